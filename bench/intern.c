@@ -0,0 +1,195 @@
+/*
+ * INTERN
+ * Contention benchmark for the symbol table and the global scope.
+ * Threads share one interpreter's symbols and globals, as tasks do,
+ * and run on 1, 2, 4, ... 64 threads:
+ *
+ *   intern : lval_intern() of names that mostly exist already
+ *   lookup : lenv_get() of globals while thread 0 keeps def-ing them
+ *
+ * usage: bench_intern [max_threads] [iterations]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "context.h"
+
+#define BENCH_NAMES     4096
+#define BENCH_GLOBALS   256
+// one in this many interns is a name no thread has made before
+#define BENCH_NEW_EVERY 8
+// thread 0 defs once every this many lookups
+#define BENCH_DEF_EVERY 64
+
+typedef struct
+{
+    int         id;
+    long        iterations;
+    lispy_ctx*  ctx;
+    char**      globals;
+    int         failed;
+} bench_job;
+
+static char bench_names[BENCH_NAMES][16];
+
+/*
+ * bench_intern()
+ */
+static void* bench_intern(void* arg)
+{
+    bench_job* job = arg;
+    lheap heap;
+    char name[32];
+
+    lheap_init(&heap, &job->ctx->heap);
+    lheap_set_current(&heap);
+
+    unsigned int seed = job->id + 1;
+    for(long i = 0; i < job->iterations; ++i)
+    {
+        if(i % BENCH_NEW_EVERY == 0)
+        {
+            snprintf(name, sizeof(name), "t%d_%ld", job->id, i);
+            lval_intern(name);
+        }
+        else
+            lval_intern(bench_names[rand_r(&seed) % BENCH_NAMES]);
+    }
+
+    lheap_set_current(NULL);
+    lheap_destroy(&heap);
+    return NULL;
+}
+
+/*
+ * bench_lookup()
+ */
+static void* bench_lookup(void* arg)
+{
+    bench_job* job = arg;
+    lheap heap;
+
+    lheap_init(&heap, &job->ctx->heap);
+    lheap_set_current(&heap);
+
+    unsigned int seed = job->id + 1;
+    lval sym = {.type = LVAL_SYM};
+    lval* num = lval_num(0);
+    for(long i = 0; i < job->iterations; ++i)
+    {
+        sym.sym = job->globals[rand_r(&seed) % BENCH_GLOBALS];
+        if(job->id == 0 && i % BENCH_DEF_EVERY == 0)
+        {
+            num->num = i;
+            lenv_def(job->ctx->env, &sym, num);
+            continue;
+        }
+
+        lval* x = lenv_get(job->ctx->env, &sym);
+        if(x->type != LVAL_NUM)
+            job->failed = 1;
+        lval_del(x);
+    }
+    lval_del(num);
+
+    lheap_set_current(NULL);
+    lheap_destroy(&heap);
+    return NULL;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * bench_time()
+ * Seconds taken by n threads running func
+ */
+static double bench_time(void* (*func)(void*), bench_job* jobs, pthread_t* threads, int n)
+{
+    double start = bench_now();
+    for(int t = 0; t < n; ++t)
+        pthread_create(&threads[t], NULL, func, &jobs[t]);
+    for(int t = 0; t < n; ++t)
+        pthread_join(threads[t], NULL);
+
+    return bench_now() - start;
+}
+
+int main(int argc, char* argv[])
+{
+    int  max_threads = (argc > 1) ? atoi(argv[1]) : 64;
+    long iterations  = (argc > 2) ? atol(argv[2]) : 200000;
+
+    if(max_threads < 1)
+        max_threads = 1;
+
+    lispy_ctx* ctx = lispy_ctx_new();
+    if(ctx == NULL)
+        return 1;
+    lispy_ctx_use(ctx);
+
+    char* globals[BENCH_GLOBALS];
+    char name[32];
+    lval* zero = lval_num(0);
+    for(int i = 0; i < BENCH_NAMES; ++i)
+    {
+        snprintf(bench_names[i], sizeof(bench_names[i]), "s%d", i);
+        lval_intern(bench_names[i]);
+    }
+    for(int i = 0; i < BENCH_GLOBALS; ++i)
+    {
+        snprintf(name, sizeof(name), "g%d", i);
+        lval* sym = lval_sym(name);
+        globals[i] = sym->sym;
+        lenv_def(ctx->env, sym, zero);
+        lval_del(sym);
+    }
+    lval_del(zero);
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * max_threads);
+    bench_job* jobs    = malloc(sizeof(bench_job) * max_threads);
+
+    fprintf(stdout, "%8s %14s %14s\n", "threads", "interns/s", "lookups/s");
+    for(int n = 1; n <= max_threads; n = (n * 2 > max_threads && n < max_threads) ? max_threads : n * 2)
+    {
+        for(int t = 0; t < n; ++t)
+        {
+            jobs[t].id         = t;
+            jobs[t].iterations = iterations;
+            jobs[t].ctx        = ctx;
+            jobs[t].globals    = globals;
+            jobs[t].failed     = 0;
+        }
+
+        double intern = bench_time(bench_intern, jobs, threads, n);
+        double lookup = bench_time(bench_lookup, jobs, threads, n);
+        // no thread is reading any more
+        lenv_reclaim(ctx->env);
+
+        for(int t = 0; t < n; ++t)
+        {
+            if(jobs[t].failed)
+            {
+                fprintf(stderr, "[%s] thread %d looked up a wrong value\n", __func__, t);
+                return 1;
+            }
+        }
+
+        fprintf(stdout, "%8d %14.0f %14.0f\n", n,
+                n * iterations / intern, n * iterations / lookup);
+    }
+
+    free(threads);
+    free(jobs);
+    lispy_ctx_del(ctx);
+
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * RUN
+ * Benchmark harness for Lispy programs. Each program is evaluated
+ * runs times, every time in a fresh interpreter, in a child process
+ * of its own so that its peak RSS is its own. Prints one JSON object
+ * per program:
+ *
+ *   {"bench": "fib", "runs": 10, "median_ms": ..., "p99_ms": ...,
+ *    "min_ms": ..., "max_ms": ..., "allocs": ..., "peak_rss_kb": ...,
+ *    "errors": 0}
+ *
+ * allocs is the number of lvals made by one run. errors counts the
+ * lines of the last run that failed to parse or evaluated to an error.
+ *
+ * usage: bench_run [-n runs] file.l...
+ */
+
+#define _GNU_SOURCE
+
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "context.h"
+
+typedef struct
+{
+    double  seconds;
+    long    allocs;
+    int     errors;
+} bench_result;
+
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench_cmp(const void* a, const void* b)
+{
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * bench_read()
+ * The lines of filename, or NULL
+ */
+static char** bench_read(const char* filename, int* num_lines)
+{
+    FILE* fp = fopen(filename, "r");
+    if(!fp)
+    {
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, filename);
+        return NULL;
+    }
+
+    char** lines = NULL;
+    char* line = NULL;
+    size_t len = 0;
+    *num_lines = 0;
+    while(getline(&line, &len, fp) != -1)
+    {
+        lines = realloc(lines, sizeof(char*) * (*num_lines + 1));
+        lines[(*num_lines)++] = strdup(line);
+    }
+    free(line);
+    fclose(fp);
+
+    return lines;
+}
+
+/*
+ * bench_once()
+ * Parse and evaluate every line in a new interpreter. Only the
+ * evaluation is timed, not making the interpreter.
+ */
+static bench_result bench_once(char** lines, int num_lines)
+{
+    bench_result r = {0.0, 0, 0};
+    lispy_ctx* ctx = lispy_ctx_new();
+    if(ctx == NULL)
+    {
+        r.errors = -1;
+        return r;
+    }
+    lispy_ctx_use(ctx);
+    lmemstats stats;
+    lheap_stats(&ctx->heap, &stats);
+    long allocs = stats.kinds[LMEM_LVAL].total;
+
+    double start = bench_now();
+    for(int i = 0; i < num_lines; ++i)
+    {
+        lval* expr = lispy_read(ctx, "<bench>", lines[i], NULL);
+        if(expr == NULL)
+        {
+            r.errors++;
+            continue;
+        }
+        lval* x = lispy_eval(ctx, expr);
+        r.errors += (x->type == LVAL_ERR);
+        lval_del(x);
+    }
+    r.seconds = bench_now() - start;
+    lheap_stats(&ctx->heap, &stats);
+    r.allocs  = stats.kinds[LMEM_LVAL].total - allocs;
+
+    lispy_ctx_use(NULL);
+    lispy_ctx_del(ctx);
+
+    return r;
+}
+
+/*
+ * bench_file()
+ * Runs in the child, prints the result
+ */
+static int bench_file(const char* filename, int runs)
+{
+    int num_lines;
+    char** lines = bench_read(filename, &num_lines);
+    if(lines == NULL)
+        return 1;
+
+    double* times = malloc(sizeof(double) * runs);
+    bench_result r;
+    for(int i = 0; i < runs; ++i)
+    {
+        r = bench_once(lines, num_lines);
+        if(r.errors < 0)
+            return 1;
+        times[i] = r.seconds * 1e3;
+    }
+    qsort(times, runs, sizeof(double), bench_cmp);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    // the name of the program is its file name without .l
+    char* copy = strdup(filename);
+    char* name = basename(copy);
+    char* dot = strrchr(name, '.');
+    if(dot != NULL)
+        *dot = '\0';
+
+    // nearest rank
+    int p99 = (int) (0.99 * runs + 0.999999) - 1;
+    double median = (runs % 2) ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    fprintf(stdout, "{\"bench\": \"%s\", \"runs\": %d, \"median_ms\": %.3f, \"p99_ms\": %.3f, "
+            "\"min_ms\": %.3f, \"max_ms\": %.3f, \"allocs\": %ld, \"peak_rss_kb\": %ld, \"errors\": %d}\n",
+            name, runs, median, times[p99 < 0 ? 0 : p99], times[0], times[runs - 1],
+            r.allocs, usage.ru_maxrss, r.errors);
+    fflush(stdout);
+
+    for(int i = 0; i < num_lines; ++i)
+        free(lines[i]);
+    free(lines);
+    free(times);
+    free(copy);
+
+    return (r.errors == 0) ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    int runs = 10;
+    int opt;
+    int status = 0;
+
+    while((opt = getopt(argc, argv, "n:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n runs] file.l...\n", argv[0]);
+                return 1;
+        }
+    }
+    if(runs < 1 || optind == argc)
+    {
+        fprintf(stderr, "usage: %s [-n runs] file.l...\n", argv[0]);
+        return 1;
+    }
+
+    fflush(stdout);
+    for(int i = optind; i < argc; ++i)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+            _exit(bench_file(argv[i], runs));
+
+        int child;
+        if(pid < 0 || waitpid(pid, &child, 0) < 0 || !WIFEXITED(child) || WEXITSTATUS(child) != 0)
+        {
+            fprintf(stderr, "[%s] %s failed\n", __func__, argv[i]);
+            status = 1;
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,116 @@
+/*
+ * THREADS
+ * Scaling benchmark for interpreter contexts. Runs the same
+ * workload on 1, 2, 4, ... threads, each thread with its own
+ * lispy_ctx, and reports how throughput scales.
+ *
+ * usage: bench_threads [max_threads] [iterations]
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "context.h"
+
+static const char* bench_prog[] = {
+    "def {fib} (\\ {n} {if (<= n 1) {n} {+ (fib (- n 1)) (fib (- n 2))}})",
+    "def {len} (\\ {l} {if (== l {}) {0} {+ 1 (len (tail l))}})",
+    NULL
+};
+static const char* bench_expr = "+ (fib 15) (len {1 2 3 4 5 6 7 8 9 10})";
+static const long  bench_expect = 620;
+
+typedef struct
+{
+    int     iterations;
+    int     failed;
+} bench_job;
+
+/*
+ * bench_run()
+ * One interpreter, start to finish
+ */
+static void* bench_run(void* arg)
+{
+    bench_job* job = arg;
+    lispy_ctx* ctx = lispy_ctx_new();
+    if(ctx == NULL)
+    {
+        job->failed = 1;
+        return NULL;
+    }
+    lispy_ctx_use(ctx);
+
+    for(int i = 0; bench_prog[i] != NULL; ++i)
+        lval_del(lispy_eval(ctx, lispy_read(ctx, "bench", bench_prog[i], NULL)));
+
+    for(int i = 0; i < job->iterations; ++i)
+    {
+        lval* x = lispy_eval(ctx, lispy_read(ctx, "bench", bench_expr, NULL));
+        if(x->type != LVAL_NUM || x->num != bench_expect)
+            job->failed = 1;
+        lval_del(x);
+    }
+
+    lispy_ctx_del(ctx);
+    return NULL;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char* argv[])
+{
+    int max_threads = (argc > 1) ? atoi(argv[1]) : sysconf(_SC_NPROCESSORS_ONLN);
+    int iterations  = (argc > 2) ? atoi(argv[2]) : 50;
+    double base = 0.0;
+
+    if(max_threads < 1)
+        max_threads = 1;
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * max_threads);
+    bench_job* jobs    = malloc(sizeof(bench_job) * max_threads);
+
+    fprintf(stdout, "%8s %10s %12s %8s %10s\n", "threads", "seconds", "evals/s", "speedup", "efficiency");
+    for(int n = 1; n <= max_threads; n = (n * 2 > max_threads && n < max_threads) ? max_threads : n * 2)
+    {
+        double start = bench_now();
+        for(int t = 0; t < n; ++t)
+        {
+            jobs[t].iterations = iterations;
+            jobs[t].failed     = 0;
+            pthread_create(&threads[t], NULL, bench_run, &jobs[t]);
+        }
+        for(int t = 0; t < n; ++t)
+            pthread_join(threads[t], NULL);
+        double secs = bench_now() - start;
+
+        for(int t = 0; t < n; ++t)
+        {
+            if(jobs[t].failed)
+            {
+                fprintf(stderr, "[%s] thread %d got a wrong result\n", __func__, t);
+                return 1;
+            }
+        }
+
+        double rate = (double) n * iterations / secs;
+        if(n == 1)
+            base = rate;
+        fprintf(stdout, "%8d %10.3f %12.1f %8.2f %9.0f%%\n",
+                n, secs, rate, rate / base, 100.0 * rate / base / n);
+    }
+
+    free(threads);
+    free(jobs);
+
+    return 0;
+}
@@ -0,0 +1,1083 @@
+/*
+ * ACTOR
+ * Actor processes, mailboxes and nodes
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "context.h"
+#include "actor.h"
+#include "snapshot.h"
+
+/*
+ * WIRE
+ * Nodes talk in frames of u32 len, u8 op, i64 target and then len
+ * bytes of payload, in native byte order since both ends are on the
+ * same machine.
+ *
+ *   SEND   target is a mailbox id, the payload a message
+ *   SPAWN  the payload is an actor (see lactor_pack()), answered
+ *          with a REPLY whose target is the new id, or -1
+ */
+#define LACTOR_HEADER   13
+
+typedef enum
+{
+    LACTOR_OP_SEND = 1,
+    LACTOR_OP_SPAWN,
+    LACTOR_OP_REPLY
+} lactor_op;
+
+// outgoing connection to another node, kept for sends
+typedef struct lactor_conn
+{
+    char                node[LACTOR_NAME_MAX];
+    int                 fd;
+    pthread_mutex_t     lock;
+    struct lactor_conn* next;
+} lactor_conn;
+
+// an actor waiting for its thread
+typedef struct
+{
+    lmailbox*   box;
+    char*       data;
+    size_t      len;
+} lactor_job;
+
+static pthread_mutex_t lactor_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static lmailbox*       lactor_registry[LACTOR_BUCKETS];
+static long            lactor_next_id = 1;
+
+static pthread_once_t  lactor_name_once = PTHREAD_ONCE_INIT;
+static char            lactor_name[LACTOR_NAME_MAX];
+static pthread_mutex_t lactor_listen_lock = PTHREAD_MUTEX_INITIALIZER;
+static char            lactor_path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+static int             lactor_listening = 0;
+
+static pthread_mutex_t lactor_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static lactor_conn*    lactor_conns = NULL;
+
+
+/*
+ * lactor_now()
+ * Monotonic time in microseconds
+ */
+static long lactor_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * lactor_root()
+ */
+static lenv* lactor_root(lenv* env)
+{
+    while(env->parent != NULL)
+        env = env->parent;
+
+    return env;
+}
+
+
+// ======== MAILBOX ======== //
+
+/*
+ * lmailbox_new()
+ */
+lmailbox* lmailbox_new(void)
+{
+    lmailbox* box = malloc(sizeof(*box));
+    if(!box)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for mailbox\n", __func__, sizeof(*box));
+        return NULL;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&box->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&box->lock, NULL);
+    box->head   = NULL;
+    box->tail   = NULL;
+    box->closed = 0;
+    box->refs   = 2;    // the caller's and the registry's
+
+    pthread_mutex_lock(&lactor_registry_lock);
+    box->id   = lactor_next_id++;
+    box->next = lactor_registry[box->id % LACTOR_BUCKETS];
+    lactor_registry[box->id % LACTOR_BUCKETS] = box;
+    pthread_mutex_unlock(&lactor_registry_lock);
+
+    return box;
+}
+
+/*
+ * lmailbox_release()
+ */
+void lmailbox_release(lmailbox* box)
+{
+    if(__atomic_sub_fetch(&box->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    while(box->head != NULL)
+    {
+        lmsg* m = box->head;
+        box->head = m->next;
+        free(m->data);
+        free(m);
+    }
+    pthread_cond_destroy(&box->cond);
+    pthread_mutex_destroy(&box->lock);
+    free(box);
+}
+
+/*
+ * lmailbox_close()
+ */
+void lmailbox_close(lmailbox* box)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&lactor_registry_lock);
+    for(lmailbox** p = &lactor_registry[box->id % LACTOR_BUCKETS]; *p != NULL; p = &(*p)->next)
+    {
+        if(*p == box)
+        {
+            *p = box->next;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lactor_registry_lock);
+
+    pthread_mutex_lock(&box->lock);
+    box->closed = 1;
+    while(box->head != NULL)
+    {
+        lmsg* m = box->head;
+        box->head = m->next;
+        free(m->data);
+        free(m);
+    }
+    box->tail = NULL;
+    pthread_mutex_unlock(&box->lock);
+
+    if(found)
+        lmailbox_release(box);
+}
+
+/*
+ * lmailbox_find()
+ * The mailbox registered under id with a reference for the caller,
+ * or NULL.
+ */
+static lmailbox* lmailbox_find(long id)
+{
+    lmailbox* box;
+
+    pthread_mutex_lock(&lactor_registry_lock);
+    box = lactor_registry[id % LACTOR_BUCKETS];
+    while(box != NULL && box->id != id)
+        box = box->next;
+    if(box != NULL)
+        __atomic_add_fetch(&box->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lactor_registry_lock);
+
+    return box;
+}
+
+/*
+ * lmailbox_post()
+ * Queue data (which the mailbox takes) for the actor with id. Drops
+ * it if there is no such actor.
+ */
+static void lmailbox_post(long id, char* data, size_t len)
+{
+    lmailbox* box = (id > 0) ? lmailbox_find(id) : NULL;
+    lmsg* m = malloc(sizeof(*m));
+
+    if(box == NULL || m == NULL)
+    {
+        free(data);
+        free(m);
+        if(box != NULL)
+            lmailbox_release(box);
+        return;
+    }
+    m->data = data;
+    m->len  = len;
+    m->next = NULL;
+
+    pthread_mutex_lock(&box->lock);
+    if(box->closed)
+    {
+        free(m->data);
+        free(m);
+    }
+    else
+    {
+        if(box->tail != NULL)
+            box->tail->next = m;
+        else
+            box->head = m;
+        box->tail = m;
+        pthread_cond_signal(&box->cond);
+    }
+    pthread_mutex_unlock(&box->lock);
+    lmailbox_release(box);
+}
+
+/*
+ * lmailbox_take()
+ * The oldest message, or NULL if nothing arrives before deadline
+ * (in lactor_now() time). Waits no longer than that, and not at all
+ * if deadline has passed.
+ */
+static lmsg* lmailbox_take(lmailbox* box, long deadline)
+{
+    lmsg* m;
+
+    pthread_mutex_lock(&box->lock);
+    while(box->head == NULL && deadline > lactor_now())
+    {
+        struct timespec ts = {deadline / 1000000, (deadline % 1000000) * 1000};
+        pthread_cond_timedwait(&box->cond, &box->lock, &ts);
+    }
+    m = box->head;
+    if(m != NULL)
+    {
+        box->head = m->next;
+        if(box->head == NULL)
+            box->tail = NULL;
+    }
+    pthread_mutex_unlock(&box->lock);
+
+    return m;
+}
+
+
+// ======== NODES ======== //
+
+/*
+ * lactor_name_init()
+ */
+static void lactor_name_init(void)
+{
+    if(lactor_name[0] == '\0')
+        snprintf(lactor_name, sizeof(lactor_name), "n%d", (int) getpid());
+}
+
+/*
+ * lactor_node()
+ */
+const char* lactor_node(void)
+{
+    pthread_once(&lactor_name_once, lactor_name_init);
+
+    return lactor_name;
+}
+
+/*
+ * lactor_user_dir()
+ * /tmp/lispy-<uid>, made if needed. Returns -1 unless it is a
+ * directory that only the calling user can get into, since anyone
+ * who can reach a socket there can run code on its node.
+ */
+static int lactor_user_dir(char* dir, size_t size)
+{
+    struct stat st;
+
+    snprintf(dir, size, "/tmp/lispy-%ld", (long) geteuid());
+    if(mkdir(dir, 0700) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "[%s] failed to make [%s]: %s\n", __func__, dir, strerror(errno));
+        return -1;
+    }
+    if(lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0)
+    {
+        fprintf(stderr, "[%s] [%s] is not a private directory of this user\n", __func__, dir);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * lactor_addr()
+ * Returns -1 if the socket path for node does not fit, or the node
+ * directory is not safe to use
+ */
+static int lactor_addr(const char* node, struct sockaddr_un* addr)
+{
+    char user_dir[64];
+    const char* dir = getenv("LISPY_NODE_DIR");
+    if(dir == NULL || dir[0] == '\0')
+    {
+        if(lactor_user_dir(user_dir, sizeof(user_dir)) != 0)
+            return -1;
+        dir = user_dir;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    size_t n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/lispy-%s.sock", dir, node);
+    if(n >= sizeof(addr->sun_path))
+    {
+        fprintf(stderr, "[%s] socket path for node '%s' is too long\n", __func__, node);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * lactor_connect()
+ * Returns a socket connected to node, or -1
+ */
+static int lactor_connect(const char* node)
+{
+    struct sockaddr_un addr;
+    if(lactor_addr(node, &addr) != 0)
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    if(connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/*
+ * lactor_write()
+ */
+static int lactor_write(int fd, const void* src, size_t n)
+{
+    const char* p = src;
+    while(n > 0)
+    {
+        ssize_t k = send(fd, p, n, MSG_NOSIGNAL);
+        if(k < 0 && errno == EINTR)
+            continue;
+        if(k <= 0)
+            return -1;
+        p += k;
+        n -= k;
+    }
+
+    return 0;
+}
+
+/*
+ * lactor_read()
+ */
+static int lactor_read(int fd, void* dst, size_t n)
+{
+    char* p = dst;
+    while(n > 0)
+    {
+        ssize_t k = recv(fd, p, n, 0);
+        if(k < 0 && errno == EINTR)
+            continue;
+        if(k <= 0)
+            return -1;
+        p += k;
+        n -= k;
+    }
+
+    return 0;
+}
+
+/*
+ * lactor_write_frame()
+ */
+static int lactor_write_frame(int fd, lactor_op op, int64_t target, const char* data, uint32_t len)
+{
+    char head[LACTOR_HEADER];
+    uint8_t code = op;
+
+    memcpy(head, &len, 4);
+    memcpy(head + 4, &code, 1);
+    memcpy(head + 5, &target, 8);
+    if(lactor_write(fd, head, sizeof(head)) != 0)
+        return -1;
+
+    return (len > 0) ? lactor_write(fd, data, len) : 0;
+}
+
+/*
+ * lactor_read_frame()
+ * On success *data is a malloc'd payload of *len bytes
+ */
+static int lactor_read_frame(int fd, lactor_op* op, int64_t* target, char** data, uint32_t* len)
+{
+    char head[LACTOR_HEADER];
+    uint8_t code;
+
+    if(lactor_read(fd, head, sizeof(head)) != 0)
+        return -1;
+    memcpy(len, head, 4);
+    memcpy(&code, head + 4, 1);
+    memcpy(target, head + 5, 8);
+    *op = code;
+
+    *data = malloc(*len > 0 ? *len : 1);
+    if(*data == NULL || lactor_read(fd, *data, *len) != 0)
+    {
+        free(*data);
+        return -1;
+    }
+
+    return 0;
+}
+
+static long lactor_start(char* data, size_t len);
+
+/*
+ * lactor_serve_conn()
+ * Handle the frames from one connection until it closes
+ */
+static void* lactor_serve_conn(void* arg)
+{
+    int fd = (int) (intptr_t) arg;
+    lactor_op op;
+    int64_t target;
+    char* data;
+    uint32_t len;
+
+    while(lactor_read_frame(fd, &op, &target, &data, &len) == 0)
+    {
+        switch(op)
+        {
+            case LACTOR_OP_SEND:
+                lmailbox_post(target, data, len);
+                break;
+            case LACTOR_OP_SPAWN:
+                target = lactor_start(data, len);
+                lactor_write_frame(fd, LACTOR_OP_REPLY, target, NULL, 0);
+                break;
+            default:
+                free(data);
+                break;
+        }
+    }
+    close(fd);
+
+    return NULL;
+}
+
+/*
+ * lactor_accept()
+ */
+static void* lactor_accept(void* arg)
+{
+    int fd = (int) (intptr_t) arg;
+
+    while(1)
+    {
+        int conn = accept(fd, NULL, NULL);
+        if(conn < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "[%s] node '%s' stopped listening: %s\n", __func__, lactor_node(), strerror(errno));
+            return NULL;
+        }
+
+        // a SPAWN runs code here, so only our own user gets in
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if(getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != geteuid())
+        {
+            fprintf(stderr, "[%s] node '%s' refused a connection from another user\n", __func__, lactor_node());
+            close(conn);
+            continue;
+        }
+
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, lactor_serve_conn, (void*) (intptr_t) conn) != 0)
+            close(conn);
+        else
+            pthread_detach(thread);
+    }
+}
+
+/*
+ * lactor_stop()
+ * Only unlink(), so that signal handlers can call it
+ */
+void lactor_stop(void)
+{
+    if(lactor_path[0] != '\0')
+        unlink(lactor_path);
+}
+
+/*
+ * lactor_listen()
+ * Start listening (once) so that other nodes can reach the actors
+ * here. Returns 0 if listening.
+ */
+static int lactor_listen(void)
+{
+    struct sockaddr_un addr;
+    int status = -1;
+
+    pthread_mutex_lock(&lactor_listen_lock);
+    if(lactor_listening)
+    {
+        pthread_mutex_unlock(&lactor_listen_lock);
+        return 0;
+    }
+    if(lactor_addr(lactor_node(), &addr) != 0)
+        goto LISTEN_END;
+
+    // a socket someone still answers on belongs to a live node
+    int fd = lactor_connect(lactor_node());
+    if(fd >= 0)
+    {
+        fprintf(stderr, "[%s] node '%s' is already running\n", __func__, lactor_node());
+        close(fd);
+        goto LISTEN_END;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        goto LISTEN_END;
+    unlink(addr.sun_path);
+    if(bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, SOMAXCONN) != 0)
+    {
+        fprintf(stderr, "[%s] failed to listen on [%s]: %s\n", __func__, addr.sun_path, strerror(errno));
+        close(fd);
+        goto LISTEN_END;
+    }
+    strcpy(lactor_path, addr.sun_path);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, lactor_accept, (void*) (intptr_t) fd) != 0)
+    {
+        close(fd);
+        lactor_stop();
+        lactor_path[0] = '\0';
+        goto LISTEN_END;
+    }
+    pthread_detach(thread);
+
+    __atomic_store_n(&lactor_listening, 1, __ATOMIC_RELAXED);
+    status = 0;
+
+LISTEN_END:
+    pthread_mutex_unlock(&lactor_listen_lock);
+
+    return status;
+}
+
+/*
+ * lactor_serve()
+ */
+int lactor_serve(const char* name)
+{
+    if(name[0] == '\0' || strlen(name) >= LACTOR_NAME_MAX || strchr(name, '/') != NULL)
+    {
+        fprintf(stderr, "[%s] invalid node name '%s'\n", __func__, name);
+        return -1;
+    }
+    strcpy(lactor_name, name);
+    lactor_node();
+
+    return lactor_listen();
+}
+
+/*
+ * lactor_send_remote()
+ * Send a message over the connection kept for node, making it (or
+ * making it again, if node was restarted) as needed.
+ */
+static int lactor_send_remote(const char* node, long id, const char* data, size_t len)
+{
+    lactor_conn* conn;
+
+    if(lactor_listen() != 0)
+        return -1;
+
+    pthread_mutex_lock(&lactor_conns_lock);
+    for(conn = lactor_conns; conn != NULL; conn = conn->next)
+    {
+        if(strcmp(conn->node, node) == 0)
+            break;
+    }
+    if(conn == NULL)
+    {
+        conn = malloc(sizeof(*conn));
+        snprintf(conn->node, sizeof(conn->node), "%s", node);
+        conn->fd = -1;
+        pthread_mutex_init(&conn->lock, NULL);
+        conn->next = lactor_conns;
+        lactor_conns = conn;
+    }
+    pthread_mutex_unlock(&lactor_conns_lock);
+
+    int status = -1;
+    pthread_mutex_lock(&conn->lock);
+    for(int attempt = 0; attempt < 2 && status != 0; ++attempt)
+    {
+        if(conn->fd < 0)
+            conn->fd = lactor_connect(node);
+        if(conn->fd < 0)
+            break;
+        status = lactor_write_frame(conn->fd, LACTOR_OP_SEND, id, data, len);
+        if(status != 0)
+        {
+            close(conn->fd);
+            conn->fd = -1;
+        }
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    return status;
+}
+
+/*
+ * lactor_spawn_remote()
+ * Start an actor on node. Returns its id, or -1.
+ */
+static long lactor_spawn_remote(const char* node, const char* data, size_t len)
+{
+    lactor_op op;
+    int64_t id = -1;
+    uint32_t n;
+    char* reply;
+
+    if(lactor_listen() != 0)
+        return -1;
+
+    int fd = lactor_connect(node);
+    if(fd < 0)
+        return -1;
+    if(lactor_write_frame(fd, LACTOR_OP_SPAWN, 0, data, len) != 0 ||
+       lactor_read_frame(fd, &op, &id, &reply, &n) != 0)
+        id = -1;
+    else
+    {
+        if(op != LACTOR_OP_REPLY)
+            id = -1;
+        free(reply);
+    }
+    close(fd);
+
+    return id;
+}
+
+/*
+ * lactor_node_up()
+ */
+static int lactor_node_up(const char* node)
+{
+    if(strcmp(node, lactor_node()) == 0)
+        return __atomic_load_n(&lactor_listening, __ATOMIC_RELAXED);
+
+    int fd = lactor_connect(node);
+    if(fd < 0)
+        return 0;
+    close(fd);
+
+    return 1;
+}
+
+
+// ======== ACTORS ======== //
+
+/*
+ * lactor_bind_self()
+ */
+void lactor_bind_self(lenv* env, lmailbox* box)
+{
+    lval* sym = lval_sym("self");
+    lval* pid = lval_pid(lactor_node(), box->id);
+    lenv_put(env, sym, pid);
+    lval_del(sym);
+    lval_del(pid);
+}
+
+/*
+ * lactor_pack()
+ * An actor is the globals it starts with, the locals it was spawned
+ * with and its body, each as u32 len and then a snapshot. Takes the
+ * parts.
+ */
+static char* lactor_pack(char* parts[3], size_t lens[3], size_t* len)
+{
+    char* data = NULL;
+
+    *len = 0;
+    for(int i = 0; i < 3; ++i)
+        *len += sizeof(uint32_t) + lens[i];
+    if(parts[0] && parts[1] && parts[2])
+        data = malloc(*len);
+
+    if(data != NULL)
+    {
+        char* p = data;
+        for(int i = 0; i < 3; ++i)
+        {
+            uint32_t n = lens[i];
+            memcpy(p, &n, sizeof(n));
+            memcpy(p + sizeof(n), parts[i], n);
+            p += sizeof(n) + n;
+        }
+    }
+    for(int i = 0; i < 3; ++i)
+        free(parts[i]);
+
+    return data;
+}
+
+/*
+ * lactor_unpack()
+ * Returns -1 if data is not three parts
+ */
+static int lactor_unpack(const char* data, size_t len, const char* parts[3], size_t lens[3])
+{
+    size_t pos = 0;
+
+    for(int i = 0; i < 3; ++i)
+    {
+        uint32_t n;
+        if(len - pos < sizeof(n))
+            return -1;
+        memcpy(&n, data + pos, sizeof(n));
+        pos += sizeof(n);
+        if(len - pos < n)
+            return -1;
+        parts[i] = data + pos;
+        lens[i]  = n;
+        pos += n;
+    }
+
+    return (pos == len) ? 0 : -1;
+}
+
+/*
+ * lactor_main()
+ * Body of an actor thread. The actor gets an interpreter of its own
+ * and takes over the mailbox that its pid already names.
+ */
+static void* lactor_main(void* arg)
+{
+    lactor_job* job = arg;
+    const char* parts[3];
+    size_t lens[3];
+
+    lispy_ctx* ctx = lispy_ctx_new();
+    if(ctx != NULL)
+    {
+        lispy_ctx_use(ctx);
+        lmailbox_close(ctx->mailbox);
+        lmailbox_release(ctx->mailbox);
+        ctx->mailbox = job->box;
+        job->box = NULL;
+
+        lval* body = NULL;
+        lactor_unpack(job->data, job->len, parts, lens);
+        if(lenv_snapshot_restore(ctx->env, parts[0], lens[0], "<actor globals>") == 0 &&
+           lenv_snapshot_restore(ctx->env, parts[1], lens[1], "<actor locals>") == 0)
+            body = lval_snapshot_restore(ctx->env, parts[2], lens[2]);
+
+        if(body != NULL)
+        {
+            lactor_bind_self(ctx->env, ctx->mailbox);
+            body->type = LVAL_SEXPR;
+            lval* x = lval_eval(ctx->env, body);
+            if(x->type == LVAL_ERR)
+                fprintf(stderr, "[%s] actor <pid %s:%li> failed: %s\n",
+                        __func__, lactor_node(), ctx->mailbox->id, x->err);
+            lval_del(x);
+        }
+        lispy_ctx_use(NULL);
+        lispy_ctx_del(ctx);
+    }
+
+    if(job->box != NULL)
+    {
+        lmailbox_close(job->box);
+        lmailbox_release(job->box);
+    }
+    free(job->data);
+    free(job);
+
+    return NULL;
+}
+
+/*
+ * lactor_start()
+ * Start a local actor from packed data (which it takes). Returns its
+ * id, or -1.
+ */
+static long lactor_start(char* data, size_t len)
+{
+    const char* parts[3];
+    size_t lens[3];
+    lactor_job* job = NULL;
+    lmailbox* box = NULL;
+    pthread_t thread;
+
+    if(lactor_unpack(data, len, parts, lens) != 0)
+        goto START_FAIL;
+    job = malloc(sizeof(*job));
+    box = lmailbox_new();
+    if(job == NULL || box == NULL)
+        goto START_FAIL;
+    job->box  = box;
+    job->data = data;
+    job->len  = len;
+
+    long id = box->id;
+    if(pthread_create(&thread, NULL, lactor_main, job) != 0)
+        goto START_FAIL;
+    pthread_detach(thread);
+
+    return id;
+
+START_FAIL:
+    if(box != NULL)
+    {
+        lmailbox_close(box);
+        lmailbox_release(box);
+    }
+    free(job);
+    free(data);
+
+    return -1;
+}
+
+
+// ======== BUILTINS ======== //
+
+/*
+ * builtin_spawn_actor()
+ * (spawn-actor {expr}) or (spawn-actor {node} {expr}) -> the pid of
+ * a new actor evaluating expr, here or on node. The actor starts with
+ * a copy of the globals and the local variables of its spawner, less
+ * any futures and channels.
+ */
+lval* builtin_spawn_actor(lenv* env, lval* val)
+{
+    LVAL_ASSERT(val, val->count == 1 || val->count == 2,
+            "[%s] Function 'spawn-actor' passed incorrect number of args. Got %i, expected 1 or 2",
+            __func__, val->count
+    );
+    for(int i = 0; i < val->count; ++i)
+        LVAL_ASSERT_TYPE("spawn-actor", val, i, LVAL_QEXPR);
+
+    char node[LACTOR_NAME_MAX];
+    snprintf(node, sizeof(node), "%s", lactor_node());
+    if(val->count == 2)
+    {
+        lval* n = val->cell[0];
+        LVAL_ASSERT(val, n->count == 1 && n->cell[0]->type == LVAL_SYM,
+                "[%s] Function 'spawn-actor': node must be a single symbol", __func__
+        );
+        snprintf(node, sizeof(node), "%s", n->cell[0]->sym);
+    }
+
+    lenv* root = lactor_root(env);
+    lenv* locals = lenv_capture(env);
+    char* parts[3];
+    size_t lens[3];
+    size_t len;
+
+    parts[0] = lenv_snapshot_dump(root, 1, &lens[0]);
+    parts[1] = lenv_snapshot_dump(locals, 1, &lens[1]);
+    parts[2] = lval_snapshot_dump(val->cell[val->count - 1], root, &lens[2]);
+    lenv_del(locals);
+    lval_del(val);
+
+    char* data = lactor_pack(parts, lens, &len);
+    if(data == NULL)
+        return lval_err("[%s] Function 'spawn-actor': expression cannot be copied to an actor", __func__);
+
+    long id;
+    if(strcmp(node, lactor_node()) == 0)
+        id = lactor_start(data, len);
+    else
+    {
+        id = lactor_spawn_remote(node, data, len);
+        free(data);
+    }
+    if(id < 0)
+        return lval_err("[%s] Function 'spawn-actor': failed to start actor on node '%s'", __func__, node);
+
+    return lval_pid(node, id);
+}
+
+/*
+ * builtin_send_msg()
+ * (send! pid x) -> (). A copy of x goes to the mailbox of pid. If
+ * the actor has finished it is dropped.
+ */
+lval* builtin_send_msg(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("send!", val, 2);
+    LVAL_ASSERT_TYPE("send!", val, 0, LVAL_PID);
+
+    lval* pid = val->cell[0];
+    size_t len;
+    char* data = lval_snapshot_dump(val->cell[1], lactor_root(env), &len);
+    LVAL_ASSERT(val, data != NULL,
+            "[%s] Function 'send!': %s cannot be sent to an actor", __func__, lval_type_str(val->cell[1]->type)
+    );
+
+    if(strcmp(pid->sym, lactor_node()) == 0)
+        lmailbox_post(pid->num, data, len);
+    else
+    {
+        int status = lactor_send_remote(pid->sym, pid->num, data, len);
+        free(data);
+        LVAL_ASSERT(val, status == 0,
+                "[%s] Function 'send!': node '%s' is unreachable", __func__, pid->sym
+        );
+    }
+    lval_del(val);
+
+    return lval_sexpr();
+}
+
+/*
+ * builtin_receive()
+ * (receive ms) -> the oldest message in the mailbox of this actor,
+ * waiting up to ms milliseconds (forever if ms is negative) for one.
+ * Returns () on timeout. Other fibers run while it waits.
+ */
+lval* builtin_receive(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("receive", val, 1);
+    LVAL_ASSERT_TYPE("receive", val, 0, LVAL_NUM);
+
+    lispy_ctx* ctx = lispy_ctx_current();
+    LVAL_ASSERT(val, ctx != NULL && ctx->mailbox != NULL && !ltask_active() && !lpool_active(),
+            "[%s] Function 'receive': only an actor's own thread can receive", __func__
+    );
+
+    long ms = val->cell[0]->num;
+    long deadline = (ms < 0) ? -1 : lactor_now() + ms * 1000;
+    lval_del(val);
+
+    // no later than the timeout of the evaluation, see lbudget_deadline()
+    long timeout = lbudget_deadline();
+    if(timeout > 0 && (deadline < 0 || (timeout + 999) / 1000 < deadline))
+        deadline = (timeout + 999) / 1000;
+
+    lmsg* m;
+    int spins = 0;
+    while((m = lmailbox_take(ctx->mailbox, 0)) == NULL)
+    {
+        long now = lactor_now();
+        if(deadline >= 0 && now >= deadline)
+            break;
+        // a fiber here may be the sender
+        if(lfiber_pause() && ++spins < LACTOR_SPINS)
+            continue;
+        spins = 0;
+
+        long until = now + LACTOR_NAP_US;
+        if(ctx->fibers == NULL || ctx->fibers->count == 0)
+            until = (deadline >= 0) ? deadline : now + 1000000;
+        if(deadline >= 0 && until > deadline)
+            until = deadline;
+        if((m = lmailbox_take(ctx->mailbox, until)) != NULL)
+            break;
+    }
+    if(m == NULL)
+    {
+        lval* err = lbudget_timed_out();
+        return (err != NULL) ? err : lval_sexpr();
+    }
+
+    lval* x = lval_snapshot_restore(ctx->env, m->data, m->len);
+    free(m->data);
+    free(m);
+    if(x == NULL)
+        return lval_err("[%s] Function 'receive': message is corrupt", __func__);
+
+    return x;
+}
+
+/*
+ * builtin_nodes()
+ * (nodes {}) -> {n1 n2 ...}, the nodes running on this machine.
+ * (nodes {n1 n2 ...}) -> those of n1 n2 ... that are running.
+ */
+lval* builtin_nodes(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("nodes", val, 1);
+    LVAL_ASSERT_TYPE("nodes", val, 0, LVAL_QEXPR);
+
+    lval* names = val->cell[0];
+    for(int i = 0; i < names->count; ++i)
+    {
+        LVAL_ASSERT(val, names->cell[i]->type == LVAL_SYM,
+                "[%s] Function 'nodes': incorrect type for node %i. Got %s, expected %s.",
+                __func__, i, lval_type_str(names->cell[i]->type), lval_type_str(LVAL_SYM)
+        );
+    }
+
+    lval* up = lval_qexpr();
+    if(names->count > 0)
+    {
+        for(int i = 0; i < names->count; ++i)
+        {
+            if(lactor_node_up(names->cell[i]->sym))
+                up = lval_add(up, lval_sym(names->cell[i]->sym));
+        }
+        lval_del(val);
+        return up;
+    }
+    lval_del(val);
+
+    struct sockaddr_un addr;
+    if(lactor_addr("", &addr) != 0)
+        return up;
+    // the directory part of the path for the node named ""
+    *strrchr(addr.sun_path, '/') = '\0';
+
+    DIR* dir = opendir(addr.sun_path);
+    if(dir == NULL)
+        return up;
+    struct dirent* ent;
+    while((ent = readdir(dir)) != NULL)
+    {
+        size_t n = strlen(ent->d_name);
+        if(n <= 11 || n - 11 >= LACTOR_NAME_MAX ||
+           strncmp(ent->d_name, "lispy-", 6) != 0 || strcmp(ent->d_name + n - 5, ".sock") != 0)
+            continue;
+
+        char node[LACTOR_NAME_MAX];
+        memcpy(node, ent->d_name + 6, n - 11);
+        node[n - 11] = '\0';
+        if(lactor_node_up(node))
+            up = lval_add(up, lval_sym(node));
+    }
+    closedir(dir);
+
+    return up;
+}
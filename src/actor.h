@@ -0,0 +1,100 @@
+/*
+ * ACTOR
+ * Actor processes. An actor is an interpreter context of its own
+ * (see lispy.h) on a thread of its own, so it shares no environment
+ * or heap with anything else and only talks to other actors through
+ * its mailbox. Messages are deep copies: they are encoded with the
+ * snapshot format (see snapshot.h) by the sender and decoded into
+ * the heap of the receiver, which is also how they travel between
+ * processes.
+ *
+ * A node is one process. Nodes on the same machine find each other
+ * through a Unix domain socket per node, $LISPY_NODE_DIR/lispy-<name>.sock
+ * ($LISPY_NODE_DIR defaults to /tmp/lispy-<uid>, which is made private
+ * to the user). A node only accepts connections from processes of its
+ * own user.
+ */
+
+#ifndef __BYOL_ACTOR_H
+#define __BYOL_ACTOR_H
+
+#include <pthread.h>
+#include "lval.h"
+
+// mailboxes by id, see lmailbox_new()
+#define LACTOR_BUCKETS      256
+#define LACTOR_NAME_MAX     64
+// receives from a fiber yield this many times before waiting
+#define LACTOR_SPINS        64
+#define LACTOR_NAP_US       1000
+
+/*
+ * MESSAGE
+ * An encoded value, see lval_snapshot_dump()
+ */
+typedef struct lmsg
+{
+    char*           data;
+    size_t          len;
+    struct lmsg*    next;
+} lmsg;
+
+/*
+ * MAILBOX
+ * Messages waiting for an actor, oldest first. Each mailbox is in
+ * the registry of this process under an id that is never reused, so
+ * a message for an actor that has finished is simply dropped.
+ */
+typedef struct lmailbox
+{
+    long                id;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    lmsg*               head;
+    lmsg*               tail;
+    int                 closed;
+    int                 refs;
+    struct lmailbox*    next;       // in its registry bucket
+} lmailbox;
+
+/*
+ * lmailbox_new()
+ * A new registered mailbox, holding one reference.
+ */
+lmailbox*   lmailbox_new(void);
+/*
+ * lmailbox_close()
+ * Take box out of the registry and drop anything still in it.
+ */
+void        lmailbox_close(lmailbox* box);
+void        lmailbox_release(lmailbox* box);
+
+/*
+ * lactor_node()
+ * The name of this node. Unless lactor_serve() says otherwise it is
+ * n<process id>.
+ */
+const char* lactor_node(void);
+/*
+ * lactor_serve()
+ * Name this node and start listening for other nodes. Must come
+ * before the first interpreter is made. Returns 0, or -1 if the name
+ * is taken or the socket cannot be made.
+ */
+int         lactor_serve(const char* name);
+/*
+ * lactor_stop()
+ * Remove the socket of this node, if it is listening, so that other
+ * nodes no longer find it. The library installs no handlers of its
+ * own: a program that listens (see lactor_serve(), and also any remote
+ * send or spawn) calls this at exit and from its signal handlers.
+ */
+void        lactor_stop(void);
+/*
+ * lactor_bind_self()
+ * Bind self in the global scope env to the pid of box.
+ */
+void        lactor_bind_self(lenv* env, lmailbox* box);
+
+
+#endif /*__BYOL_ACTOR_H*/
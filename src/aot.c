@@ -0,0 +1,682 @@
+/*
+ * AOT
+ * Lispy to C
+ */
+
+#define _GNU_SOURCE
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "context.h"
+#include "aot.h"
+
+/*
+ * DEFINITION
+ * One candidate for compilation. Values are owned by the list.
+ */
+typedef struct
+{
+    const char* name;       // interned
+    lval*       formals;    // Q-Expression of symbols
+    lval*       body;       // Q-Expression
+    int         ok;         // still compilable
+} laot_def;
+
+typedef struct
+{
+    laot_def*   defs;
+    int         count;
+    lval*       names;      // every name the file defines, as symbols
+} laot_unit;
+
+// operators that fold over one or more numbers
+static const char* laot_folds[] = {"+", "-", "*", "/", "%", "^", "min", "max", NULL};
+// operators on exactly two numbers
+static const char* laot_cmps[]  = {"<", ">", "<=", ">=", "==", "!=", NULL};
+
+static int laot_list(laot_unit* u, laot_def* d, lval* list, lbuf* b);
+
+
+/*
+ * laot_is()
+ * s is one of the names in list
+ */
+static int laot_is(const char* s, const char** list)
+{
+    for(int i = 0; list[i] != NULL; ++i)
+    {
+        if(strcmp(s, list[i]) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * laot_defined()
+ * The file binds name itself, so it cannot be taken for a builtin
+ */
+static int laot_defined(laot_unit* u, const char* name)
+{
+    for(int i = 0; i < u->names->count; ++i)
+    {
+        if(strcmp(u->names->cell[i]->sym, name) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+static laot_def* laot_find(laot_unit* u, const char* name)
+{
+    for(int i = 0; i < u->count; ++i)
+    {
+        if(strcmp(u->defs[i].name, name) == 0)
+            return &u->defs[i];
+    }
+
+    return NULL;
+}
+
+/*
+ * laot_put_name()
+ * A C identifier for a Lispy name: letters and digits are kept, any
+ * other character is written as _ and its hex code.
+ */
+static void laot_put_name(lbuf* b, const char* prefix, const char* name)
+{
+    static const char* hex = "0123456789abcdef";
+
+    lbuf_puts(b, prefix);
+    for(const unsigned char* c = (const unsigned char*) name; *c; ++c)
+    {
+        if((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9'))
+            lbuf_putc(b, *c);
+        else
+        {
+            lbuf_putc(b, '_');
+            lbuf_putc(b, hex[*c >> 4]);
+            lbuf_putc(b, hex[*c & 15]);
+        }
+    }
+}
+
+/*
+ * laot_put_string()
+ * name as a C string literal
+ */
+static void laot_put_string(lbuf* b, const char* name)
+{
+    lbuf_putc(b, '"');
+    for(const char* c = name; *c; ++c)
+    {
+        if(*c == '"' || *c == '\\')
+            lbuf_putc(b, '\\');
+        lbuf_putc(b, *c);
+    }
+    lbuf_putc(b, '"');
+}
+
+// ======== EXPRESSIONS ======== //
+
+/*
+ * laot_value()
+ * Write v, evaluated, as a C expression of type long. Returns 0 if v
+ * is not known to evaluate to a number.
+ */
+static int laot_value(laot_unit* u, laot_def* d, lval* v, lbuf* b)
+{
+    switch(v->type)
+    {
+        case LVAL_NUM:
+            // LONG_MIN has no literal of its own
+            lbuf_putc(b, '(');
+            if(v->num == LONG_MIN)
+                lbuf_puts(b, "LONG_MIN");
+            else
+            {
+                lbuf_put_long(b, v->num);
+                lbuf_putc(b, 'L');
+            }
+            lbuf_putc(b, ')');
+            return 1;
+
+        case LVAL_SYM:
+            for(int i = 0; i < d->formals->count; ++i)
+            {
+                if(strcmp(d->formals->cell[i]->sym, v->sym) == 0)
+                {
+                    lbuf_putc(b, 'a');
+                    lbuf_put_long(b, i);
+                    return 1;
+                }
+            }
+            // globals are looked up at run time, and may be anything
+            return 0;
+
+        case LVAL_SEXPR:
+            return laot_list(u, d, v, b);
+
+        default:
+            return 0;
+    }
+}
+
+/*
+ * laot_formal()
+ * name is bound by the function being compiled
+ */
+static int laot_formal(laot_def* d, const char* name)
+{
+    for(int i = 0; i < d->formals->count; ++i)
+    {
+        if(strcmp(d->formals->cell[i]->sym, name) == 0)
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * laot_list()
+ * Write the S-Expression list as evaluated by lval_eval_sexpr()
+ */
+static int laot_list(laot_unit* u, laot_def* d, lval* list, lbuf* b)
+{
+    if(list->count == 0)
+        return 0;
+    if(list->count == 1)
+        return laot_value(u, d, list->cell[0], b);
+
+    lval* head = list->cell[0];
+    int argc = list->count - 1;
+    lval** args = &list->cell[1];
+    if(head->type != LVAL_SYM || laot_formal(d, head->sym) || laot_defined(u, head->sym))
+    {
+        // a call to another compiled function
+        laot_def* callee = (head->type == LVAL_SYM) ? laot_find(u, head->sym) : NULL;
+        if(callee == NULL || !callee->ok || laot_formal(d, head->sym) || callee->formals->count != argc)
+            return 0;
+
+        laot_put_name(b, "lc_", callee->name);
+        lbuf_putc(b, '(');
+        for(int i = 0; i < argc; ++i)
+        {
+            if(!laot_value(u, d, args[i], b))
+                return 0;
+            lbuf_puts(b, ", ");
+        }
+        lbuf_puts(b, "e)");
+        return 1;
+    }
+
+    const char* op = head->sym;
+    if(strcmp(op, "if") == 0)
+    {
+        if(argc != 3 || args[1]->type != LVAL_QEXPR || args[2]->type != LVAL_QEXPR)
+            return 0;
+        lbuf_puts(b, "(");
+        if(!laot_value(u, d, args[0], b))
+            return 0;
+        lbuf_puts(b, " ? ");
+        if(!laot_list(u, d, args[1], b))
+            return 0;
+        lbuf_puts(b, " : ");
+        if(!laot_list(u, d, args[2], b))
+            return 0;
+        lbuf_puts(b, ")");
+        return 1;
+    }
+
+    if(laot_is(op, laot_cmps))
+    {
+        if(argc != 2)
+            return 0;
+        lbuf_puts(b, "(long) (");
+        if(!laot_value(u, d, args[0], b))
+            return 0;
+        lbuf_putc(b, ' ');
+        lbuf_puts(b, op);
+        lbuf_putc(b, ' ');
+        if(!laot_value(u, d, args[1], b))
+            return 0;
+        lbuf_puts(b, ")");
+        return 1;
+    }
+
+    if(laot_is(op, laot_folds))
+    {
+        // unary minus negates, as in lval_builtin_op()
+        if(argc == 1 && strcmp(op, "-") == 0)
+        {
+            lbuf_puts(b, "(-");
+            int ok = laot_value(u, d, args[0], b);
+            lbuf_puts(b, ")");
+            return ok;
+        }
+
+        // left fold, innermost first
+        for(int i = 1; i < argc; ++i)
+        {
+            if(strcmp(op, "+") == 0 || strcmp(op, "-") == 0 || strcmp(op, "*") == 0)
+                lbuf_putc(b, '(');
+            else
+            {
+                laot_put_name(b, "lc_op_", op);
+                lbuf_putc(b, '(');
+            }
+        }
+        if(!laot_value(u, d, args[0], b))
+            return 0;
+        for(int i = 1; i < argc; ++i)
+        {
+            int infix = strcmp(op, "+") == 0 || strcmp(op, "-") == 0 || strcmp(op, "*") == 0;
+            if(infix)
+            {
+                lbuf_putc(b, ' ');
+                lbuf_puts(b, op);
+                lbuf_putc(b, ' ');
+            }
+            else
+                lbuf_puts(b, ", ");
+            if(!laot_value(u, d, args[i], b))
+                return 0;
+            lbuf_puts(b, infix ? ")" : ", e)");
+        }
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * laot_callees()
+ * Mark in seen the compiled functions that v calls as a body of d, and
+ * the ones those call in turn
+ */
+static void laot_callees(laot_unit* u, laot_def* d, lval* v, char* seen)
+{
+    if(v->type != LVAL_SEXPR && v->type != LVAL_QEXPR)
+        return;
+
+    if(v->type == LVAL_SEXPR && v->count > 1 && v->cell[0]->type == LVAL_SYM && !laot_formal(d, v->cell[0]->sym))
+    {
+        laot_def* callee = laot_find(u, v->cell[0]->sym);
+        if(callee != NULL && callee->ok && !seen[callee - u->defs])
+        {
+            seen[callee - u->defs] = 1;
+            laot_callees(u, callee, callee->body, seen);
+        }
+    }
+    for(int i = 0; i < v->count; ++i)
+        laot_callees(u, d, v->cell[i], seen);
+}
+
+// ======== UNITS ======== //
+
+/*
+ * laot_read()
+ * Collect the definitions in filename. Returns -1 if it cannot be
+ * read.
+ */
+static int laot_read(lispy_ctx* ctx, const char* filename, laot_unit* u)
+{
+    FILE* fp = fopen(filename, "r");
+    if(!fp)
+    {
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, filename);
+        return -1;
+    }
+
+    char* line = NULL;
+    size_t cap = 0;
+    while(getline(&line, &cap, fp) != -1)
+    {
+        lval* x = lispy_read(ctx, filename, line, NULL);
+        if(x == NULL)
+            continue;
+
+        // def {name ...} values...
+        if(x->count >= 3 && x->cell[0]->type == LVAL_SYM && strcmp(x->cell[0]->sym, "def") == 0 &&
+           x->cell[1]->type == LVAL_QEXPR)
+        {
+            lval* syms = x->cell[1];
+            for(int i = 0; i < syms->count; ++i)
+            {
+                if(syms->cell[i]->type == LVAL_SYM)
+                    lval_add(u->names, lval_copy(syms->cell[i]));
+            }
+
+            // def {name} (\ {formals} {body})
+            lval* f = x->cell[2];
+            int is_def = x->count == 3 && syms->count == 1 && syms->cell[0]->type == LVAL_SYM &&
+                f->type == LVAL_SEXPR && f->count == 3 && f->cell[0]->type == LVAL_SYM &&
+                strcmp(f->cell[0]->sym, "\\") == 0 &&
+                f->cell[1]->type == LVAL_QEXPR && f->cell[2]->type == LVAL_QEXPR;
+            for(int i = 0; is_def && i < f->cell[1]->count; ++i)
+            {
+                lval* s = f->cell[1]->cell[i];
+                if(s->type != LVAL_SYM || strcmp(s->sym, "&") == 0)
+                    is_def = 0;
+            }
+
+            if(is_def)
+            {
+                // the last definition of a name is the one that counts
+                laot_def* d = laot_find(u, syms->cell[0]->sym);
+                if(d == NULL)
+                {
+                    u->defs = realloc(u->defs, sizeof(laot_def) * (u->count + 1));
+                    d = &u->defs[u->count++];
+                }
+                else
+                {
+                    lval_del(d->formals);
+                    lval_del(d->body);
+                }
+                d->name    = syms->cell[0]->sym;
+                d->formals = lval_copy(f->cell[1]);
+                d->body    = lval_copy(f->cell[2]);
+                d->ok      = 1;
+            }
+            else
+            {
+                // redefined as something else
+                for(int i = 0; i < syms->count; ++i)
+                {
+                    laot_def* d = (syms->cell[i]->type == LVAL_SYM) ? laot_find(u, syms->cell[i]->sym) : NULL;
+                    if(d != NULL)
+                        d->ok = 0;
+                }
+            }
+        }
+        lval_del(x);
+    }
+    free(line);
+    fclose(fp);
+
+    return 0;
+}
+
+/*
+ * laot_write()
+ * The module for the definitions still ok
+ */
+static void laot_write(laot_unit* u, int count, const char* filename, lbuf* b)
+{
+    lbuf_puts(b, "/*\n * Compiled from ");
+    lbuf_puts(b, filename);
+    lbuf_puts(b, " by lispy --emit-c, do not edit\n */\n\n");
+    // the index of each definition in lc_names, and scratch for laot_callees()
+    int* index = malloc(sizeof(int) * u->count);
+    char* seen = malloc(u->count);
+    for(int i = 0, n = 0; i < u->count; ++i)
+        index[i] = u->defs[i].ok ? n++ : -1;
+
+    lbuf_puts(b, "#include <limits.h>\n#include <math.h>\n#include \"native.h\"\n\n");
+    lbuf_puts(b, "static const lnative_api* api;\n");
+    // the lambdas, for whatever the unboxed functions cannot do
+    lbuf_puts(b, "static lval* lc_lambdas[");
+    lbuf_put_long(b, count);
+    lbuf_puts(b, "];\n");
+    // and the builtins that replace them, while their names are bound to them
+    lbuf_puts(b, "static lbuiltin lc_builtins[");
+    lbuf_put_long(b, count);
+    lbuf_puts(b, "];\n");
+    lbuf_puts(b, "static const char* lc_names[] = {");
+    for(int i = 0; i < u->count; ++i)
+    {
+        if(u->defs[i].ok)
+        {
+            laot_put_string(b, u->defs[i].name);
+            lbuf_puts(b, ", ");
+        }
+    }
+    lbuf_puts(b, "NULL};\n\n");
+
+    // a def after loading rebinds a name, and calls to it then go
+    // through the lambdas, which look it up like the interpreter does
+    lbuf_puts(b,
+        "static int lc_bound(lenv* env, int i)\n{\n"
+        "    lval* f = api->get(env, lc_names[i]);\n"
+        "    int bound = api->get_builtin(f) == lc_builtins[i];\n"
+        "    api->del(f);\n\n"
+        "    return bound;\n}\n\n");
+
+    // the folds that need more than a C operator
+    lbuf_puts(b,
+        "static long lc_op__2f(long x, long y, int* e) { if(y == 0) { *e = 1; return 0; } return x / y; }\n"
+        "static long lc_op__25(long x, long y, int* e) { if(y == 0) { *e = 1; return 0; } return x % y; }\n"
+        "static long lc_op__5e(long x, long y, int* e) { return (long) pow(x, y); }\n"
+        "static long lc_op_min(long x, long y, int* e) { return (x <= y) ? x : y; }\n"
+        "static long lc_op_max(long x, long y, int* e) { return (x >= y) ? x : y; }\n\n");
+
+    for(int i = 0; i < u->count; ++i)
+    {
+        laot_def* d = &u->defs[i];
+        if(!d->ok)
+            continue;
+        lbuf_puts(b, "static long ");
+        laot_put_name(b, "lc_", d->name);
+        lbuf_putc(b, '(');
+        for(int j = 0; j < d->formals->count; ++j)
+        {
+            lbuf_puts(b, "long a");
+            lbuf_put_long(b, j);
+            lbuf_puts(b, ", ");
+        }
+        lbuf_puts(b, "int* e);\n");
+    }
+    lbuf_puts(b, "\n");
+
+    int n = 0;
+    for(int i = 0; i < u->count; ++i)
+    {
+        laot_def* d = &u->defs[i];
+        if(!d->ok)
+            continue;
+
+        // the unboxed function, which gives up once *e is set
+        lbuf_puts(b, "static long ");
+        laot_put_name(b, "lc_", d->name);
+        lbuf_putc(b, '(');
+        for(int j = 0; j < d->formals->count; ++j)
+        {
+            lbuf_puts(b, "long a");
+            lbuf_put_long(b, j);
+            lbuf_puts(b, ", ");
+        }
+        lbuf_puts(b, "int* e)\n{\n    if(*e)\n        return 0;\n    return ");
+        laot_list(u, d, d->body, b);
+        lbuf_puts(b, ";\n}\n\n");
+
+        // the builtin, which leaves anything but numbers to the lambda
+        lbuf_puts(b, "static lval* ");
+        laot_put_name(b, "lc_builtin_", d->name);
+        lbuf_puts(b, "(lenv* env, lval* args)\n{\n    int n = api->count(args);\n");
+        lbuf_puts(b, "    for(int i = 0; i < n; ++i)\n    {\n");
+        lbuf_puts(b, "        if(api->type(api->item(args, i)) != LVAL_NUM)\n            n = -1;\n    }\n");
+        lbuf_puts(b, "    if(n == ");
+        lbuf_put_long(b, d->formals->count);
+        // the unboxed path calls the functions it reaches directly
+        memset(seen, 0, u->count);
+        seen[i] = 1;
+        laot_callees(u, d, d->body, seen);
+        for(int j = 0; j < u->count; ++j)
+        {
+            if(seen[j])
+            {
+                lbuf_puts(b, " && lc_bound(env, ");
+                lbuf_put_long(b, index[j]);
+                lbuf_putc(b, ')');
+            }
+        }
+        lbuf_puts(b, ")\n    {\n        int e = 0;\n        long x = ");
+        laot_put_name(b, "lc_", d->name);
+        lbuf_putc(b, '(');
+        for(int j = 0; j < d->formals->count; ++j)
+        {
+            lbuf_puts(b, "api->get_num(api->item(args, ");
+            lbuf_put_long(b, j);
+            lbuf_puts(b, ")), ");
+        }
+        lbuf_puts(b, "&e);\n        if(!e)\n        {\n            api->del(args);\n");
+        lbuf_puts(b, "            return api->num(x);\n        }\n    }\n\n");
+        lbuf_puts(b, "    lval* f = api->copy(lc_lambdas[");
+        lbuf_put_long(b, n);
+        lbuf_puts(b, "]);\n    lval* x = api->call(env, f, args);\n    api->del(f);\n\n    return x;\n}\n\n");
+        n++;
+    }
+
+    lbuf_puts(b, "int lispy_native_init(lenv* env, const lnative_api* a);\n\n");
+    lbuf_puts(b, "int lispy_native_init(lenv* env, const lnative_api* a)\n{\n");
+    lbuf_puts(b, "    if(a->version != LNATIVE_API_VERSION || a->size < sizeof(lnative_api))\n        return 1;\n");
+    lbuf_puts(b, "    api = a;\n\n");
+    lbuf_puts(b, "    for(int i = 0; lc_names[i] != NULL; ++i)\n    {\n");
+    lbuf_puts(b, "        lc_lambdas[i] = api->get(env, lc_names[i]);\n");
+    lbuf_puts(b, "        if(api->type(lc_lambdas[i]) != LVAL_FUNC)\n            return 2;\n    }\n");
+    n = 0;
+    for(int i = 0; i < u->count; ++i)
+    {
+        laot_def* d = &u->defs[i];
+        if(!d->ok)
+            continue;
+        lbuf_puts(b, "    lc_builtins[");
+        lbuf_put_long(b, n);
+        lbuf_puts(b, "] = ");
+        laot_put_name(b, "lc_builtin_", d->name);
+        lbuf_puts(b, ";\n    api->add_builtin(env, lc_names[");
+        lbuf_put_long(b, n);
+        lbuf_puts(b, "], lc_builtins[");
+        lbuf_put_long(b, n++);
+        lbuf_puts(b, "]);\n");
+    }
+    lbuf_puts(b, "\n    return 0;\n}\n");
+
+    free(index);
+    free(seen);
+}
+
+/*
+ * laot_build()
+ * Run the C compiler, without a shell in between
+ */
+static int laot_build(const char* c_path, const char* so_path)
+{
+    const char* cc = getenv("CC");
+    const char* inc = getenv("LISPY_INCLUDE");
+    char include[4096];
+    snprintf(include, sizeof(include), "-I%s", (inc != NULL) ? inc : LISPY_INCLUDE_DIR);
+    if(cc == NULL || *cc == '\0')
+        cc = "gcc";
+
+    // -fwrapv, since the interpreter wraps around on overflow
+    char* argv[] = {(char*) cc, "-shared", "-fPIC", "-O2", "-fwrapv", "-w", include,
+        (char*) c_path, "-o", (char*) so_path, "-lm", NULL};
+
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        fprintf(stderr, "[%s] failed to fork\n", __func__);
+        return -1;
+    }
+    if(pid == 0)
+    {
+        execvp(cc, argv);
+        fprintf(stderr, "[%s] failed to run [%s]\n", __func__, cc);
+        _exit(127);
+    }
+
+    int status;
+    if(waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "[%s] [%s] failed to build [%s]\n", __func__, cc, c_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * laot_compile()
+ */
+int laot_compile(lispy_ctx* ctx, const char* filename, const char* c_path, const char* so_path)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    laot_unit u = {NULL, 0, lval_qexpr()};
+    int n = -1;
+
+    if(laot_read(ctx, filename, &u) == 0)
+    {
+        // drop what does not compile until nothing else does, since a
+        // function is only compilable if its callees are
+        int changed = 1;
+        while(changed)
+        {
+            changed = 0;
+            for(int i = 0; i < u.count; ++i)
+            {
+                lbuf b;
+                lbuf_init(&b);
+                if(u.defs[i].ok && !laot_list(&u, &u.defs[i], u.defs[i].body, &b))
+                {
+                    u.defs[i].ok = 0;
+                    changed = 1;
+                }
+                lbuf_free(&b);
+            }
+        }
+
+        n = 0;
+        for(int i = 0; i < u.count; ++i)
+            n += u.defs[i].ok;
+    }
+
+    if(n > 0)
+    {
+        lbuf b;
+        lbuf_init(&b);
+        laot_write(&u, n, filename, &b);
+
+        FILE* fp = fopen(c_path, "w");
+        if(!fp)
+        {
+            fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, c_path);
+            n = -1;
+        }
+        else
+        {
+            fwrite(b.data, 1, b.len, fp);
+            if(fclose(fp) != 0 || laot_build(c_path, so_path) != 0)
+                n = -1;
+        }
+        lbuf_free(&b);
+    }
+
+    for(int i = 0; i < u.count; ++i)
+    {
+        lval_del(u.defs[i].formals);
+        lval_del(u.defs[i].body);
+    }
+    free(u.defs);
+    lval_del(u.names);
+    lispy_ctx_use(prev);
+
+    return n;
+}
+
+/*
+ * laot_load()
+ */
+lval* laot_load(lispy_ctx* ctx, const char* so_path)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    lval* names = lnative_load(ctx->env, so_path);
+    lispy_ctx_use(prev);
+
+    return names;
+}
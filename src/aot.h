@@ -0,0 +1,53 @@
+/*
+ * AOT
+ * Ahead-of-time compilation of Lispy definitions to C. Every line of
+ * a file of the form
+ *
+ *   def {name} (\ {formals...} {body})
+ *
+ * whose body only does integer arithmetic (+ - * / % ^ min max),
+ * comparisons, if, and calls to itself or other such definitions,
+ * becomes a C function on longs. The functions are written out as a
+ * native module (see native.h), built with the C compiler and loaded
+ * in place of the lambdas.
+ *
+ * Each compiled builtin takes the unboxed path when it gets as many
+ * numbers as the lambda has formals. Anything else (other types, too
+ * few or too many arguments, division by zero) goes to the original
+ * lambda, so compiled and interpreted definitions give the same
+ * results. So does a later def of a compiled name: a builtin only
+ * takes the unboxed path while it and the compiled functions it calls
+ * are still bound to their builtins. Compiled code does not count
+ * towards budgets (see lispy.h), and calls between compiled functions
+ * are invisible to the profiler, the call stats and the trace.
+ */
+
+#ifndef __BYOL_AOT_H
+#define __BYOL_AOT_H
+
+#include "lispy.h"
+
+// where native.h is, for the compiler
+#ifndef LISPY_INCLUDE_DIR
+#define LISPY_INCLUDE_DIR   "src"
+#endif
+
+/*
+ * laot_compile()
+ * Write the C for the definitions in filename to c_path and build it
+ * into so_path with $CC (or gcc), with native.h taken from
+ * $LISPY_INCLUDE (or LISPY_INCLUDE_DIR). Returns the number of
+ * functions compiled, 0 if there was nothing to compile (and no
+ * module was built), or -1 on failure.
+ */
+int   laot_compile(lispy_ctx* ctx, const char* filename, const char* c_path, const char* so_path);
+/*
+ * laot_load()
+ * Load a module built by laot_compile() into ctx, once the lambdas it
+ * replaces are defined. Returns the names of the compiled builtins,
+ * or an error.
+ */
+lval* laot_load(lispy_ctx* ctx, const char* so_path);
+
+
+#endif /*__BYOL_AOT_H*/
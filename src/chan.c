@@ -0,0 +1,439 @@
+/*
+ * CHAN
+ * Channels
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "context.h"
+#include "chan.h"
+
+// waits that yield this many times in a row start to sleep
+#define LCHAN_SPINS     64
+#define LCHAN_NAP_NS    50000
+
+static long lchan_num_moves = 0;
+
+
+/*
+ * lchan_new()
+ */
+lchan* lchan_new(long cap)
+{
+    lchan* ch = malloc(sizeof(*ch));
+    if(!ch)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for channel\n", __func__, sizeof(*ch));
+        return NULL;
+    }
+
+    ch->cap      = cap;
+    ch->cells    = NULL;
+    ch->send_pos = 0;
+    ch->recv_pos = 0;
+    ch->items    = NULL;
+    ch->start    = 0;
+    ch->count    = 0;
+    ch->slots    = 0;
+    ch->closed   = 0;
+    ch->refs     = 1;
+    pthread_mutex_init(&ch->lock, NULL);
+
+    if(cap > 0)
+    {
+        ch->cells = malloc(sizeof(lchan_cell) * cap);
+        for(long i = 0; i < cap; ++i)
+        {
+            ch->cells[i].seq = 2 * i;
+            ch->cells[i].val = NULL;
+        }
+    }
+
+    return ch;
+}
+
+/*
+ * lchan_retain()
+ */
+void lchan_retain(lchan* ch)
+{
+    __atomic_add_fetch(&ch->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * lchan_release()
+ * Values still in the channel are deleted with it
+ */
+void lchan_release(lchan* ch)
+{
+    if(__atomic_sub_fetch(&ch->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    if(ch->cap > 0)
+    {
+        for(long pos = ch->recv_pos; pos < ch->send_pos; ++pos)
+            lval_del(ch->cells[pos % ch->cap].val);
+        free(ch->cells);
+    }
+    else
+    {
+        for(long i = 0; i < ch->count; ++i)
+            lval_del(ch->items[(ch->start + i) % ch->slots]);
+        free(ch->items);
+    }
+    pthread_mutex_destroy(&ch->lock);
+    free(ch);
+}
+
+/*
+ * lchan_moves()
+ */
+long lchan_moves(void)
+{
+    return __atomic_load_n(&lchan_num_moves, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * lchan_moved()
+ */
+static void lchan_moved(void)
+{
+    __atomic_add_fetch(&lchan_num_moves, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * lchan_try_send()
+ * Returns 0 if v went in (and now belongs to the channel), or -1 if
+ * the channel is full.
+ */
+static int lchan_try_send(lchan* ch, lval* v)
+{
+    if(ch->cap == 0)
+    {
+        pthread_mutex_lock(&ch->lock);
+        if(ch->count == ch->slots)
+        {
+            long slots = (ch->slots == 0) ? 16 : ch->slots * 2;
+            lval** items = malloc(sizeof(lval*) * slots);
+            for(long i = 0; i < ch->count; ++i)
+                items[i] = ch->items[(ch->start + i) % ch->slots];
+            free(ch->items);
+            ch->items = items;
+            ch->slots = slots;
+            ch->start = 0;
+        }
+        ch->items[(ch->start + ch->count) % ch->slots] = v;
+        ch->count++;
+        pthread_mutex_unlock(&ch->lock);
+        lchan_moved();
+        return 0;
+    }
+
+    long pos = __atomic_load_n(&ch->send_pos, __ATOMIC_RELAXED);
+    lchan_cell* cell;
+    while(1)
+    {
+        cell = &ch->cells[pos % ch->cap];
+        long dif = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - 2 * pos;
+        if(dif == 0)
+        {
+            // the slot is free, claim it
+            if(__atomic_compare_exchange_n(&ch->send_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(dif < 0)
+            return -1;
+        else
+            pos = __atomic_load_n(&ch->send_pos, __ATOMIC_RELAXED);
+    }
+    cell->val = v;
+    __atomic_store_n(&cell->seq, 2 * pos + 1, __ATOMIC_RELEASE);
+    lchan_moved();
+
+    return 0;
+}
+
+/*
+ * lchan_try_recv()
+ * Returns the oldest value, or NULL if the channel is empty
+ */
+static lval* lchan_try_recv(lchan* ch)
+{
+    lval* v = NULL;
+
+    if(ch->cap == 0)
+    {
+        pthread_mutex_lock(&ch->lock);
+        if(ch->count > 0)
+        {
+            v = ch->items[ch->start];
+            ch->start = (ch->start + 1) % ch->slots;
+            ch->count--;
+        }
+        pthread_mutex_unlock(&ch->lock);
+        if(v != NULL)
+            lchan_moved();
+        return v;
+    }
+
+    long pos = __atomic_load_n(&ch->recv_pos, __ATOMIC_RELAXED);
+    lchan_cell* cell;
+    while(1)
+    {
+        cell = &ch->cells[pos % ch->cap];
+        long dif = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (2 * pos + 1);
+        if(dif == 0)
+        {
+            if(__atomic_compare_exchange_n(&ch->recv_pos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if(dif < 0)
+            return NULL;
+        else
+            pos = __atomic_load_n(&ch->recv_pos, __ATOMIC_RELAXED);
+    }
+    v = cell->val;
+    // free the slot for the sender one lap ahead
+    __atomic_store_n(&cell->seq, 2 * (pos + ch->cap), __ATOMIC_RELEASE);
+    lchan_moved();
+
+    return v;
+}
+
+/*
+ * lchan_closed()
+ */
+static int lchan_closed(lchan* ch)
+{
+    return __atomic_load_n(&ch->closed, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * WAIT
+ * State of one blocking send, recv or select
+ */
+typedef struct
+{
+    int  spins;
+    int  blocked;
+    long moves;     // see ltask_stuck()
+    long since;
+    lval* err;      // the evaluation timed out, see lbudget_timed_out()
+} lchan_wait;
+
+#define LCHAN_WAIT_INIT {0, 0, -1, 0, NULL}
+
+/*
+ * lchan_pause()
+ * Wait a little for the other end of a channel. The other end may be
+ * a fiber on this thread, which gets to run, or a queued task, which
+ * gets a worker of its own if every worker is waiting. Fibers park
+ * until a channel moves instead of spinning. Returns -1 if the wait
+ * has to give up, with w->err set if the evaluation timed out, or
+ * because the interpreter is being freed and nothing is left that
+ * could move the channel.
+ */
+static int lchan_pause(lchan_wait* w)
+{
+    if(!w->blocked)
+    {
+        ltask_block(1);
+        w->blocked = 1;
+    }
+    ltask_unstall();
+    if((w->err = lbudget_timed_out()) != NULL)
+        return -1;
+    if(ltask_stuck(&w->moves, &w->since))
+        return -1;
+
+    int parked = lfiber_block();
+    if(parked != 0)
+        return (parked > 0) ? 0 : -1;
+
+    if(++w->spins > LCHAN_SPINS)
+    {
+        struct timespec ts = {0, LCHAN_NAP_NS};
+        nanosleep(&ts, NULL);
+    }
+    if(!lfiber_pause())
+        sched_yield();
+
+    return 0;
+}
+
+/*
+ * lchan_wait_done()
+ */
+static void lchan_wait_done(lchan_wait* w)
+{
+    if(w->blocked)
+        ltask_block(0);
+}
+
+
+// ======== BUILTINS ======== //
+
+/*
+ * builtin_chan()
+ * (chan n) -> a channel holding up to n values, or any number if n
+ * is 0
+ */
+lval* builtin_chan(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("chan", val, 1);
+    LVAL_ASSERT_TYPE("chan", val, 0, LVAL_NUM);
+    LVAL_ASSERT(val, val->cell[0]->num >= 0,
+            "[%s] Function 'chan': negative capacity %li", __func__, val->cell[0]->num
+    );
+
+    lchan* ch = lchan_new(val->cell[0]->num);
+    lval_del(val);
+
+    return lval_chan(ch);
+}
+
+/*
+ * builtin_send()
+ * (send c x) -> () once x is in c, waiting while c is full
+ */
+lval* builtin_send(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("send", val, 2);
+    LVAL_ASSERT_TYPE("send", val, 0, LVAL_CHAN);
+
+    lchan* ch = val->cell[0]->chan;
+    lval* x = lval_pop(val, 1);
+    lchan_wait w = LCHAN_WAIT_INIT;
+    int sent = 0;
+    int stuck = 0;
+
+    while(!lchan_closed(ch) && !(sent = (lchan_try_send(ch, x) == 0)))
+    {
+        if((stuck = lchan_pause(&w)) != 0)
+            break;
+    }
+    lchan_wait_done(&w);
+    lval_del(val);
+
+    if(!sent)
+    {
+        lval_del(x);
+        if(w.err != NULL)
+            return w.err;
+        if(stuck)
+            return lval_err("[%s] Function 'send': gave up at shutdown, nothing can receive any more", __func__);
+        return lval_err("[%s] Function 'send': channel is closed", __func__);
+    }
+
+    return lval_sexpr();
+}
+
+/*
+ * builtin_recv()
+ * (recv c) -> the oldest value in c, waiting while c is empty. Once
+ * c is closed and empty returns ().
+ */
+lval* builtin_recv(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("recv", val, 1);
+    LVAL_ASSERT_TYPE("recv", val, 0, LVAL_CHAN);
+
+    lchan* ch = val->cell[0]->chan;
+    lchan_wait w = LCHAN_WAIT_INIT;
+    lval* x;
+
+    while((x = lchan_try_recv(ch)) == NULL)
+    {
+        // anything sent before the close has to be seen first
+        if(lchan_closed(ch) && (x = lchan_try_recv(ch)) == NULL)
+        {
+            x = lval_sexpr();
+            break;
+        }
+        if(lchan_pause(&w) != 0)
+        {
+            x = (w.err != NULL) ? w.err :
+                lval_err("[%s] Function 'recv': gave up at shutdown, nothing can send any more", __func__);
+            break;
+        }
+    }
+    lchan_wait_done(&w);
+    lval_del(val);
+
+    return x;
+}
+
+/*
+ * builtin_select()
+ * (select {c1 c2 ...}) -> {i x} where x is the value received from
+ * the i-th channel, waiting until one of them has a value. Returns
+ * {i ()} for a channel that is closed and empty.
+ */
+lval* builtin_select(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("select", val, 1);
+    LVAL_ASSERT_TYPE("select", val, 0, LVAL_QEXPR);
+    LVAL_ASSERT_NOT_EMPTY("select", val, 0);
+
+    lval* chans = val->cell[0];
+    for(int i = 0; i < chans->count; ++i)
+    {
+        LVAL_ASSERT(val, chans->cell[i]->type == LVAL_CHAN,
+                "[%s] Function 'select': incorrect type for channel %i. Got %s, expected %s.",
+                __func__, i, lval_type_str(chans->cell[i]->type), lval_type_str(LVAL_CHAN)
+        );
+    }
+
+    // start each pass one channel further on so that a busy channel
+    // cannot starve the others
+    int n = chans->count;
+    int first = 0;
+    lchan_wait w = LCHAN_WAIT_INIT;
+    while(1)
+    {
+        for(int k = 0; k < n; ++k)
+        {
+            int i = (first + k) % n;
+            lchan* ch = chans->cell[i]->chan;
+            lval* x = lchan_try_recv(ch);
+            if(x == NULL && lchan_closed(ch) && (x = lchan_try_recv(ch)) == NULL)
+                x = lval_sexpr();
+            if(x != NULL)
+            {
+                lchan_wait_done(&w);
+                lval_del(val);
+                return lval_add(lval_add(lval_qexpr(), lval_num(i)), x);
+            }
+        }
+        first = (first + 1) % n;
+        if(lchan_pause(&w) != 0)
+        {
+            lchan_wait_done(&w);
+            lval_del(val);
+            if(w.err != NULL)
+                return w.err;
+            return lval_err("[%s] Function 'select': gave up at shutdown, nothing can send any more", __func__);
+        }
+    }
+}
+
+/*
+ * builtin_close()
+ * (close c) -> (). Values already in c can still be received.
+ */
+lval* builtin_close(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("close", val, 1);
+    LVAL_ASSERT_TYPE("close", val, 0, LVAL_CHAN);
+
+    __atomic_store_n(&val->cell[0]->chan->closed, 1, __ATOMIC_RELEASE);
+    lchan_moved();
+    lval_del(val);
+
+    return lval_sexpr();
+}
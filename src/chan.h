@@ -0,0 +1,72 @@
+/*
+ * CHAN
+ * Channels for passing values between tasks, fibers and threads
+ */
+
+#ifndef __BYOL_CHAN_H
+#define __BYOL_CHAN_H
+
+#include <pthread.h>
+#include "lval.h"
+
+#define LCHAN_CACHE_LINE 64
+
+/*
+ * CELL
+ * A slot of a bounded channel. seq says whose turn the slot is: it
+ * is 2 * pos when free for the sender at pos and 2 * pos + 1 when
+ * full for the receiver at pos. Doubling keeps the two apart when the
+ * channel holds a single value, where pos + 1 would also be the turn
+ * of the next sender.
+ */
+typedef struct lchan_cell
+{
+    long    seq;
+    lval*   val;
+} lchan_cell;
+
+/*
+ * CHANNEL
+ * Bounded channels are a lock-free ring (Vyukov's bounded MPMC
+ * queue), so one sender and one receiver never wait on each other
+ * unless the ring is full or empty. Unbounded channels are a
+ * growable ring behind a mutex. Values in a channel belong to it
+ * until received.
+ */
+struct lchan
+{
+    long            cap;        // 0 for unbounded
+    lchan_cell*     cells;
+    char            pad0[LCHAN_CACHE_LINE];
+    long            send_pos;
+    char            pad1[LCHAN_CACHE_LINE];
+    long            recv_pos;
+    char            pad2[LCHAN_CACHE_LINE];
+    // unbounded
+    pthread_mutex_t lock;
+    lval**          items;
+    long            start;
+    long            count;
+    long            slots;
+    int             closed;
+    int             refs;
+};
+
+/*
+ * lchan_new()
+ * A channel that holds up to cap values, or any number if cap is 0.
+ * It holds one reference.
+ */
+lchan* lchan_new(long cap);
+void   lchan_retain(lchan* ch);
+void   lchan_release(lchan* ch);
+/*
+ * lchan_moves()
+ * How many values have been sent or received and channels closed so
+ * far, by any thread. Waits that see no change know nothing has
+ * happened that they could be waiting for.
+ */
+long   lchan_moves(void);
+
+
+#endif /*__BYOL_CHAN_H*/
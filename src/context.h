@@ -0,0 +1,87 @@
+/*
+ * CONTEXT
+ * The inside of a lispy_ctx, for the interpreter itself, the repl and
+ * the benchmarks. Programs embedding liblispy only get lispy.h (and
+ * native modules native.h), where contexts and values are opaque, so
+ * their layouts (here and in lval.h) can change without breaking them.
+ */
+
+#ifndef __BYOL_CONTEXT_H
+#define __BYOL_CONTEXT_H
+
+#include "lispy.h"
+#include "lval.h"
+#include "mpc.h"
+#include "parallel.h"
+#include "task.h"
+#include "fiber.h"
+#include "chan.h"
+#include "spec.h"
+#include "actor.h"
+#include "prof.h"
+#include "stats.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "native.h"
+
+// Grammar rules, in the order they are passed to mpca_lang()
+typedef enum
+{
+    LISPY_NUMBER,
+    LISPY_DECIMAL,
+    LISPY_SYMBOL,
+    LISPY_SEXPR,
+    LISPY_QEXPR,
+    LISPY_EXPR,
+    LISPY_LISPY,
+    LISPY_NUM_RULES
+} lispy_rule;
+
+struct lispy_ctx
+{
+    lheap           heap;
+    lenv*           env;            // global environment
+    mpc_parser_t*   rules[LISPY_NUM_RULES];
+    lpool*          pool;           // started on first use
+    lsched*         sched;          // started on first spawn
+    lfiber_sched*   fibers;         // started on first go
+    long            speculate;      // cost threshold, 0 for off (see spec.h)
+    lmailbox*       mailbox;        // bound to self (see actor.h)
+    lbudget         budget;         // limits of each lispy_eval() (see lispy.h)
+};
+
+/*
+ * lispy_ctx_pool()
+ * The worker pool of ctx, started with lpool_default_size()
+ * threads the first time it is asked for.
+ */
+lpool*     lispy_ctx_pool(lispy_ctx* ctx);
+/*
+ * lispy_ctx_sched()
+ * The task scheduler of ctx, started with lpool_default_size()
+ * threads the first time it is asked for.
+ */
+lsched*    lispy_ctx_sched(lispy_ctx* ctx);
+/*
+ * lispy_ctx_fibers()
+ * The fiber scheduler of ctx, made the first time it is asked for.
+ * Fibers only ever run on the thread using ctx.
+ */
+lfiber_sched* lispy_ctx_fibers(lispy_ctx* ctx);
+
+/*
+ * lispy_parse()
+ * lispy_read() into the heap current on the calling thread instead
+ * of the heap of ctx, which lets another thread parse ahead while ctx
+ * evaluates. That heap must share the symbols of ctx (see
+ * lheap_init()), and only one thread at a time may parse with ctx.
+ */
+lval* lispy_parse(lispy_ctx* ctx, const char* filename, const char* src, char** err);
+
+// Convert MPC expressions to lvals
+lval* lval_read_num(mpc_ast_t* ast);
+lval* lval_read_decimal(mpc_ast_t* ast);
+lval* lval_read(mpc_ast_t* ast);
+
+
+#endif /*__BYOL_CONTEXT_H*/
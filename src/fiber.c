@@ -0,0 +1,482 @@
+/*
+ * FIBER
+ * Cooperative green threads
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "context.h"
+#include "fiber.h"
+#include "chan.h"
+
+
+/*
+ * lfiber_now()
+ * Monotonic time in microseconds
+ */
+static long lfiber_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * lfiber_here()
+ * The fiber scheduler of the calling thread, or NULL. Tasks and
+ * parallel builtins run on borrowed stacks (or threads) and cannot
+ * switch fibers.
+ */
+static lfiber_sched* lfiber_here(void)
+{
+    lispy_ctx* ctx = lispy_ctx_current();
+
+    if(ctx == NULL || ltask_active() || lpool_active())
+        return NULL;
+
+    return lispy_ctx_fibers(ctx);
+}
+
+
+// ======== STACKS ======== //
+
+/*
+ * lfiber_stack_alloc()
+ * Stacks are reserved but only committed as they are touched, so
+ * an idle fiber costs a few pages.
+ */
+static char* lfiber_stack_alloc(lfiber_sched* sched)
+{
+    if(sched->num_stacks > 0)
+        return sched->stacks[--sched->num_stacks];
+
+    char* stack = mmap(NULL, LFIBER_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(stack == MAP_FAILED)
+    {
+        fprintf(stderr, "[%s] failed to map %d bytes for fiber stack\n", __func__, LFIBER_STACK_SIZE);
+        return NULL;
+    }
+    // stacks grow down, so overflowing one faults on this page
+    mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+
+    return stack;
+}
+
+/*
+ * lfiber_stack_free()
+ */
+static void lfiber_stack_free(lfiber_sched* sched, char* stack)
+{
+    if(sched->num_stacks < LFIBER_STACK_CACHE)
+        sched->stacks[sched->num_stacks++] = stack;
+    else
+        munmap(stack, LFIBER_STACK_SIZE);
+}
+
+
+// ======== SCHEDULER ======== //
+
+/*
+ * lfiber_sched_new()
+ */
+lfiber_sched* lfiber_sched_new(void)
+{
+    lfiber_sched* sched = malloc(sizeof(*sched));
+    if(!sched)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for fiber scheduler\n", __func__, sizeof(*sched));
+        return NULL;
+    }
+
+    sched->current    = NULL;
+    sched->run_head   = NULL;
+    sched->run_tail   = NULL;
+    sched->sleeping   = NULL;
+    sched->blocked    = NULL;
+    sched->moves      = 0;
+    sched->closing    = 0;
+    sched->num_stacks = 0;
+    sched->count      = 0;
+
+    return sched;
+}
+
+/*
+ * lfiber_ready()
+ * Put f at the back of the run queue
+ */
+static void lfiber_ready(lfiber_sched* sched, lfiber* f)
+{
+    f->next = NULL;
+    if(sched->run_tail != NULL)
+        sched->run_tail->next = f;
+    else
+        sched->run_head = f;
+    sched->run_tail = f;
+}
+
+/*
+ * lfiber_unblock()
+ * Make the blocked fibers runnable again if any channel has moved
+ * since they were last woken or the evaluation has timed out (so
+ * they can fail), or unconditionally if force is set.
+ */
+static void lfiber_unblock(lfiber_sched* sched, int force)
+{
+    if(sched->blocked == NULL)
+        return;
+
+    long moves = lchan_moves();
+    long deadline = lbudget_deadline();
+    if(!force && moves == sched->moves && (deadline <= 0 || lfiber_now() < (deadline + 999) / 1000))
+        return;
+    sched->moves = moves;
+
+    while(sched->blocked != NULL)
+    {
+        lfiber* f = sched->blocked;
+        sched->blocked = f->next;
+        lfiber_ready(sched, f);
+    }
+}
+
+/*
+ * lfiber_entry()
+ * First frame on every fiber stack. Returning switches back to the
+ * scheduler through uc_link.
+ */
+static void lfiber_entry(void)
+{
+    lfiber_sched* sched = lispy_ctx_current()->fibers;
+
+    lfuture_run(sched->current->fut);
+    sched->count--;
+}
+
+/*
+ * lfiber_resume()
+ * Run f until it yields, sleeps or finishes. Called on the owner's
+ * stack only.
+ */
+static void lfiber_resume(lfiber_sched* sched, lfiber* f)
+{
+    sched->current = f;
+    lprof_stack* prof = lprof_switch(&f->prof);
+    swapcontext(&sched->main, &f->uc);
+    lprof_switch(prof);
+    sched->current = NULL;
+
+    if(lfuture_done(f->fut))
+    {
+        lfuture_release(f->fut);
+        lfiber_stack_free(sched, f->stack);
+        free(f);
+    }
+}
+
+/*
+ * lfiber_suspend()
+ * Switch from the current fiber back to the scheduler. Whoever
+ * called this has already queued the fiber somewhere.
+ */
+static void lfiber_suspend(lfiber_sched* sched)
+{
+    swapcontext(&sched->current->uc, &sched->main);
+}
+
+/*
+ * lfiber_step()
+ * Wake the sleepers that are due and give every runnable fiber one
+ * turn. Fibers that yield during the step wait for the next one.
+ */
+static void lfiber_step(lfiber_sched* sched)
+{
+    lfiber_unblock(sched, 0);
+
+    long now = lfiber_now();
+    while(sched->sleeping != NULL && sched->sleeping->wake <= now)
+    {
+        lfiber* f = sched->sleeping;
+        sched->sleeping = f->next;
+        lfiber_ready(sched, f);
+    }
+
+    lfiber* last = sched->run_tail;
+    while(sched->run_head != NULL)
+    {
+        lfiber* f = sched->run_head;
+        int end = (f == last);
+
+        sched->run_head = f->next;
+        if(sched->run_head == NULL)
+            sched->run_tail = NULL;
+        lfiber_resume(sched, f);
+        if(end)
+            break;
+    }
+}
+
+/*
+ * lfiber_idle()
+ * If nothing can run, sleep until the next sleeper is due or until
+ * deadline (if not negative), whichever is first. Blocked fibers
+ * wait on other threads, so they are checked for every so often.
+ */
+static void lfiber_idle(lfiber_sched* sched, long deadline)
+{
+    if(sched->run_head != NULL)
+        return;
+
+    long until = deadline;
+    if(sched->sleeping != NULL && (until < 0 || sched->sleeping->wake < until))
+        until = sched->sleeping->wake;
+
+    long now = lfiber_now();
+    if(sched->blocked != NULL && (until < 0 || now + LFIBER_BLOCKED_NAP_US < until))
+        until = now + LFIBER_BLOCKED_NAP_US;
+    if(until > now)
+    {
+        struct timespec ts = {(until - now) / 1000000, ((until - now) % 1000000) * 1000};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/*
+ * lfiber_sched_del()
+ */
+void lfiber_sched_del(lfiber_sched* sched)
+{
+    long stuck = -1;
+
+    while(sched->count > 0 && (sched->run_head != NULL || sched->sleeping != NULL || sched->blocked != NULL))
+    {
+        if(sched->run_head == NULL && sched->sleeping == NULL && !sched->closing)
+        {
+            // only blocked fibers are left, and only another thread can
+            // move a channel for them now
+            long moves = lchan_moves();
+            if(moves != sched->moves)
+                stuck = -1;
+            else if(stuck < 0)
+                stuck = lfiber_now() + LFIBER_STUCK_US;
+            else if(lfiber_now() >= stuck)
+            {
+                sched->closing = 1;
+                lfiber_unblock(sched, 1);
+            }
+        }
+        lfiber_step(sched);
+        lfiber_idle(sched, -1);
+    }
+
+    for(int i = 0; i < sched->num_stacks; ++i)
+        munmap(sched->stacks[i], LFIBER_STACK_SIZE);
+    free(sched);
+}
+
+/*
+ * lfiber_pause()
+ */
+int lfiber_pause(void)
+{
+    lispy_ctx* ctx = lispy_ctx_current();
+    lfiber_sched* sched = (ctx != NULL && !ltask_active() && !lpool_active()) ? ctx->fibers : NULL;
+
+    if(sched == NULL)
+        return 0;
+    if(sched->current != NULL)
+    {
+        lfiber_ready(sched, sched->current);
+        lfiber_suspend(sched);
+        return 1;
+    }
+    lfiber_unblock(sched, 0);
+    if(sched->run_head == NULL && (sched->sleeping == NULL || sched->sleeping->wake > lfiber_now()))
+        return 0;
+    lfiber_step(sched);
+
+    return 1;
+}
+
+/*
+ * lfiber_block()
+ */
+int lfiber_block(void)
+{
+    lfiber_sched* sched = lfiber_here();
+
+    if(sched == NULL || sched->current == NULL)
+        return 0;
+    if(sched->closing)
+        return -1;
+
+    lfiber* f = sched->current;
+    f->next = sched->blocked;
+    sched->blocked = f;
+    lfiber_suspend(sched);
+
+    return sched->closing ? -1 : 1;
+}
+
+/*
+ * lfiber_await()
+ */
+int lfiber_await(lfuture* fut)
+{
+    lfiber_sched* sched = lfiber_here();
+
+    if(sched == NULL)
+        return -1;
+
+    // inside a fiber, let the others run until fut is done
+    if(sched->current != NULL)
+    {
+        while(!lfuture_done(fut))
+        {
+            lfiber_ready(sched, sched->current);
+            lfiber_suspend(sched);
+        }
+        return 0;
+    }
+
+    while(!lfuture_done(fut))
+    {
+        if(sched->run_head == NULL && sched->sleeping == NULL && sched->blocked == NULL)
+            return -1;
+        lfiber_step(sched);
+        if(!lfuture_done(fut))
+            lfiber_idle(sched, -1);
+    }
+
+    return 0;
+}
+
+
+// ======== BUILTINS ======== //
+
+/*
+ * builtin_go()
+ * (go {expr}) -> future of (eval {expr}), run on a new fiber
+ * Inside a task or parallel builtin expr is evaluated straight
+ * away instead.
+ */
+lval* builtin_go(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("go", val, 1);
+    LVAL_ASSERT_TYPE("go", val, 0, LVAL_QEXPR);
+
+    lfuture* fut = lfuture_new(lval_take(val, 0), env);
+    lfiber_sched* sched = lfiber_here();
+    char* stack = (sched != NULL) ? lfiber_stack_alloc(sched) : NULL;
+
+    if(stack == NULL)
+    {
+        lfuture_run(fut);
+        return lval_future(fut);
+    }
+
+    lfiber* f = malloc(sizeof(*f));
+    f->stack = stack;
+    f->fut   = fut;
+    f->wake  = 0;
+    f->prof.depth = 0;
+    getcontext(&f->uc);
+    f->uc.uc_stack.ss_sp   = stack;
+    f->uc.uc_stack.ss_size = LFIBER_STACK_SIZE;
+    f->uc.uc_link          = &sched->main;
+    makecontext(&f->uc, lfiber_entry, 0);
+
+    // the fiber holds a reference until it finishes
+    lfuture_retain(fut);
+    sched->count++;
+    lfiber_ready(sched, f);
+
+    return lval_future(fut);
+}
+
+/*
+ * builtin_yield()
+ * (yield x) -> x, after letting every other runnable fiber run
+ */
+lval* builtin_yield(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("yield", val, 1);
+
+    lfiber_sched* sched = lfiber_here();
+    if(sched != NULL)
+    {
+        if(sched->current != NULL)
+        {
+            lfiber_ready(sched, sched->current);
+            lfiber_suspend(sched);
+        }
+        else
+            lfiber_step(sched);
+    }
+
+    return lval_take(val, 0);
+}
+
+/*
+ * builtin_sleep()
+ * (sleep ms) -> () after ms milliseconds, during which other fibers
+ * run
+ */
+lval* builtin_sleep(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("sleep", val, 1);
+    LVAL_ASSERT_TYPE("sleep", val, 0, LVAL_NUM);
+    LVAL_ASSERT(val, val->cell[0]->num >= 0,
+            "[%s] Function 'sleep': negative time %li", __func__, val->cell[0]->num
+    );
+
+    long deadline = lfiber_now() + val->cell[0]->num * 1000;
+    lfiber_sched* sched = lfiber_here();
+    lval_del(val);
+
+    // no later than the timeout of the evaluation, see lbudget_deadline()
+    long timeout = lbudget_deadline();
+    if(timeout > 0 && (timeout + 999) / 1000 < deadline)
+        deadline = (timeout + 999) / 1000;
+
+    if(sched != NULL && sched->current != NULL)
+    {
+        // insert in wake order, after any fiber due at the same time
+        lfiber* f = sched->current;
+        lfiber** p = &sched->sleeping;
+        while(*p != NULL && (*p)->wake <= deadline)
+            p = &(*p)->next;
+        f->wake = deadline;
+        f->next = *p;
+        *p = f;
+        lfiber_suspend(sched);
+    }
+    else if(sched != NULL)
+    {
+        while(lfiber_now() < deadline)
+        {
+            lfiber_step(sched);
+            lfiber_idle(sched, deadline);
+        }
+    }
+    else
+    {
+        long now = lfiber_now();
+        if(deadline > now)
+        {
+            struct timespec ts = {(deadline - now) / 1000000, ((deadline - now) % 1000000) * 1000};
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    lval* err = lbudget_timed_out();
+    return (err != NULL) ? err : lval_sexpr();
+}
@@ -0,0 +1,89 @@
+/*
+ * FIBER
+ * Cooperative green threads (go/yield/sleep) multiplexed on the
+ * thread that owns an interpreter context.
+ */
+
+#ifndef __BYOL_FIBER_H
+#define __BYOL_FIBER_H
+
+#include <ucontext.h>
+#include "lval.h"
+#include "prof.h"
+
+// as deep as a default main thread stack, only touched pages use memory
+#define LFIBER_STACK_SIZE   (8 * 1024 * 1024)
+#define LFIBER_STACK_CACHE  64
+// how long to wait for other threads to move a channel when only
+// blocked fibers are left
+#define LFIBER_BLOCKED_NAP_US   50
+#define LFIBER_STUCK_US         20000
+
+/*
+ * FIBER
+ * Each fiber evaluates its future on a stack of its own, so it can
+ * be suspended anywhere inside lval_eval() and resumed later.
+ */
+typedef struct lfiber
+{
+    ucontext_t      uc;
+    char*           stack;      // mmap'd, lowest page is a guard
+    lfuture*        fut;
+    long            wake;       // monotonic usec, while sleeping
+    struct lfiber*  next;
+    lprof_stack     prof;       // shadow stack for the profiler
+} lfiber;
+
+/*
+ * SCHEDULER
+ * Fibers only ever switch to and from the scheduler loop, which
+ * runs on the owner's own stack whenever non-fiber code yields,
+ * sleeps or awaits a fiber.
+ */
+typedef struct lfiber_sched
+{
+    ucontext_t  main;
+    lfiber*     current;        // NULL while on the owner's stack
+    lfiber*     run_head;
+    lfiber*     run_tail;
+    lfiber*     sleeping;       // sorted by wake
+    lfiber*     blocked;        // waiting on a channel (see lfiber_block())
+    long        moves;          // lchan_moves() when blocked was last woken
+    int         closing;        // blocked fibers have to give up
+    char*       stacks[LFIBER_STACK_CACHE];
+    int         num_stacks;
+    int         count;          // fibers not yet finished
+} lfiber_sched;
+
+lfiber_sched* lfiber_sched_new(void);
+/*
+ * lfiber_sched_del()
+ * Run every fiber to completion, then free the scheduler. Once only
+ * fibers blocked on channels are left and no channel has moved for
+ * LFIBER_STUCK_US, their waits fail so that they can finish.
+ */
+void          lfiber_sched_del(lfiber_sched* sched);
+
+/*
+ * lfiber_pause()
+ * Let other fibers run: yield if called from a fiber, otherwise run
+ * one step of the scheduler. Returns 0 if no fiber could run.
+ */
+int           lfiber_pause(void);
+/*
+ * lfiber_block()
+ * Park the calling fiber until some channel moves (see lchan_moves()).
+ * Returns 1 once woken, 0 if not called from a fiber, or -1 if the
+ * wait has to give up because the scheduler is being freed.
+ */
+int           lfiber_block(void);
+/*
+ * lfiber_await()
+ * Run fibers (or from inside a fiber, yield) until the fiber behind
+ * fut has finished. Returns -1 if that cannot happen on the calling
+ * thread.
+ */
+int           lfiber_await(lfuture* fut);
+
+
+#endif /*__BYOL_FIBER_H*/
@@ -0,0 +1,558 @@
+/*
+ * LISPY
+ * Interpreter contexts and the reader
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+
+static const char* lispy_rule_names[LISPY_NUM_RULES] = {
+    "number", "decimal", "symbol", "sexpr", "qexpr", "expr", "lispy"
+};
+
+static const char* lispy_grammar =
+    "                                                       \
+      number   : /-?[0-9]+/  ;                              \
+      decimal  : /-?([0-9]*[.])?[0-9]+/  ;                  \
+      symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;          \
+      sexpr    : '(' <expr>* ')';                           \
+      qexpr    : '{' <expr>* '}';                           \
+      expr     : <number> | <symbol> | <sexpr> | <qexpr> ;  \
+      lispy    : /^/ <expr>* /$/ ;                          \
+    ";
+
+static __thread lispy_ctx* lispy_thread_ctx = NULL;
+
+
+// ======== CONTEXT ======== //
+
+/*
+ * lispy_ctx_new()
+ */
+lispy_ctx* lispy_ctx_new(void)
+{
+    lispy_ctx* ctx;
+    mpc_parser_t** p;
+    mpc_err_t* err;
+
+    ctx = malloc(sizeof(*ctx));
+    if(!ctx)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for context\n", __func__, sizeof(*ctx));
+        return NULL;
+    }
+    lheap_init(&ctx->heap, NULL);
+    memset(&ctx->budget, 0, sizeof(ctx->budget));
+    ctx->heap.budget = &ctx->budget;
+    ctx->pool      = NULL;
+    ctx->sched     = NULL;
+    ctx->fibers    = NULL;
+    ctx->speculate = lspec_default_threshold();
+    ctx->mailbox   = NULL;
+
+    // Each context gets its own parsers so that no parser state
+    // is shared between threads
+    p = ctx->rules;
+    for(int i = 0; i < LISPY_NUM_RULES; ++i)
+        p[i] = mpc_new(lispy_rule_names[i]);
+
+    err = mpca_lang(MPCA_LANG_DFA, lispy_grammar, p[0], p[1], p[2], p[3], p[4], p[5], p[6]);
+    if(err != NULL)
+    {
+        fprintf(stderr, "[%s] failed to build grammar\n", __func__);
+        mpc_err_print_to(err, stderr);
+        mpc_err_delete(err);
+        mpc_cleanup(LISPY_NUM_RULES, p[0], p[1], p[2], p[3], p[4], p[5], p[6]);
+        free(ctx);
+        return NULL;
+    }
+
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    ctx->env = lenv_new_global();
+    lenv_init_builtins(ctx->env);
+    ctx->mailbox = lmailbox_new();
+    if(ctx->mailbox != NULL)
+        lactor_bind_self(ctx->env, ctx->mailbox);
+    lispy_ctx_use(prev);
+
+    return ctx;
+}
+
+/*
+ * lispy_ctx_del()
+ */
+void lispy_ctx_del(lispy_ctx* ctx)
+{
+    mpc_parser_t** p = ctx->rules;
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+
+    // fibers may still spawn tasks and tasks may still use the pool
+    if(ctx->fibers != NULL)
+        lfiber_sched_del(ctx->fibers);
+    if(ctx->sched != NULL)
+        lsched_del(ctx->sched);
+    if(ctx->pool != NULL)
+        lpool_del(ctx->pool);
+    lenv_del(ctx->env);
+    lispy_ctx_use(prev != ctx ? prev : NULL);
+    if(ctx->mailbox != NULL)
+    {
+        lmailbox_close(ctx->mailbox);
+        lmailbox_release(ctx->mailbox);
+    }
+
+    mpc_cleanup(LISPY_NUM_RULES, p[0], p[1], p[2], p[3], p[4], p[5], p[6]);
+    lheap_destroy(&ctx->heap);
+    free(ctx);
+}
+
+/*
+ * lispy_ctx_use()
+ */
+lispy_ctx* lispy_ctx_use(lispy_ctx* ctx)
+{
+    lispy_ctx* prev = lispy_thread_ctx;
+
+    lispy_thread_ctx = ctx;
+    lheap_set_current(ctx != NULL ? &ctx->heap : NULL);
+
+    return prev;
+}
+
+/*
+ * lispy_ctx_current()
+ */
+lispy_ctx* lispy_ctx_current(void)
+{
+    return lispy_thread_ctx;
+}
+
+/*
+ * lispy_ctx_pool()
+ */
+lpool* lispy_ctx_pool(lispy_ctx* ctx)
+{
+    if(ctx->pool == NULL)
+        ctx->pool = lpool_new(lpool_default_size(), &ctx->heap);
+
+    return ctx->pool;
+}
+
+/*
+ * lispy_ctx_sched()
+ */
+lsched* lispy_ctx_sched(lispy_ctx* ctx)
+{
+    if(ctx->sched == NULL)
+    {
+        ctx->sched = lsched_new(lpool_default_size(), &ctx->heap);
+        ctx->sched->speculate = ctx->speculate;
+    }
+
+    return ctx->sched;
+}
+
+/*
+ * lispy_ctx_fibers()
+ */
+lfiber_sched* lispy_ctx_fibers(lispy_ctx* ctx)
+{
+    if(ctx->fibers == NULL)
+        ctx->fibers = lfiber_sched_new();
+
+    return ctx->fibers;
+}
+
+/*
+ * lispy_read()
+ */
+lval* lispy_read(lispy_ctx* ctx, const char* filename, const char* src, char** err)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    lval* x = lispy_parse(ctx, filename, src, err);
+    lispy_ctx_use(prev);
+
+    return x;
+}
+
+/*
+ * lispy_parse()
+ */
+lval* lispy_parse(lispy_ctx* ctx, const char* filename, const char* src, char** err)
+{
+    mpc_result_t r;
+    lval* x = NULL;
+    int depth = __atomic_load_n(&lprof_on, __ATOMIC_RELAXED) ? lprof_push("<parse>") : -1;
+    long start = __atomic_load_n(&ltrace_on, __ATOMIC_RELAXED) ? ltrace_now() : 0;
+
+    if(mpc_parse(filename, src, ctx->rules[LISPY_LISPY], &r))
+    {
+        x = lval_read(r.output);
+        mpc_ast_delete(r.output);
+    }
+    else
+    {
+        if(err != NULL)
+            *err = mpc_err_string(r.error);
+        mpc_err_delete(r.error);
+    }
+    if(depth >= 0)
+        lprof_pop(depth);
+    if(start != 0)
+        ltrace_complete(LTRACE_PARSE, "parse", start, ltrace_now(), -1);
+
+    return x;
+}
+
+/*
+ * lispy_eval()
+ */
+lval* lispy_eval(lispy_ctx* ctx, lval* expr)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    lval* x;
+
+    lbudget_start(&ctx->budget);
+    if(!__atomic_load_n(&ltrace_on, __ATOMIC_RELAXED))
+        x = lval_eval(ctx->env, expr);
+    else
+    {
+        // traced, along with the lvals the form made
+        lmemstats before, after;
+        lheap_stats(&ctx->heap, &before);
+        long start = ltrace_now();
+        x = lval_eval(ctx->env, expr);
+        long end = ltrace_now();
+        lheap_stats(&ctx->heap, &after);
+        long made = after.kinds[LMEM_LVAL].total - before.kinds[LMEM_LVAL].total;
+        ltrace_complete(LTRACE_EVAL, "eval", start, end, made);
+        ltrace_memory(after.kinds[LMEM_LVAL].live, made);
+    }
+    lbudget_stop(&ctx->budget);
+    lispy_ctx_use(prev);
+
+    return x;
+}
+
+
+// ======== READER ======== //
+
+/*
+ * lval_read_num()
+ */
+lval* lval_read_num(mpc_ast_t* ast)
+{
+    long x;
+
+    errno = 0;
+    x = strtol(ast->contents, NULL, 10);
+    if(errno == ERANGE)
+        return lval_err("Invalid number");
+    else
+        return lval_num(x);
+}
+
+/*
+ * lval_read_decimal()
+ */
+lval* lval_read_decimal(mpc_ast_t* ast)
+{
+    char* end;
+    double dec;
+
+    errno = 0;
+    dec = strtod(ast->contents, &end);
+    if(errno == ERANGE)
+        return lval_err("Invalid number");
+    else
+        return lval_decimal(dec);
+}
+
+/*
+ * lval_read()
+ */
+lval* lval_read(mpc_ast_t* ast)
+{
+    // If input is a symbol or a number then return a conversion to that type
+    if(strstr(ast->tag, "number"))
+        return lval_read_num(ast);
+    //if(strstr(ast->tag, "decimal"))
+    //    return lval_read_decimal(ast);
+    if(strstr(ast->tag, "symbol"))
+        return lval_sym(ast->contents);
+
+    // If this is the root (>) or an S-expr then create an empty list
+    lval* val = NULL;
+    if(strcmp(ast->tag, ">") == 0)  // TODO :never evaluates true?
+    {
+        val = lval_sexpr();
+    }
+    if(strstr(ast->tag, "sexpr"))
+        val = lval_sexpr();
+    if(strstr(ast->tag, "qexpr"))
+        val = lval_qexpr();
+
+    // Fill the list with valid expressions in the sexpr
+    for(int i = 0; i < ast->children_num; ++i)
+    {
+        // unpack parens
+        if(strncmp(ast->children[i]->contents, "(", 1) == 0)
+            continue;
+        if(strncmp(ast->children[i]->contents, ")", 1) == 0)
+            continue;
+        if(strncmp(ast->children[i]->contents, "{", 1) == 0)
+            continue;
+        if(strncmp(ast->children[i]->contents, "}", 1) == 0)
+            continue;
+        if(strncmp(ast->children[i]->tag, "regex", 5) == 0)
+            continue;
+        val = lval_add(val, lval_read(ast->children[i]));
+    }
+
+    return val;
+}
+
+// ======== EMBEDDING ======== //
+
+/*
+ * lispy_version()
+ */
+const char* lispy_version(void)
+{
+    return LISPY_VERSION;
+}
+
+/*
+ * lispy_eval_line()
+ * Evaluate one line, replacing *result unless the line is blank.
+ * Returns 0, or -1 if *result is now an error. ctx must be current.
+ */
+static int lispy_eval_line(lispy_ctx* ctx, const char* name, const char* line, lval** result)
+{
+    if(line[strspn(line, " \t\r\n")] == '\0')
+        return 0;
+
+    char* err = NULL;
+    lval* expr = lispy_read(ctx, name, line, &err);
+    lval* x;
+    if(expr != NULL)
+        x = lispy_eval(ctx, expr);
+    else
+    {
+        // mpc ends its messages with a newline
+        size_t len = (err != NULL) ? strlen(err) : 0;
+        if(len > 0 && err[len - 1] == '\n')
+            err[len - 1] = '\0';
+        x = lval_err("%s", (err != NULL) ? err : "parse error");
+        free(err);
+    }
+    lval_del(*result);
+    *result = x;
+
+    return (x->type == LVAL_ERR) ? -1 : 0;
+}
+
+/*
+ * lispy_eval_string()
+ */
+lval* lispy_eval_string(lispy_ctx* ctx, const char* name, const char* src)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    lval* result = lval_sexpr();
+    char* line = NULL;
+    size_t cap = 0;
+
+    while(*src != '\0')
+    {
+        size_t len = strcspn(src, "\n");
+        if(len + 1 > cap)
+        {
+            cap = len + 1;
+            line = realloc(line, cap);
+        }
+        memcpy(line, src, len);
+        line[len] = '\0';
+        src += len + (src[len] == '\n');
+
+        if(lispy_eval_line(ctx, name, line, &result) != 0)
+            break;
+    }
+    free(line);
+    lispy_ctx_use(prev);
+
+    return result;
+}
+
+/*
+ * lispy_eval_file()
+ */
+lval* lispy_eval_file(lispy_ctx* ctx, const char* filename)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    lval* result;
+
+    FILE* fp = fopen(filename, "r");
+    if(!fp)
+        result = lval_err("[%s] failed to open file [%s]", __func__, filename);
+    else
+    {
+        char* line = NULL;
+        size_t cap = 0;
+
+        result = lval_sexpr();
+        while(getline(&line, &cap, fp) != -1)
+        {
+            if(lispy_eval_line(ctx, filename, line, &result) != 0)
+                break;
+        }
+        free(line);
+        fclose(fp);
+    }
+    lispy_ctx_use(prev);
+
+    return result;
+}
+
+/*
+ * lispy_add_builtin()
+ */
+void lispy_add_builtin(lispy_ctx* ctx, const char* name, lbuiltin func)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    lenv_add_builtin(ctx->env, (char*) name, func);
+    lenv_rebound(ctx->env);
+    lispy_ctx_use(prev);
+}
+
+/*
+ * lispy_set_budget()
+ */
+void lispy_set_budget(lispy_ctx* ctx, long max_steps, long max_depth, long max_bytes, long timeout_ms)
+{
+    ctx->budget.max_steps  = max_steps;
+    ctx->budget.max_depth  = max_depth;
+    ctx->budget.max_bytes  = max_bytes;
+    ctx->budget.timeout_ms = timeout_ms;
+}
+
+/*
+ * lispy_node_stop()
+ */
+void lispy_node_stop(void)
+{
+    lactor_stop();
+}
+
+/*
+ * lispy_value_type()
+ */
+lval_type lispy_value_type(const lval* v)
+{
+    return v->type;
+}
+
+/*
+ * lispy_value_num()
+ */
+long lispy_value_num(const lval* v)
+{
+    return (v->type == LVAL_NUM) ? v->num : 0;
+}
+
+/*
+ * lispy_value_decimal()
+ */
+double lispy_value_decimal(const lval* v)
+{
+    if(v->type == LVAL_DECIMAL)
+        return v->decimal;
+    return (v->type == LVAL_NUM) ? (double) v->num : 0.0;
+}
+
+/*
+ * lispy_value_text()
+ */
+const char* lispy_value_text(const lval* v)
+{
+    switch(v->type)
+    {
+        case LVAL_ERR:
+            return v->err;
+        case LVAL_SYM:
+            return v->sym;
+        case LVAL_STR:
+            return v->str;
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * lispy_value_count()
+ */
+int lispy_value_count(const lval* v)
+{
+    return (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) ? v->count : 0;
+}
+
+/*
+ * lispy_value_item()
+ */
+lval* lispy_value_item(const lval* v, int i)
+{
+    if(i < 0 || i >= lispy_value_count(v))
+        return NULL;
+
+    return v->cell[i];
+}
+
+/*
+ * lispy_value_print()
+ */
+char* lispy_value_print(lispy_ctx* ctx, lval* v)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    char* s = lval_to_string(v);
+    lispy_ctx_use(prev);
+
+    return s;
+}
+
+/*
+ * lispy_value_del()
+ */
+void lispy_value_del(lispy_ctx* ctx, lval* v)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    lval_del(v);
+    lispy_ctx_use(prev);
+}
+
+/*
+ * lispy_value_dump()
+ */
+char* lispy_value_dump(lispy_ctx* ctx, lval* v, size_t* len)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    char* data = lval_snapshot_dump(v, ctx->env, len);
+    lispy_ctx_use(prev);
+
+    return data;
+}
+
+/*
+ * lispy_value_load()
+ */
+lval* lispy_value_load(lispy_ctx* ctx, const char* data, size_t len)
+{
+    lispy_ctx* prev = lispy_ctx_use(ctx);
+    lval* v = lval_snapshot_restore(ctx->env, data, len);
+    lispy_ctx_use(prev);
+
+    return v;
+}
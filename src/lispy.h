@@ -0,0 +1,230 @@
+/*
+ * LISPY
+ * An interpreter context. Everything one interpreter needs (heap,
+ * global environment and grammar) lives in a lispy_ctx, so any
+ * number of interpreters can run side by side, one per thread.
+ *
+ * This is also the interface of liblispy (see EMBEDDING below) for
+ * programs that embed the interpreter.
+ */
+
+#ifndef __BYOL_LISPY_H
+#define __BYOL_LISPY_H
+
+#include <stddef.h>
+
+#define LISPY_VERSION       "0.0.0.2"
+// bumped whenever a function of EMBEDDING changes incompatibly
+#define LISPY_API_VERSION   2
+
+/*
+ * CONTEXT
+ * Opaque outside the interpreter, its layout is in context.h
+ */
+typedef struct lispy_ctx lispy_ctx;
+
+/*
+ * VALUE
+ * Values and environments are opaque too, see lval.h
+ */
+typedef struct lval lval;
+typedef struct lenv lenv;
+
+// list of valid lval types
+typedef enum
+{
+    LVAL_ERR,
+    LVAL_NUM,
+    LVAL_DECIMAL,
+    LVAL_FUNC,
+    LVAL_SYM,
+    LVAL_SEXPR,
+    LVAL_QEXPR,
+    LVAL_FUTURE,
+    LVAL_CHAN,
+    LVAL_PID,
+    LVAL_STR
+} lval_type;
+
+// Lisp builtin function
+typedef lval* (*lbuiltin)(lenv*, lval*);
+
+/*
+ * BUDGET
+ * Limits on one evaluation, so that a runaway script cannot take a
+ * thread with it. An interpreter context has a budget that every
+ * heap sharing its heap points to, and lispy_eval() starts
+ * it afresh for each evaluation. Each thread counts its own steps
+ * (S-Expressions evaluated), the depth of its nested calls and the
+ * bytes its heap put in use since the start. The first limit to run
+ * out, on any thread, makes every later step of every thread return
+ * an error, so the evaluation unwinds and frees what it made.
+ */
+typedef enum
+{
+    LBUDGET_OK,
+    LBUDGET_STEPS,
+    LBUDGET_DEPTH,
+    LBUDGET_BYTES,
+    LBUDGET_TIME
+} lbudget_limit;
+
+typedef struct lbudget
+{
+    // limits, 0 for none
+    long    max_steps;
+    long    max_depth;
+    long    max_bytes;
+    long    timeout_ms;
+    // set by lbudget_start()
+    int     active;
+    long    generation;     // heaps reset their counts when this changes
+    long    deadline;       // CLOCK_MONOTONIC ns, 0 for none
+    int     over;           // the lbudget_limit that ran out
+} lbudget;
+
+
+/*
+ * lispy_ctx_new()
+ * Create an interpreter with the builtins installed. Returns NULL
+ * if the grammar fails to build.
+ */
+lispy_ctx* lispy_ctx_new(void);
+/*
+ * lispy_ctx_del()
+ * Free the context along with every value made while it was
+ * current.
+ */
+void       lispy_ctx_del(lispy_ctx* ctx);
+/*
+ * lispy_ctx_use()
+ * Make ctx (and its heap) current on the calling thread. Values
+ * made or deleted by lval.c go to the current context. Returns the
+ * previous context, which may be NULL.
+ */
+lispy_ctx* lispy_ctx_use(lispy_ctx* ctx);
+/*
+ * lispy_ctx_current()
+ * The context current on the calling thread, or NULL.
+ */
+lispy_ctx* lispy_ctx_current(void);
+
+/*
+ * lispy_read()
+ * Parse src into an S-Expression. On a parse error returns NULL and
+ * if err is not NULL sets it to the (malloc'd) error message.
+ */
+lval* lispy_read(lispy_ctx* ctx, const char* filename, const char* src, char** err);
+/*
+ * lispy_eval()
+ * Evaluate expr in the global environment of ctx. Takes ownership
+ * of expr. The limits set with lispy_set_budget() apply to this
+ * evaluation, and an evaluation that goes over them returns an error.
+ */
+lval* lispy_eval(lispy_ctx* ctx, lval* expr);
+
+// ======== EMBEDDING ======== //
+/*
+ * A program linked against liblispy makes a context with
+ * lispy_ctx_new(), evaluates code with lispy_eval_string() or
+ * lispy_eval_file(), looks at the results with the lispy_value_*()
+ * functions and frees them with lispy_value_del(). Values belong to
+ * the context that made them. A lispy_ctx is opaque, and is only set
+ * up through the functions here. Every function here makes its context
+ * current for the duration of the call, so contexts can be used from
+ * any thread, one thread at a time.
+ */
+
+/*
+ * lispy_version()
+ * LISPY_VERSION of the library, which may be newer than the header
+ */
+const char* lispy_version(void);
+/*
+ * lispy_eval_string()
+ * Evaluate src a line at a time, as the repl evaluates a file, and
+ * return the result of the last line that is not blank. Stops at the
+ * first line that fails to parse or evaluates to an error, and
+ * returns that error. name is used in parse errors.
+ */
+lval* lispy_eval_string(lispy_ctx* ctx, const char* name, const char* src);
+/*
+ * lispy_eval_file()
+ * lispy_eval_string() on the contents of filename. Returns an error
+ * if the file cannot be read.
+ */
+lval* lispy_eval_file(lispy_ctx* ctx, const char* filename);
+/*
+ * lispy_add_builtin()
+ * Bind name to a native builtin. Like the builtins of lval.c, func
+ * owns its arguments and returns a new value, made with the lval
+ * constructors (lval_num(), lval_err(), ...).
+ */
+void  lispy_add_builtin(lispy_ctx* ctx, const char* name, lbuiltin func);
+/*
+ * lispy_set_budget()
+ * Limit each evaluation of ctx to max_steps steps, max_depth nested
+ * calls, max_bytes bytes of values and timeout_ms milliseconds (see
+ * BUDGET above). 0 leaves that limit off.
+ */
+void  lispy_set_budget(lispy_ctx* ctx, long max_steps, long max_depth, long max_bytes, long timeout_ms);
+/*
+ * lispy_node_stop()
+ * Remove the socket of this process, if it has served as a node (see
+ * actor.h). The library installs no signal handlers, so a program
+ * embedding it should call this at exit.
+ */
+void  lispy_node_stop(void);
+
+// Making values, for builtins to return
+lval* lval_num(long x);
+lval* lval_decimal(double x);
+lval* lval_err(char* fmt, ...);
+lval* lval_sym(char* s);
+lval* lval_str(const char* s);
+lval* lval_sexpr(void);
+lval* lval_qexpr(void);
+/*
+ * lval_add()
+ * Append x to the S- or Q-Expression v, which takes x over. Returns v.
+ */
+lval* lval_add(lval* v, lval* x);
+
+// Inspecting values. None of these take ownership of v.
+lval_type   lispy_value_type(const lval* v);
+// the number of a NUM, or 0
+long        lispy_value_num(const lval* v);
+// the number of a DECIMAL or NUM, or 0
+double      lispy_value_decimal(const lval* v);
+// the message of an ERR, name of a SYM or text of a STR, or NULL
+const char* lispy_value_text(const lval* v);
+// elements of an S- or Q-Expression, or 0
+int         lispy_value_count(const lval* v);
+// element i of an S- or Q-Expression, still owned by v, or NULL
+lval*       lispy_value_item(const lval* v, int i);
+/*
+ * lispy_value_print()
+ * The printed form of v as a malloc'd string
+ */
+char*       lispy_value_print(lispy_ctx* ctx, lval* v);
+/*
+ * lispy_value_del()
+ */
+void        lispy_value_del(lispy_ctx* ctx, lval* v);
+/*
+ * lispy_value_dump()
+ * Serialize v in the snapshot format (see snapshot.h), which only
+ * another interpreter of the same build can read. Builtins are
+ * written by the name they are bound to in ctx. Returns a malloc'd
+ * buffer of *len bytes, or NULL if v holds a future or a channel.
+ */
+char*       lispy_value_dump(lispy_ctx* ctx, lval* v, size_t* len);
+/*
+ * lispy_value_load()
+ * A value of ctx from the output of lispy_value_dump(), or NULL if
+ * data is no good.
+ */
+lval*       lispy_value_load(lispy_ctx* ctx, const char* data, size_t len);
+
+
+#endif /*__BYOL_LISPY_H*/
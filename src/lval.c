@@ -3,18 +3,500 @@
  * Lisp values 
  */
 
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "lval.h"
+#include "parallel.h"
+#include "task.h"
+#include "chan.h"
+#include "spec.h"
+#include "prof.h"
+#include "stats.h"
+#include "trace.h"
+
+// ======== HEAP ======== //
+
+static lheap lheap_default = {
+    .symtab      = &lheap_default.own,
+    .shared_lock = PTHREAD_MUTEX_INITIALIZER
+};
+static __thread lheap* lheap_thread = NULL;
+
+static void lsymtab_free(void* slot);
+static void lbudget_check_bytes(lheap* heap);
 
 /*
- * __lval_create()
- * Private lval constructor
+ * lheap_init()
  */
-lval* __lval_create(long num, double decimal, char* m, char* s, int type)
+void lheap_init(lheap* heap, lheap* share)
+{
+    // sharers of a sharer register with the heap it shares
+    if(share != NULL && share->owner != NULL)
+        share = share->owner;
+
+    heap->free       = NULL;
+    heap->free_count = 0;
+    heap->symtab     = (share != NULL) ? share->symtab : &heap->own;
+    heap->own.root   = NULL;
+    memset(&heap->stats, 0, sizeof(heap->stats));
+    memset(&heap->gone, 0, sizeof(heap->gone));
+    heap->owner       = share;
+    heap->shared      = NULL;
+    heap->next_shared = NULL;
+    pthread_mutex_init(&heap->shared_lock, NULL);
+    heap->budget      = (share != NULL) ? share->budget : NULL;
+    heap->generation  = 0;
+    heap->steps       = 0;
+    heap->depth       = 0;
+    heap->bytes_limit = 0;
+
+    if(share != NULL)
+    {
+        pthread_mutex_lock(&share->shared_lock);
+        heap->next_shared = share->shared;
+        share->shared = heap;
+        pthread_mutex_unlock(&share->shared_lock);
+    }
+}
+
+/*
+ * lheap_destroy()
+ */
+void lheap_destroy(lheap* heap)
 {
-    lval* val;
+    while(heap->free != NULL)
+    {
+        lval* next = heap->free->body;
+        free(heap->free);
+        heap->free = next;
+    }
+    heap->free_count = 0;
+
+    lsymtab_free(heap->own.root);
+    heap->own.root = NULL;
+
+    lheap* owner = heap->owner;
+    if(owner != NULL)
+    {
+        pthread_mutex_lock(&owner->shared_lock);
+        lheap** link = &owner->shared;
+        while(*link != NULL && *link != heap)
+            link = &(*link)->next_shared;
+        if(*link != NULL)
+            *link = heap->next_shared;
+        lmemstats_add(&owner->gone, &heap->stats);
+        pthread_mutex_unlock(&owner->shared_lock);
+        heap->owner = NULL;
+    }
+    pthread_mutex_destroy(&heap->shared_lock);
+}
+
+/*
+ * lheap_current()
+ */
+lheap* lheap_current(void)
+{
+    return (lheap_thread != NULL) ? lheap_thread : &lheap_default;
+}
+
+/*
+ * lheap_set_current()
+ */
+lheap* lheap_set_current(lheap* heap)
+{
+    lheap* prev = lheap_thread;
+    lheap_thread = heap;
+
+    return prev;
+}
+
+// ======== MEMORY STATISTICS ======== //
+
+/*
+ * lheap_count()
+ * Only the thread of heap writes its counters, but others read them
+ * (see lheap_stats()), so the stores are atomic without being a
+ * read-modify-write.
+ */
+static inline void lheap_count(lheap* heap, lmem_kind kind, long live, long total, long bytes)
+{
+    lmem_counter* c = &heap->stats.kinds[kind];
+    long now = c->bytes + bytes;
+
+    __atomic_store_n(&c->live, c->live + live, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->total, c->total + total, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->bytes, now, __ATOMIC_RELAXED);
+    if(now > c->peak)
+        __atomic_store_n(&c->peak, now, __ATOMIC_RELAXED);
+    if(bytes > 0 && heap->bytes_limit > 0)
+        lbudget_check_bytes(heap);
+}
+
+/*
+ * lmem_count()
+ */
+void lmem_count(lmem_kind kind, long live, long total, long bytes)
+{
+    lheap_count(lheap_current(), kind, live, total, bytes);
+}
+
+/*
+ * lmem_kind_str()
+ */
+const char* lmem_kind_str(lmem_kind kind)
+{
+    switch(kind)
+    {
+        case LMEM_LVAL:
+            return "lval";
+        case LMEM_LENV:
+            return "lenv";
+        case LMEM_CELL:
+            return "cell";
+        case LMEM_STRING:
+            return "string";
+        case LMEM_SYMBOL:
+            return "symbol";
+        default:
+            return "unknown";
+    }
+}
+
+/*
+ * lmemstats_add()
+ * stats may be the live counters of some heap
+ */
+void lmemstats_add(lmemstats* sum, lmemstats* stats)
+{
+    for(int k = 0; k < LMEM_NUM_KINDS; ++k)
+    {
+        sum->kinds[k].live  += __atomic_load_n(&stats->kinds[k].live, __ATOMIC_RELAXED);
+        sum->kinds[k].total += __atomic_load_n(&stats->kinds[k].total, __ATOMIC_RELAXED);
+        sum->kinds[k].bytes += __atomic_load_n(&stats->kinds[k].bytes, __ATOMIC_RELAXED);
+        sum->kinds[k].peak  += __atomic_load_n(&stats->kinds[k].peak, __ATOMIC_RELAXED);
+    }
+    sum->copies += __atomic_load_n(&stats->copies, __ATOMIC_RELAXED);
+}
+
+/*
+ * lheap_stats()
+ */
+void lheap_stats(lheap* heap, lmemstats* out)
+{
+    if(heap->owner != NULL)
+        heap = heap->owner;
+
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&heap->shared_lock);
+    lmemstats_add(out, &heap->stats);
+    lmemstats_add(out, &heap->gone);
+    for(lheap* h = heap->shared; h != NULL; h = h->next_shared)
+        lmemstats_add(out, &h->stats);
+    pthread_mutex_unlock(&heap->shared_lock);
+}
+
+/*
+ * lmemstats_fprint()
+ */
+void lmemstats_fprint(FILE* fp, lmemstats* stats)
+{
+    fprintf(fp, "%-8s %12s %14s %14s %14s\n", "kind", "live", "total", "bytes", "peak");
+    for(int k = 0; k < LMEM_NUM_KINDS; ++k)
+    {
+        fprintf(fp, "%-8s %12ld %14ld %14ld %14ld\n", lmem_kind_str(k),
+                stats->kinds[k].live, stats->kinds[k].total, stats->kinds[k].bytes, stats->kinds[k].peak);
+    }
+    fprintf(fp, "%-8s %12ld\n", "copies", stats->copies);
+}
+
+// ======== BUDGET ======== //
+
+static long lbudget_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * lbudget_start()
+ */
+void lbudget_start(lbudget* budget)
+{
+    int active = budget->max_steps > 0 || budget->max_depth > 0 ||
+                 budget->max_bytes > 0 || budget->timeout_ms > 0;
+    long deadline = (budget->timeout_ms > 0) ? lbudget_now() + budget->timeout_ms * 1000000L : 0;
+
+    __atomic_store_n(&budget->deadline, deadline, __ATOMIC_RELAXED);
+    __atomic_store_n(&budget->over, LBUDGET_OK, __ATOMIC_RELAXED);
+    __atomic_store_n(&budget->generation, budget->generation + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&budget->active, active, __ATOMIC_RELEASE);
+}
+
+/*
+ * lbudget_stop()
+ */
+void lbudget_stop(lbudget* budget)
+{
+    __atomic_store_n(&budget->active, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * lbudget_limit_str()
+ */
+const char* lbudget_limit_str(lbudget_limit limit)
+{
+    switch(limit)
+    {
+        case LBUDGET_OK:
+            return "ok";
+        case LBUDGET_STEPS:
+            return "steps";
+        case LBUDGET_DEPTH:
+            return "depth";
+        case LBUDGET_BYTES:
+            return "bytes";
+        case LBUDGET_TIME:
+            return "time";
+        default:
+            return "unknown";
+    }
+}
+
+/*
+ * lbudget_over()
+ * Only the first limit to run out is kept
+ */
+static void lbudget_over(lbudget* budget, lbudget_limit limit)
+{
+    int ok = LBUDGET_OK;
+    __atomic_compare_exchange_n(&budget->over, &ok, limit, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/*
+ * lheap_bytes()
+ * Bytes in use by this heap alone
+ */
+static long lheap_bytes(lheap* heap)
+{
+    long bytes = 0;
+    for(int k = 0; k < LMEM_NUM_KINDS; ++k)
+        bytes += heap->stats.kinds[k].bytes;
+
+    return bytes;
+}
+
+/*
+ * lbudget_check_bytes()
+ * Called by the allocator once the heap has a byte limit
+ */
+static void lbudget_check_bytes(lheap* heap)
+{
+    lbudget* budget = heap->budget;
+
+    if(lheap_bytes(heap) > heap->bytes_limit &&
+       __atomic_load_n(&budget->active, __ATOMIC_ACQUIRE) &&
+       __atomic_load_n(&budget->generation, __ATOMIC_RELAXED) == heap->generation)
+        lbudget_over(budget, LBUDGET_BYTES);
+}
+
+/*
+ * lbudget_err()
+ * The error for the limit that ran out, or NULL
+ */
+static lval* lbudget_err(lbudget* budget)
+{
+    switch(__atomic_load_n(&budget->over, __ATOMIC_RELAXED))
+    {
+        case LBUDGET_STEPS:
+            return lval_err("[lbudget_check] evaluation over budget: more than %ld steps", budget->max_steps);
+        case LBUDGET_DEPTH:
+            return lval_err("[lbudget_check] evaluation over budget: calls nested more than %ld deep", budget->max_depth);
+        case LBUDGET_BYTES:
+            return lval_err("[lbudget_check] evaluation over budget: more than %ld bytes", budget->max_bytes);
+        case LBUDGET_TIME:
+            return lval_err("[lbudget_check] evaluation over budget: more than %ld ms", budget->timeout_ms);
+        default:
+            return NULL;
+    }
+}
+
+/*
+ * lbudget_check()
+ * Count a step against the budget of heap. Returns NULL, or the error
+ * to evaluate to once a limit has run out.
+ */
+static lval* lbudget_check(lheap* heap, lbudget* budget)
+{
+    long generation = __atomic_load_n(&budget->generation, __ATOMIC_RELAXED);
+    if(heap->generation != generation)
+    {
+        heap->generation  = generation;
+        heap->steps       = 0;
+        heap->bytes_limit = (budget->max_bytes > 0) ? lheap_bytes(heap) + budget->max_bytes : 0;
+    }
+
+    heap->steps++;
+    if(budget->max_steps > 0 && heap->steps > budget->max_steps)
+        lbudget_over(budget, LBUDGET_STEPS);
+    if(budget->max_depth > 0 && heap->depth > budget->max_depth)
+        lbudget_over(budget, LBUDGET_DEPTH);
+    // on every step, since a single step (a join of a huge list, say)
+    // can take longer than the whole timeout
+    long deadline = __atomic_load_n(&budget->deadline, __ATOMIC_RELAXED);
+    if(deadline > 0 && lbudget_now() > deadline)
+        lbudget_over(budget, LBUDGET_TIME);
+
+    return lbudget_err(budget);
+}
+
+/*
+ * lbudget_deadline()
+ */
+long lbudget_deadline(void)
+{
+    lbudget* budget = lheap_current()->budget;
+
+    if(budget == NULL || !__atomic_load_n(&budget->active, __ATOMIC_ACQUIRE))
+        return 0;
+
+    return __atomic_load_n(&budget->deadline, __ATOMIC_RELAXED);
+}
+
+/*
+ * lbudget_timed_out()
+ */
+lval* lbudget_timed_out(void)
+{
+    lbudget* budget = lheap_current()->budget;
+    long deadline = lbudget_deadline();
+
+    if(deadline <= 0 || lbudget_now() < deadline)
+        return NULL;
+    lbudget_over(budget, LBUDGET_TIME);
+
+    return lbudget_err(budget);
+}
+
+/*
+ * lheap_hash()
+ * FNV-1a
+ */
+static size_t lheap_hash(const char* s)
+{
+    uint64_t h = 14695981039346656037u;
+    while(*s)
+        h = (h ^ (unsigned char) *s++) * 1099511628211u;
+
+    return h;
+}
+
+/*
+ * lsymtab_free()
+ */
+static void lsymtab_free(void* slot)
+{
+    if((uintptr_t) slot & 1)
+    {
+        lsymnode* node = (lsymnode*) ((uintptr_t) slot & ~(uintptr_t) 1);
+        for(int i = 0; i < (1 << LSYMTAB_BITS); ++i)
+            lsymtab_free(node->slots[i]);
+        free(node);
+        return;
+    }
+
+    lsym* sym = slot;
+    while(sym != NULL)
+    {
+        lsym* next = sym->next;
+        free(sym);
+        sym = next;
+    }
+}
+
+/*
+ * lval_intern()
+ */
+char* lval_intern(const char* s)
+{
+    size_t hash = lheap_hash(s);
+    void** slot = &lheap_current()->symtab->root;
+    int shift = 0;
+    lsym* sym = NULL;
+    void* cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+
+    while(1)
+    {
+        if((uintptr_t) cur & 1)
+        {
+            lsymnode* node = (lsymnode*) ((uintptr_t) cur & ~(uintptr_t) 1);
+            slot = &node->slots[(hash >> shift) & ((1 << LSYMTAB_BITS) - 1)];
+            shift += LSYMTAB_BITS;
+            cur = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        lsym* leaf = cur;
+        for(lsym* n = leaf; n != NULL; n = n->next)
+        {
+            if(n->hash == hash && strcmp(n->name, s) == 0)
+            {
+                free(sym);
+                return n->name;
+            }
+        }
+
+        // a different hash moves the names here one level down, the
+        // same hash (or no bits left) shares the slot
+        if(leaf != NULL && leaf->hash != hash && shift < 64)
+        {
+            lsymnode* node = calloc(1, sizeof(*node));
+            node->slots[(leaf->hash >> shift) & ((1 << LSYMTAB_BITS) - 1)] = leaf;
+            if(!__atomic_compare_exchange_n(slot, &cur, (void*) ((uintptr_t) node | 1), 0,
+                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                free(node);
+            else
+                cur = (void*) ((uintptr_t) node | 1);
+            continue;
+        }
+
+        if(sym == NULL)
+        {
+            sym = malloc(sizeof(*sym) + strlen(s) + 1);
+            sym->hash = hash;
+            strcpy(sym->name, s);
+        }
+        sym->next = leaf;
+        if(__atomic_compare_exchange_n(slot, &cur, sym, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+        {
+            lmem_count(LMEM_SYMBOL, 1, 1, sizeof(*sym) + strlen(s) + 1);
+            return sym->name;
+        }
+        // cur is now whatever beat us to the slot
+    }
+}
+
+/*
+ * lval_alloc()
+ * Take an lval from the free list of the current heap
+ */
+static lval* lval_alloc(void)
+{
+    lheap* heap = lheap_current();
+    lval* val = heap->free;
+
+    lheap_count(heap, LMEM_LVAL, 1, 1, sizeof(*val));
+    if(val != NULL)
+    {
+        heap->free = val->body;
+        heap->free_count--;
+        return val;
+    }
 
     val = malloc(sizeof(*val));
     if(!val)
@@ -22,8 +504,41 @@ lval* __lval_create(long num, double decimal, char* m, char* s, int type)
         fprintf(stderr, "[%s] failed to allocate %ld bytes for lval\n", 
                 __func__, sizeof(*val)
         );
-        return NULL;
     }
+
+    return val;
+}
+
+/*
+ * lval_free()
+ * Return an lval to the free list of the current heap
+ */
+static void lval_free(lval* val)
+{
+    lheap* heap = lheap_current();
+
+    lheap_count(heap, LMEM_LVAL, -1, 0, -(long) sizeof(*val));
+    if(heap->free_count >= LHEAP_FREE_MAX)
+    {
+        free(val);
+        return;
+    }
+    val->body = heap->free;
+    heap->free = val;
+    heap->free_count++;
+}
+
+/*
+ * __lval_create()
+ * Private lval constructor
+ */
+lval* __lval_create(long num, double decimal, char* m, char* s, int type)
+{
+    lval* val;
+
+    val = lval_alloc();
+    if(!val)
+        return NULL;
     val->type    = type;
     val->num     = num;
     val->decimal = decimal;
@@ -31,16 +546,15 @@ lval* __lval_create(long num, double decimal, char* m, char* s, int type)
     {
         val->err = malloc(strlen(m) + 1);
         strcpy(val->err, m);
+        lmem_count(LMEM_STRING, 1, 1, strlen(m) + 1);
     }
     else
         val->err   = NULL;
     if(s != NULL)
-    {
-        val->sym = malloc(strlen(s) + 1);
-        strcpy(val->sym, s);
-    }
+        val->sym = lval_intern(s);
     else
         val->sym   = NULL;
+    val->str     = NULL;
 
     val->builtin = NULL;     
     val->env     = NULL;
@@ -48,6 +562,9 @@ lval* __lval_create(long num, double decimal, char* m, char* s, int type)
     val->body    = NULL;     
     val->cell    = NULL;
     val->count   = 0;
+    val->future  = NULL;
+    val->chan    = NULL;
+    val->purity  = 0;
 
     return val;
 }
@@ -88,6 +605,7 @@ lval* lval_err(char* fmt, ...)
     // resize to the real size of the string
     verr->err = realloc(verr->err, strlen(verr->err) + 1);
     va_end(va);
+    lmem_count(LMEM_STRING, 1, 1, strlen(verr->err) + 1);
 
     return verr;
 }
@@ -142,6 +660,54 @@ lval* lval_lambda(lval* formals, lval* body)
     return val;
 }
 
+/*
+ * lval_future()
+ * Takes the reference the caller holds on fut
+ */
+lval* lval_future(lfuture* fut)
+{
+    lval* val = __lval_create(0, 0.0f, NULL, NULL, LVAL_FUTURE);
+    val->future = fut;
+
+    return val;
+}
+
+/*
+ * lval_chan()
+ * Takes the reference the caller holds on ch
+ */
+lval* lval_chan(lchan* ch)
+{
+    lval* val = __lval_create(0, 0.0f, NULL, NULL, LVAL_CHAN);
+    val->chan = ch;
+
+    return val;
+}
+
+/*
+ * lval_pid()
+ */
+lval* lval_pid(const char* node, long id)
+{
+    lval* val = __lval_create(id, 0.0f, NULL, NULL, LVAL_PID);
+    val->sym = lval_intern(node);
+
+    return val;
+}
+
+/*
+ * lval_str()
+ */
+lval* lval_str(const char* s)
+{
+    lval* val = __lval_create(0, 0.0f, NULL, NULL, LVAL_STR);
+    val->str = malloc(strlen(s) + 1);
+    strcpy(val->str, s);
+    lmem_count(LMEM_STRING, 1, 1, strlen(s) + 1);
+
+    return val;
+}
+
 /*
  * lval_del()
  */
@@ -150,6 +716,8 @@ void lval_del(lval* val)
     switch(val->type)
     {
         case LVAL_ERR:
+            if(val->err != NULL)
+                lmem_count(LMEM_STRING, -1, 0, -(long) (strlen(val->err) + 1));
             free(val->err); // TODO : double free here when div by zero
             break;
         case LVAL_FUNC:
@@ -164,7 +732,11 @@ void lval_del(lval* val)
         case LVAL_DECIMAL:
             break;      // nothing extra to do
         case LVAL_SYM:
-            free(val->sym);
+        case LVAL_PID:
+            break;      // name belongs to the heap
+        case LVAL_STR:
+            lmem_count(LMEM_STRING, -1, 0, -(long) (strlen(val->str) + 1));
+            free(val->str);
             break;
         case LVAL_SEXPR:
         case LVAL_QEXPR:
@@ -172,10 +744,18 @@ void lval_del(lval* val)
             {
                 lval_del(val->cell[i]);
             }
+            if(val->count > 0)
+                lmem_count(LMEM_CELL, -1, 0, -(long) (sizeof(lval*) * val->count));
             free(val->cell);
             break;
+        case LVAL_FUTURE:
+            lfuture_release(val->future);
+            break;
+        case LVAL_CHAN:
+            lchan_release(val->chan);
+            break;
     }
-    free(val);
+    lval_free(val);
 }
 
 /*
@@ -183,13 +763,12 @@ void lval_del(lval* val)
  */
 lval* lval_copy(lval* val)
 {
-    lval* out = malloc(sizeof(*out));  
+    lval* out = lval_alloc();
     if(!out)
-    {
-        fprintf(stderr, "[%s] failed to allocate %ld bytes for new lval\n", __func__, sizeof(*out));
         return NULL;
-    }
     out->type = val->type;
+    lmemstats* stats = &lheap_current()->stats;
+    __atomic_store_n(&stats->copies, stats->copies + 1, __ATOMIC_RELAXED);
 
     switch(val->type)
     {
@@ -203,82 +782,301 @@ lval* lval_copy(lval* val)
                 out->env     = lenv_copy(val->env);
                 out->formals = lval_copy(val->formals);
                 out->body    = lval_copy(val->body);
+                out->purity  = __atomic_load_n(&val->purity, __ATOMIC_RELAXED);
             }
             break;
 
         case LVAL_NUM:
-        case LVAL_DECIMAL:
             out->num = val->num;
             break;
+        case LVAL_DECIMAL:
+            out->decimal = val->decimal;
+            break;
 
         case LVAL_ERR:
             out->err = malloc(strlen(val->err) + 1);
             strcpy(out->err, val->err);
+            lmem_count(LMEM_STRING, 1, 1, strlen(val->err) + 1);
             break;
 
         case LVAL_SYM:
-            out->sym = malloc(strlen(val->sym) + 1);
-            strcpy(out->sym, val->sym);
+            out->sym = val->sym;
+            break;
+
+        case LVAL_PID:
+            out->sym = val->sym;
+            out->num = val->num;
+            break;
+
+        case LVAL_STR:
+            out->str = malloc(strlen(val->str) + 1);
+            strcpy(out->str, val->str);
+            lmem_count(LMEM_STRING, 1, 1, strlen(val->str) + 1);
             break;
 
         case LVAL_SEXPR:
         case LVAL_QEXPR:
             out->count = val->count;
             out->cell = malloc(sizeof(lval*) * val->count);
+            if(val->count > 0)
+                lmem_count(LMEM_CELL, 1, 1, sizeof(lval*) * val->count);
             for(int i = 0; i < val->count; ++i)
                 out->cell[i] = lval_copy(val->cell[i]);
             break;
+
+        case LVAL_FUTURE:
+            out->future = val->future;
+            lfuture_retain(out->future);
+            break;
+
+        case LVAL_CHAN:
+            out->chan = val->chan;
+            lchan_retain(out->chan);
+            break;
+    }
+
+    return out;
+}
+
+// ======== PRINTING ======== //
+
+/*
+ * lbuf_init()
+ */
+void lbuf_init(lbuf* b)
+{
+    b->data = NULL;
+    b->len  = 0;
+    b->cap  = 0;
+}
+
+/*
+ * lbuf_free()
+ */
+void lbuf_free(lbuf* b)
+{
+    free(b->data);
+    lbuf_init(b);
+}
+
+/*
+ * lbuf_reserve()
+ * Make room for n more bytes and a terminator
+ */
+static void lbuf_reserve(lbuf* b, size_t n)
+{
+    if(b->len + n + 1 <= b->cap)
+        return;
+
+    size_t cap = (b->cap == 0) ? LBUF_INITIAL_SIZE : b->cap;
+    while(b->len + n + 1 > cap)
+        cap *= 2;
+    char* data = realloc(b->data, cap);
+    if(!data)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for buffer\n", __func__, cap);
+        exit(1);
+    }
+    b->data = data;
+    b->cap  = cap;
+}
+
+/*
+ * lbuf_put()
+ */
+void lbuf_put(lbuf* b, const char* s, size_t n)
+{
+    lbuf_reserve(b, n);
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
+
+/*
+ * lbuf_putc()
+ */
+void lbuf_putc(lbuf* b, char c)
+{
+    lbuf_reserve(b, 1);
+    b->data[b->len++] = c;
+    b->data[b->len] = '\0';
+}
+
+/*
+ * lbuf_puts()
+ */
+void lbuf_puts(lbuf* b, const char* s)
+{
+    lbuf_put(b, s, strlen(s));
+}
+
+/*
+ * lbuf_put_long()
+ * Digits are written backwards into a scratch buffer. The magnitude
+ * is taken as unsigned so that LONG_MIN works.
+ */
+void lbuf_put_long(lbuf* b, long x)
+{
+    char digits[24];
+    char* p = digits + sizeof(digits);
+    unsigned long u = (x < 0) ? -(unsigned long) x : (unsigned long) x;
+
+    do
+    {
+        *--p = '0' + (u % 10);
+        u /= 10;
+    } while(u != 0);
+    if(x < 0)
+        *--p = '-';
+
+    lbuf_put(b, p, digits + sizeof(digits) - p);
+}
+
+/*
+ * lbuf_put_double()
+ * A decimal that looks like an integer gets a ".0", so that it does
+ * not print the same as a number.
+ */
+void lbuf_put_double(lbuf* b, double x)
+{
+    char digits[32];
+    int n = snprintf(digits, sizeof(digits), "%.15g", x);
+
+    lbuf_put(b, digits, n);
+    if(strspn(digits, "-0123456789") == (size_t) n)
+        lbuf_puts(b, ".0");
+}
+
+/*
+ * lval_list_to_buffer()
+ */
+static void lval_list_to_buffer(lbuf* b, lval* v, char open, char close)
+{
+    lbuf_putc(b, open);
+    for(int i = 0; i < v->count; ++i)
+    {
+        lval_to_buffer(b, v->cell[i]);
+        // remove trailing space if this is the last element
+        if(i != (v->count-1))
+            lbuf_putc(b, ' ');
     }
-
-    return out;
+    lbuf_putc(b, close);
 }
 
 /*
- * lval_print()
+ * lval_to_buffer()
  */
-void lval_print(lval* v)
+void lval_to_buffer(lbuf* b, lval* v)
 {
     switch(v->type)
     {
         case LVAL_ERR:
-            fprintf(stdout, "ERROR: %s", v->err);
+            lbuf_puts(b, "ERROR: ");
+            lbuf_puts(b, v->err);
             break;
-        case LVAL_DECIMAL:
         case LVAL_NUM:
-            fprintf(stdout, "%li", v->num);
+            lbuf_put_long(b, v->num);
+            break;
+        case LVAL_DECIMAL:
+            lbuf_put_double(b, v->decimal);
             break;
         case LVAL_FUNC:
             if(v->builtin)
-                fprintf(stdout, "<builtin>");
+                lbuf_puts(b, "<builtin>");
             else
             {
-                fprintf(stdout, "(\\");
-                lval_print(v->formals);
-                fprintf(stdout, " ");
-                lval_print(v->body);
-                fprintf(stdout, ")");
+                lbuf_puts(b, "(\\");
+                lval_to_buffer(b, v->formals);
+                lbuf_putc(b, ' ');
+                lval_to_buffer(b, v->body);
+                lbuf_putc(b, ')');
             }
             break;
         case LVAL_SYM:
-            fprintf(stdout, "%s", v->sym);
+            lbuf_puts(b, v->sym);
             break;
         case LVAL_SEXPR:
-            lval_sexpr_print(v, '(', ')');
+            lval_list_to_buffer(b, v, '(', ')');
             break;
         case LVAL_QEXPR:
-            lval_sexpr_print(v, '{', '}');
+            lval_list_to_buffer(b, v, '{', '}');
+            break;
+        case LVAL_FUTURE:
+            lbuf_puts(b, "<future>");
+            break;
+        case LVAL_CHAN:
+            lbuf_puts(b, "<chan>");
+            break;
+        case LVAL_PID:
+            lbuf_puts(b, "<pid ");
+            lbuf_puts(b, v->sym);
+            lbuf_putc(b, ':');
+            lbuf_put_long(b, v->num);
+            lbuf_putc(b, '>');
+            break;
+        case LVAL_STR:
+            lbuf_puts(b, v->str);
             break;
     }
 }
 
+/*
+ * lval_to_string()
+ */
+char* lval_to_string(lval* v)
+{
+    lbuf b;
+
+    lbuf_init(&b);
+    lval_to_buffer(&b, v);
+    if(b.data == NULL)
+        lbuf_put(&b, "", 0);
+
+    return b.data;
+}
+
+/*
+ * lval_fprint()
+ * The whole value goes to fp in one write
+ */
+void lval_fprint(FILE* fp, lval* v)
+{
+    lbuf b;
+
+    lbuf_init(&b);
+    lval_to_buffer(&b, v);
+    fwrite(b.data, 1, b.len, fp);
+    lbuf_free(&b);
+}
+
+/*
+ * lval_fprintln()
+ */
+void lval_fprintln(FILE* fp, lval* v)
+{
+    lbuf b;
+
+    lbuf_init(&b);
+    lval_to_buffer(&b, v);
+    lbuf_putc(&b, '\n');
+    fwrite(b.data, 1, b.len, fp);
+    lbuf_free(&b);
+}
+
+/*
+ * lval_print()
+ */
+void lval_print(lval* v)
+{
+    lval_fprint(stdout, v);
+}
 
 /*
  * lval_println()
  */
 void lval_println(lval* v)
 {
-    lval_print(v);
-    fprintf(stdout, "\n");
+    lval_fprintln(stdout, v);
 }
 
 /*
@@ -302,6 +1100,14 @@ char* lval_type_str(lval_type t)
             return "S-Expression";
         case LVAL_QEXPR:
             return "Q-Expression";
+        case LVAL_FUTURE:
+            return "Future";
+        case LVAL_CHAN:
+            return "Channel";
+        case LVAL_PID:
+            return "Pid";
+        case LVAL_STR:
+            return "String";
         default:
             return "Unkown type\0";
     }
@@ -312,8 +1118,9 @@ char* lval_type_str(lval_type t)
  */
 lval* lval_add(lval* v, lval* x)
 {
+    lmem_count(LMEM_CELL, (v->count == 0), 1, sizeof(lval*));
     v->count++;
-    v->cell = realloc(v->cell, sizeof(*v) * v->count);
+    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
     if(!v->cell)
     {
         fprintf(stderr, "[%s] failed to realloc memory for cell\n", __func__);
@@ -341,6 +1148,7 @@ lval* lval_pop(lval* val, int idx)
 
     // realloc the used memory 
     val->cell = realloc(val->cell, sizeof(lval*) * val->count);
+    lmem_count(LMEM_CELL, -(val->count == 0), (val->count > 0), -(long) sizeof(lval*));
 
     return x;
 }
@@ -510,9 +1318,33 @@ lval* lval_builtin_join(lval* val)
  */
 lval* lval_eval_sexpr(lenv* env, lval* val)
 {
-    // eval children of this lval
-    for(int i = 0; i < val->count; ++i)
-        val->cell[i] = lval_eval(env, val->cell[i]);
+    // the name the function is called by, for the profiler, the call
+    // stats and the trace
+    int profiling = __atomic_load_n(&lprof_on, __ATOMIC_RELAXED);
+    int counting  = __atomic_load_n(&lstats_on, __ATOMIC_RELAXED);
+    int tracing   = __atomic_load_n(&ltrace_on, __ATOMIC_RELAXED);
+    const char* name = NULL;
+
+    lheap* heap = lheap_current();
+    if(heap->budget != NULL && __atomic_load_n(&heap->budget->active, __ATOMIC_ACQUIRE))
+    {
+        lval* err = lbudget_check(heap, heap->budget);
+        if(err != NULL)
+        {
+            lval_del(val);
+            return err;
+        }
+    }
+
+    if((profiling || counting || tracing) && val->count > 0 && val->cell[0]->type == LVAL_SYM)
+        name = val->cell[0]->sym;
+
+    // eval children of this lval, in parallel if that pays off
+    if(!lspec_eval_args(env, val))
+    {
+        for(int i = 0; i < val->count; ++i)
+            val->cell[i] = lval_eval(env, val->cell[i]);
+    }
 
     // Check errors
     for(int i = 0; i < val->count; ++i)
@@ -543,7 +1375,41 @@ lval* lval_eval_sexpr(lenv* env, lval* val)
         return err;
     }
 
+    int depth = -1;
+    if(profiling)
+    {
+        if(name == NULL)
+            name = (f->builtin != NULL) ? lval_builtin_name(f->builtin) : "lambda";
+        depth = lprof_push(name);
+    }
+    long start = (counting || tracing) ? lstats_now() : 0;
+    heap->depth++;
     lval* result = lval_call(env, f, val);
+    heap->depth--;
+    if(counting || tracing)
+    {
+        long end = lstats_now();
+        // builtins are counted by what they are, lambdas by name
+        if(f->builtin != NULL)
+        {
+            if(counting)
+                lstats_record((const void*) f->builtin, 1, NULL, end - start);
+            if(tracing)
+                ltrace_complete(LTRACE_BUILTIN, (name != NULL) ? name : lval_builtin_name(f->builtin),
+                                start, end, -1);
+        }
+        else
+        {
+            if(name == NULL)
+                name = "lambda";
+            if(counting)
+                lstats_record(name, 0, name, end - start);
+            if(tracing)
+                ltrace_complete(LTRACE_CALL, name, start, end, -1);
+        }
+    }
+    if(depth >= 0)
+        lprof_pop(depth);
     lval_del(f);
     
     return result;
@@ -680,10 +1546,7 @@ lval* lval_call(lenv* env, lval* func, lval* val)
  */
 lval* lval_builtin(lbuiltin func)
 {
-    lval* v = malloc(sizeof(lval));
-    v->type = LVAL_FUNC;
-    v->builtin = func;
-    return v;
+    return lval_func(func);
 }
 
 /*
@@ -699,8 +1562,9 @@ int lval_eq(lval* a, lval* b)
     switch(a->type)
     {
         case LVAL_NUM:
-        case LVAL_DECIMAL:
             return (a->num == b->num);
+        case LVAL_DECIMAL:
+            return (a->decimal == b->decimal);
         case LVAL_ERR:
             return strcmp(a->err, b->err) == 0;
         case LVAL_SYM:
@@ -721,6 +1585,14 @@ int lval_eq(lval* a, lval* b)
             }
 
             return 1;
+        case LVAL_FUTURE:
+            return (a->future == b->future);
+        case LVAL_CHAN:
+            return (a->chan == b->chan);
+        case LVAL_PID:
+            return (a->sym == b->sym && a->num == b->num);
+        case LVAL_STR:
+            return strcmp(a->str, b->str) == 0;
     }
 
     return 0;       // if we get to here, then we don't know what happened and that can't be equal
@@ -750,17 +1622,20 @@ lval* builtin_cmp(lenv* env, lval* val, char* op)
  */
 void lval_sexpr_print(lval* val, char open, char close)
 {
-    fprintf(stdout, "%c", open);
+    lval_sexpr_fprint(stdout, val, open, close);
+}
 
-    for(int i = 0; i < val->count; ++i)
-    {
-        lval_print(val->cell[i]);
-        // remove trailing space if this is the last element
-        if(i != (val->count-1))
-            fprintf(stdout, " ");
-    }
+/*
+ * lval_sexpr_fprint()
+ */
+void lval_sexpr_fprint(FILE* fp, lval* val, char open, char close)
+{
+    lbuf b;
 
-    fprintf(stdout, "%c", close);
+    lbuf_init(&b);
+    lval_list_to_buffer(&b, val, open, close);
+    fwrite(b.data, 1, b.len, fp);
+    lbuf_free(&b);
 }
 
 /*
@@ -781,25 +1656,212 @@ lenv* lenv_new(void)
         return NULL;
     }
 
-    env->count  = 0;
-    env->syms   = NULL;
-    env->vals   = NULL;
-    env->parent = NULL;
+    env->count   = 0;
+    env->syms    = NULL;
+    env->vals    = NULL;
+    env->parent  = NULL;
+    env->globals = NULL;
+    lmem_count(LMEM_LENV, 1, 1, sizeof(*env));
+
+    return env;
+}
+
+/*
+ * lindex_new()
+ */
+static lindex* lindex_new(size_t slots)
+{
+    lindex* index = calloc(1, sizeof(*index) + sizeof(int) * slots);
+    if(!index)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for index\n",
+                __func__, sizeof(*index) + sizeof(int) * slots
+        );
+        return NULL;
+    }
+    index->slots = slots;
+
+    return index;
+}
+
+/*
+ * lindex_add()
+ * Symbols are interned, so their addresses are hashed
+ */
+static void lindex_add(lindex* index, char* sym, int pos)
+{
+    size_t j = ((size_t) sym >> 4) * 2654435761u & (index->slots - 1);
+    while(index->pos[j] != 0)
+        j = (j + 1) & (index->slots - 1);
+
+    __atomic_store_n(&index->pos[j], pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * lenv_global_pos()
+ * Position of sym in the global scope env, or -1. Wait-free.
+ */
+static int lenv_global_pos(lenv* env, char* sym)
+{
+    lindex* index = __atomic_load_n(&env->globals->index, __ATOMIC_ACQUIRE);
+    // published before index, so it holds every position in index
+    char** syms = __atomic_load_n(&env->syms, __ATOMIC_ACQUIRE);
+
+    size_t j = ((size_t) sym >> 4) * 2654435761u & (index->slots - 1);
+    while(1)
+    {
+        int pos = __atomic_load_n(&index->pos[j], __ATOMIC_ACQUIRE);
+        if(pos == 0)
+            return -1;
+        if(syms[pos - 1] == sym)
+            return pos - 1;
+        j = (j + 1) & (index->slots - 1);
+    }
+}
+
+/*
+ * lenv_retire()
+ * Called with the lock held
+ */
+static void lenv_retire(lglobals* g, void* ptr, int is_val)
+{
+    lretired* r = malloc(sizeof(*r));
+    r->ptr    = ptr;
+    r->is_val = is_val;
+    r->next   = g->retired;
+    g->retired = r;
+}
+
+/*
+ * lenv_grow_global()
+ * Move the global scope env to arrays twice the size. Called with
+ * the lock held.
+ */
+static void lenv_grow_global(lenv* env)
+{
+    lglobals* g = env->globals;
+    int cap = (g->cap == 0) ? 64 : g->cap * 2;
+    char** syms = malloc(sizeof(char*) * cap);
+    lval** vals = malloc(sizeof(lval*) * cap);
+    lindex* index = lindex_new(cap * 2);
+
+    for(int i = 0; i < env->count; ++i)
+    {
+        syms[i] = env->syms[i];
+        vals[i] = __atomic_load_n(&env->vals[i], __ATOMIC_RELAXED);
+        lindex_add(index, syms[i], i);
+    }
+    if(g->index != NULL)
+    {
+        lenv_retire(g, env->syms, 0);
+        lenv_retire(g, env->vals, 0);
+        lenv_retire(g, g->index, 0);
+    }
+
+    __atomic_store_n(&env->syms, syms, __ATOMIC_RELEASE);
+    __atomic_store_n(&env->vals, vals, __ATOMIC_RELEASE);
+    __atomic_store_n(&g->index, index, __ATOMIC_RELEASE);
+    g->cap = cap;
+}
+
+/*
+ * lenv_put_global()
+ * Takes v
+ */
+static void lenv_put_global(lenv* env, char* sym, lval* v)
+{
+    lglobals* g = env->globals;
+
+    pthread_mutex_lock(&g->lock);
+    int pos = lenv_global_pos(env, sym);
+    if(pos >= 0)
+        lenv_retire(g, __atomic_exchange_n(&env->vals[pos], v, __ATOMIC_ACQ_REL), 1);
+    else
+    {
+        if(env->count == g->cap)
+            lenv_grow_global(env);
+        env->syms[env->count] = sym;
+        __atomic_store_n(&env->vals[env->count], v, __ATOMIC_RELEASE);
+        lindex_add(g->index, sym, env->count);
+        __atomic_store_n(&env->count, env->count + 1, __ATOMIC_RELEASE);
+        lmem_count(LMEM_LENV, 0, 0, LENV_BINDING_SIZE);
+    }
+    pthread_mutex_unlock(&g->lock);
+}
+
+/*
+ * lenv_new_global()
+ */
+lenv* lenv_new_global(void)
+{
+    lenv* env = lenv_new();
+    if(!env)
+        return NULL;
+
+    env->globals = malloc(sizeof(lglobals));
+    pthread_mutex_init(&env->globals->lock, NULL);
+    env->globals->cap     = 0;
+    env->globals->index   = NULL;
+    env->globals->retired = NULL;
+    lenv_grow_global(env);
 
     return env;
 }
 
+/*
+ * lenv_reclaim()
+ */
+void lenv_reclaim(lenv* env)
+{
+    lglobals* g = env->globals;
+    if(g == NULL)
+        return;
+
+    pthread_mutex_lock(&g->lock);
+    lretired* r = g->retired;
+    g->retired = NULL;
+    pthread_mutex_unlock(&g->lock);
+
+    while(r != NULL)
+    {
+        lretired* next = r->next;
+        if(r->is_val)
+            lval_del(r->ptr);
+        else
+            free(r->ptr);
+        free(r);
+        r = next;
+    }
+}
+
+/*
+ * lenv_rebound()
+ */
+void lenv_rebound(lenv* env)
+{
+    lspec_invalidate();
+    while(env->parent != NULL)
+        env = env->parent;
+    if(ltask_quiet())
+        lenv_reclaim(env);
+}
+
 /*
  * lenv_del()
  */
 void lenv_del(lenv* env)
 {
     for(int i = 0; i < env->count; ++i)
-    {
-        free(env->syms[i]);
         lval_del(env->vals[i]);
-    }
 
+    if(env->globals != NULL)
+    {
+        lenv_reclaim(env);
+        free(env->globals->index);
+        pthread_mutex_destroy(&env->globals->lock);
+        free(env->globals);
+    }
+    lmem_count(LMEM_LENV, -1, 0, -(long) (sizeof(*env) + LENV_BINDING_SIZE * env->count));
     free(env->syms);
     free(env->vals);
     free(env);
@@ -819,35 +1881,87 @@ lenv* lenv_copy(lenv* env)
         return NULL;
     }
 
-    e->parent = env->parent;
-    e->count  = env->count;
+    e->parent  = env->parent;
+    e->globals = NULL;
+    e->count   = env->count;
     e->syms   = malloc(sizeof(char*) * env->count);
     e->vals   = malloc(sizeof(lval*) * env->count);
+    lmem_count(LMEM_LENV, 1, 1, sizeof(*e) + LENV_BINDING_SIZE * env->count);
 
     for(int i = 0; i < env->count; ++i)
     {
         e->vals[i] = lval_copy(env->vals[i]);
-        e->syms[i] = malloc(strlen(env->syms[i]) + 1);
-        strcpy(e->syms[i], env->syms[i]);
+        e->syms[i] = env->syms[i];
     }
 
     return e;
 }
 
-// TODO : some quick wins here later might be to use a data
-// structure for the varibles that allows faster lookup
 /*
- * lenv_get()
+ * lenv_capture_into()
+ * Outermost scope first, so that inner bindings overwrite outer ones
  */
-lval* lenv_get(lenv* env, lval* val)
+static void lenv_capture_into(lenv* frame, lenv* env)
 {
-    // check if the variable exists
+    if(env->parent == NULL)
+    {
+        frame->parent = env;
+        return;
+    }
+    lenv_capture_into(frame, env->parent);
+
+    lval sym = {.type = LVAL_SYM};
+    for(int i = 0; i < env->count; ++i)
+    {
+        sym.sym = env->syms[i];
+        lenv_put(frame, &sym, env->vals[i]);
+    }
+}
+
+/*
+ * lenv_capture()
+ */
+lenv* lenv_capture(lenv* env)
+{
+    lenv* frame = lenv_new();
+    lenv_capture_into(frame, env);
+
+    return frame;
+}
+
+/*
+ * lenv_find()
+ */
+lval* lenv_find(lenv* env, char* sym)
+{
+    if(env->globals != NULL)
+    {
+        int pos = lenv_global_pos(env, sym);
+        if(pos < 0)
+            return NULL;
+        lval** vals = __atomic_load_n(&env->vals, __ATOMIC_ACQUIRE);
+        return __atomic_load_n(&vals[pos], __ATOMIC_ACQUIRE);
+    }
+
     for(int i = 0; i < env->count; ++i)
     {
-        if(strcmp(env->syms[i], val->sym) == 0)
-            return lval_copy(env->vals[i]);
+        if(env->syms[i] == sym)
+            return env->vals[i];
     }
 
+    return NULL;
+}
+
+/*
+ * lenv_get()
+ */
+lval* lenv_get(lenv* env, lval* val)
+{
+    // check if the variable exists
+    lval* x = lenv_find(env, val->sym);
+    if(x != NULL)
+        return lval_copy(x);
+
     // Check if the symbol is in a parent environment
     if(env->parent)
         return lenv_get(env->parent, val);
@@ -860,11 +1974,17 @@ lval* lenv_get(lenv* env, lval* val)
 */
 void lenv_put(lenv* env, lval* sym, lval* func)
 {
+    if(env->globals != NULL)
+    {
+        lenv_put_global(env, sym->sym, lval_copy(func));
+        return;
+    }
+
     // check if the variable exists
     for(int i = 0; i < env->count; ++i)
     {
         // if we find 
-        if(strcmp(env->syms[i], sym->sym) == 0)
+        if(env->syms[i] == sym->sym)
         {
             lval_del(env->vals[i]);
             env->vals[i] = lval_copy(func);
@@ -876,10 +1996,10 @@ void lenv_put(lenv* env, lval* sym, lval* func)
     env->count++;
     env->vals = realloc(env->vals, sizeof(lval*) * env->count);
     env->syms = realloc(env->syms, sizeof(char*) * env->count);
+    lmem_count(LMEM_LENV, 0, 0, LENV_BINDING_SIZE);
 
     env->vals[env->count - 1] = lval_copy(func);
-    env->syms[env->count - 1] = malloc(strlen(sym->sym) + 1);
-    strcpy(env->syms[env->count - 1], sym->sym);
+    env->syms[env->count - 1] = sym->sym;
 }
 
 /*
@@ -921,6 +2041,8 @@ lval* builtin_var(lenv* env, lval* val, char* func)
         if(strncmp(func, "=", 1) == 0)
             lenv_put(env, syms->cell[i], val->cell[i+1]);
     }
+    if(strncmp(func, "def", 3) == 0 || env->globals != NULL)
+        lenv_rebound(env);
     lval_del(val);
 
     return lval_sexpr();
@@ -947,6 +2069,116 @@ lval* builtin_join(lenv* env, lval* val)
 {
     return lval_builtin_join(val);
 }
+/*
+ * builtin_str()
+ * (str x) -> the printed form of x as a string
+ */
+lval* builtin_str(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("str", val, 1);
+
+    lval* x = __lval_create(0, 0.0f, NULL, NULL, LVAL_STR);
+    x->str = lval_to_string(val->cell[0]);
+    lmem_count(LMEM_STRING, 1, 1, strlen(x->str) + 1);
+    lval_del(val);
+
+    return x;
+}
+/*
+ * builtin_mem_stats()
+ * (mem-stats {}) -> {{lval live total bytes peak} ... {copies n}}, the
+ * memory statistics of this interpreter (see MEMORY STATISTICS).
+ * (mem-stats {lval cell}) -> only the rows for those kinds
+ */
+lval* builtin_mem_stats(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("mem-stats", val, 1);
+    LVAL_ASSERT_TYPE("mem-stats", val, 0, LVAL_QEXPR);
+
+    lval* kinds = val->cell[0];
+    for(int i = 0; i < kinds->count; ++i)
+    {
+        LVAL_ASSERT(val, kinds->cell[i]->type == LVAL_SYM,
+                "[%s] Function 'mem-stats': expected kinds as symbols, got %s",
+                __func__, lval_type_str(kinds->cell[i]->type));
+    }
+
+    lmemstats s;
+    lheap_stats(lheap_current(), &s);
+
+    lval* out = lval_qexpr();
+    for(int k = 0; k <= LMEM_NUM_KINDS; ++k)
+    {
+        const char* name = (k < LMEM_NUM_KINDS) ? lmem_kind_str(k) : "copies";
+        int wanted = (kinds->count == 0);
+        for(int i = 0; i < kinds->count && !wanted; ++i)
+            wanted = (strcmp(kinds->cell[i]->sym, name) == 0);
+        if(!wanted)
+            continue;
+
+        lval* row = lval_add(lval_qexpr(), lval_sym((char*) name));
+        if(k < LMEM_NUM_KINDS)
+        {
+            row = lval_add(row, lval_num(s.kinds[k].live));
+            row = lval_add(row, lval_num(s.kinds[k].total));
+            row = lval_add(row, lval_num(s.kinds[k].bytes));
+            row = lval_add(row, lval_num(s.kinds[k].peak));
+        }
+        else
+            row = lval_add(row, lval_num(s.copies));
+        out = lval_add(out, row);
+    }
+    lval_del(val);
+
+    return out;
+}
+/*
+ * builtin_builtin_stats()
+ * (builtin-stats {}) -> {{name calls total p50 p90 p99 max} ...}, with
+ * times in nanoseconds, for every function called since the call
+ * stats were turned on (see stats.h), most total time first.
+ * (builtin-stats {join eval}) -> only the rows for those functions
+ */
+lval* builtin_builtin_stats(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("builtin-stats", val, 1);
+    LVAL_ASSERT_TYPE("builtin-stats", val, 0, LVAL_QEXPR);
+    LVAL_ASSERT(val, __atomic_load_n(&lstats_on, __ATOMIC_RELAXED),
+            "[%s] Function 'builtin-stats': call stats are off, run with --builtin-stats", __func__);
+
+    lval* names = val->cell[0];
+    for(int i = 0; i < names->count; ++i)
+    {
+        LVAL_ASSERT(val, names->cell[i]->type == LVAL_SYM,
+                "[%s] Function 'builtin-stats': expected names as symbols, got %s",
+                __func__, lval_type_str(names->cell[i]->type));
+    }
+
+    lstats_row* rows;
+    int n = lstats_collect(&rows);
+    lval* out = lval_qexpr();
+    for(int r = 0; r < n; ++r)
+    {
+        int wanted = (names->count == 0);
+        for(int i = 0; i < names->count && !wanted; ++i)
+            wanted = (strcmp(names->cell[i]->sym, rows[r].name) == 0);
+        if(!wanted)
+            continue;
+
+        lval* row = lval_add(lval_qexpr(), lval_sym((char*) rows[r].name));
+        row = lval_add(row, lval_num(rows[r].calls));
+        row = lval_add(row, lval_num(rows[r].total_ns));
+        row = lval_add(row, lval_num(lstats_percentile(&rows[r], 50)));
+        row = lval_add(row, lval_num(lstats_percentile(&rows[r], 90)));
+        row = lval_add(row, lval_num(lstats_percentile(&rows[r], 99)));
+        row = lval_add(row, lval_num(rows[r].max_ns));
+        out = lval_add(out, row);
+    }
+    free(rows);
+    lval_del(val);
+
+    return out;
+}
 /*
  * builtin_lambda()
  */
@@ -1106,36 +2338,117 @@ void lenv_add_builtin(lenv* env, char* name, lbuiltin func)
 }
 
 /*
- * lenv_init_builtins()
+ * BUILTIN TABLE
+ * Every builtin that lenv_init_builtins() installs, by name. Since
+ * function pointers are not stable between runs this table is also
+ * how snapshots relocate builtins (see snapshot.c).
  */
-void lenv_init_builtins(lenv* env)
-{
+static const lbuiltin_entry lval_builtin_table[] = {
     // variable functions
-    lenv_add_builtin(env, "\\",   builtin_lambda);
-    lenv_add_builtin(env, "def",  builtin_def);
-    lenv_add_builtin(env, "=",    builtin_put);
+    {"\\",   builtin_lambda, 1},
+    {"def",  builtin_def,    0},
+    {"=",    builtin_put,    0},
     // list functions 
-    lenv_add_builtin(env, "list", builtin_list);
-    lenv_add_builtin(env, "head", builtin_head);
-    lenv_add_builtin(env, "tail", builtin_tail);
-    lenv_add_builtin(env, "eval", builtin_eval);
-    lenv_add_builtin(env, "join", builtin_join);
+    {"list", builtin_list, 1},
+    {"head", builtin_head, 1},
+    {"tail", builtin_tail, 1},
+    {"eval", builtin_eval, 0},
+    {"join", builtin_join, 1},
+    {"str",  builtin_str,  1},
+    // memory
+    {"mem-stats",     builtin_mem_stats,     0},
+    {"builtin-stats", builtin_builtin_stats, 0},
     // operators
-    lenv_add_builtin(env, "+",   builtin_add);
-    lenv_add_builtin(env, "-",   builtin_sub);
-    lenv_add_builtin(env, "*",   builtin_mul);
-    lenv_add_builtin(env, "/",   builtin_div);
-    lenv_add_builtin(env, "%",   builtin_mod);
-    lenv_add_builtin(env, "^",   builtin_pow);
-    lenv_add_builtin(env, "min", builtin_min);
-    lenv_add_builtin(env, "max", builtin_max);
-
+    {"+",   builtin_add, 1},
+    {"-",   builtin_sub, 1},
+    {"*",   builtin_mul, 1},
+    {"/",   builtin_div, 1},
+    {"%",   builtin_mod, 1},
+    {"^",   builtin_pow, 1},
+    {"min", builtin_min, 1},
+    {"max", builtin_max, 1},
     // comparison functions
-    lenv_add_builtin(env, "if", builtin_if);
-    lenv_add_builtin(env, "==", builtin_eq);
-    lenv_add_builtin(env, "!=", builtin_ne);
-    lenv_add_builtin(env, ">",  builtin_gt);
-    lenv_add_builtin(env, "<",  builtin_lt);
-    lenv_add_builtin(env, ">=", builtin_ge);
-    lenv_add_builtin(env, "<=", builtin_le);
+    {"if", builtin_if, 1},
+    {"==", builtin_eq, 1},
+    {"!=", builtin_ne, 1},
+    {">",  builtin_gt, 1},
+    {"<",  builtin_lt, 1},
+    {">=", builtin_ge, 1},
+    {"<=", builtin_le, 1},
+    // parallel list functions
+    {"pmap",      builtin_pmap,     0},
+    {"pfor-each", builtin_pforeach, 0},
+    {"preduce",   builtin_preduce,  0},
+    // tasks
+    {"spawn", builtin_spawn, 0},
+    {"await", builtin_await, 0},
+    // fibers
+    {"go",    builtin_go,    0},
+    {"yield", builtin_yield, 0},
+    {"sleep", builtin_sleep, 0},
+    // channels
+    {"chan",   builtin_chan,   0},
+    {"send",   builtin_send,   0},
+    {"recv",   builtin_recv,   0},
+    {"select", builtin_select, 0},
+    {"close",  builtin_close,  0},
+    // actors
+    {"spawn-actor", builtin_spawn_actor, 0},
+    {"send!",       builtin_send_msg,    0},
+    {"receive",     builtin_receive,     0},
+    {"nodes",       builtin_nodes,       0},
+    // native modules
+    {"load-native", builtin_load_native, 0},
+    {NULL, NULL, 0}
+};
+
+/*
+ * lval_builtin_lookup()
+ */
+lbuiltin lval_builtin_lookup(const char* name)
+{
+    for(const lbuiltin_entry* b = lval_builtin_table; b->name != NULL; ++b)
+    {
+        if(strcmp(b->name, name) == 0)
+            return b->func;
+    }
+
+    return NULL;
+}
+
+/*
+ * lval_builtin_name()
+ */
+const char* lval_builtin_name(lbuiltin func)
+{
+    for(const lbuiltin_entry* b = lval_builtin_table; b->name != NULL; ++b)
+    {
+        if(b->func == func)
+            return b->name;
+    }
+
+    return NULL;
+}
+
+/*
+ * lval_builtin_pure()
+ */
+int lval_builtin_pure(lbuiltin func)
+{
+    for(const lbuiltin_entry* b = lval_builtin_table; b->name != NULL; ++b)
+    {
+        if(b->func == func)
+            return b->pure;
+    }
+
+    return 0;
+}
+
+/*
+ * lenv_init_builtins()
+ */
+void lenv_init_builtins(lenv* env)
+{
+    for(const lbuiltin_entry* b = lval_builtin_table; b->name != NULL; ++b)
+        lenv_add_builtin(env, (char*) b->name, b->func);
 }
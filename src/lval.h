@@ -1,12 +1,15 @@
 /*
  * LVAL
- * Lisp values 
+ * Lisp values. The layouts here are private to the interpreter, and
+ * programs embedding it only get lispy.h.
  */
 
 #ifndef __BYOL_LVAL_H
 #define __BYOL_LVAL_H
 
-#include "mpc.h"
+#include <pthread.h>
+#include <stdio.h>
+#include "lispy.h"
 
 // note : do I need the ol' do{....} while(0) trick here?
 #define LVAL_ASSERT(args, cond, fmt, ...) \
@@ -35,18 +38,6 @@
             __func__, func, idx)
 
 
-// list of valid lval types
-typedef enum 
-{
-    LVAL_ERR,
-    LVAL_NUM,
-    LVAL_DECIMAL,
-    LVAL_FUNC,
-    LVAL_SYM,
-    LVAL_SEXPR,
-    LVAL_QEXPR
-} lval_type;
-
 // lval errors
 typedef enum
 {
@@ -56,12 +47,10 @@ typedef enum
     LERR_BAD_NUM
 } lval_err_type;
 
-// Forward declarations of values, environments
-typedef struct lval lval;
-typedef struct lenv lenv;
-
-// Lisp builtin function
-typedef lval* (*lbuiltin)(lenv*, lval*);
+// Forward declarations of futures and channels, lval and lenv are in
+// lispy.h
+typedef struct lfuture lfuture;
+typedef struct lchan lchan;
 
 /*
  * VALUE
@@ -71,9 +60,11 @@ struct lval
     lval_type type;
     long      num;
     double    decimal;
-    // error and symbol types have some string data
+    // error and symbol types have some string data. Symbol names
+    // are interned (see lval_intern()) and owned by the heap.
     char*     err;
     char*     sym;
+    char*     str;      // text of a string (see builtin_str())
     // Functions
     lbuiltin  builtin;
     lenv*     env;
@@ -82,17 +73,198 @@ struct lval
     // Expressions 
     int       count;
     lval**    cell;
+    // Futures (see task.h) and channels (see chan.h), shared
+    // between copies
+    lfuture*  future;
+    lchan*    chan;
+    // Actor processes (see actor.h) are sym (the interned node
+    // name) and num (the mailbox id on that node)
+    // Cached purity of a lambda (see spec.c)
+    long      purity;
 };
 
-// lval constructors
-lval* lval_num(long x);
-lval* lval_decimal(double x);
-lval* lval_err(char* fmt, ...);
-lval* lval_sym(char* s);
-lval* lval_sexpr(void);
-lval* lval_qexpr(void);
+/*
+ * HEAP
+ * Allocator and symbol table behind every lval. Each interpreter
+ * context (see lispy.h) owns a heap and makes it current on the
+ * thread it runs on, so interpreters on different threads never
+ * touch the same heap. Threads without a current heap share a
+ * default heap, which is only safe from a single thread.
+ *
+ * Values (and their symbol names) belong to the heap that was
+ * current when they were made and must not outlive it.
+ */
+/*
+ * SYMBOL TABLE
+ * Interned names in a hash trie. Each slot is empty, holds the
+ * names whose hashes agree so far, or points (tagged with the low
+ * bit) to a node indexed by the next LSYMTAB_BITS bits of the hash.
+ * Slots only ever go from empty to a name and from a name to a node,
+ * both with compare-and-swap, and names are never removed while the
+ * heap lives. So finding a name is wait-free and adding one is
+ * lock-free.
+ */
+#define LSYMTAB_BITS    4
+
+typedef struct lsym
+{
+    struct lsym*    next;       // same hash
+    size_t          hash;
+    char            name[];
+} lsym;
+
+typedef struct lsymnode
+{
+    void*   slots[1 << LSYMTAB_BITS];
+} lsymnode;
+
+typedef struct lsymtab
+{
+    void*   root;
+} lsymtab;
+
+/*
+ * MEMORY STATISTICS
+ * What a heap has allocated, by kind. For each kind live is the
+ * number of objects in use, total the number ever made, bytes the
+ * bytes in use and peak the most bytes that were ever in use at
+ * once. Cell arrays are (re)allocated every time a list grows or
+ * shrinks, so for cells total counts allocations, not lists.
+ *
+ * Each heap counts into its own statistics without atomic updates,
+ * since only its thread allocates from it. Heaps sharing a symbol
+ * table are registered with the heap they share, and lheap_stats()
+ * sums the lot, so the statistics of an interpreter include its
+ * worker threads. Values freed on another heap than the one that
+ * made them are still counted correctly in the sum, but the peak of
+ * a sum is the sum of the peaks of each heap, an upper bound.
+ */
+typedef enum
+{
+    LMEM_LVAL,
+    LMEM_LENV,
+    LMEM_CELL,
+    LMEM_STRING,    // error messages and strings
+    LMEM_SYMBOL,    // interned names
+    LMEM_NUM_KINDS
+} lmem_kind;
+
+typedef struct
+{
+    long    live;
+    long    total;
+    long    bytes;
+    long    peak;
+} lmem_counter;
+
+typedef struct lmemstats
+{
+    lmem_counter    kinds[LMEM_NUM_KINDS];
+    long            copies;     // calls to lval_copy()
+} lmemstats;
+
+typedef struct lheap
+{
+    // deleted lvals kept for reuse, linked through body
+    lval*           free;
+    int             free_count;
+    lsymtab*        symtab;         // &own, or the table of the heap shared
+    lsymtab         own;
+    lmemstats       stats;          // written by the owning thread only
+    // the heap shared and its other sharers, see MEMORY STATISTICS
+    struct lheap*   owner;
+    struct lheap*   next_shared;
+    pthread_mutex_t shared_lock;
+    struct lheap*   shared;
+    lmemstats       gone;           // of sharers already destroyed
+    // see BUDGET, the counts are written by the owning thread only
+    lbudget*        budget;
+    long            generation;
+    long            steps;
+    long            depth;
+    long            bytes_limit;    // 0 for none
+} lheap;
+
+#define LHEAP_FREE_MAX  4096
+
+/*
+ * lheap_init()
+ * If share is not NULL the new heap interns into the symbol table
+ * of share, so that values can move between the two heaps. This is
+ * how worker threads (see parallel.h) see the symbols of the
+ * interpreter that started them.
+ */
+void   lheap_init(lheap* heap, lheap* share);
+void   lheap_destroy(lheap* heap);
+/*
+ * lheap_current()
+ * The heap for the calling thread.
+ */
+lheap* lheap_current(void);
+/*
+ * lheap_set_current()
+ * Make heap (or the default heap if NULL) current on the calling
+ * thread. Returns the previous heap so that it can be restored.
+ */
+lheap* lheap_set_current(lheap* heap);
+/*
+ * lheap_stats()
+ * A snapshot of the memory statistics of heap and of every heap
+ * sharing it (or sharing the same heap it shares).
+ */
+void   lheap_stats(lheap* heap, lmemstats* out);
+/*
+ * lbudget_start()
+ * Start a new evaluation under the limits of budget, if any are set.
+ */
+void   lbudget_start(lbudget* budget);
+void   lbudget_stop(lbudget* budget);
+/*
+ * lbudget_deadline()
+ * When the evaluation running on the calling thread times out, in
+ * CLOCK_MONOTONIC ns, or 0 if it has no timeout. Builtins that wait
+ * (sleep, receive, the channel builtins, await) stop waiting then.
+ */
+long   lbudget_deadline(void);
+/*
+ * lbudget_timed_out()
+ * NULL, or once the deadline of the evaluation running on the calling
+ * thread has passed, the error it now evaluates to.
+ */
+lval*  lbudget_timed_out(void);
+/*
+ * lbudget_limit_str()
+ */
+const char* lbudget_limit_str(lbudget_limit limit);
+/*
+ * lmem_count()
+ * Record live more objects of kind, total more allocations and bytes
+ * more bytes in use (any of which may be negative) on the current
+ * heap. Only needed by code that allocates the parts of an lval
+ * itself.
+ */
+void        lmem_count(lmem_kind kind, long live, long total, long bytes);
+const char* lmem_kind_str(lmem_kind kind);
+void        lmemstats_add(lmemstats* sum, lmemstats* stats);
+/*
+ * lmemstats_fprint()
+ * One line per kind, as a table.
+ */
+void        lmemstats_fprint(FILE* fp, lmemstats* stats);
+/*
+ * lval_intern()
+ * Returns the single copy of s held by the current heap. Interned
+ * names can be compared by pointer. Safe to call from any number of
+ * threads sharing the table.
+ */
+char*  lval_intern(const char* s);
+
+// lval constructors, besides the ones in lispy.h
 lval* lval_func(lbuiltin func);
 lval* lval_lambda(lval* formals, lval* body);
+lval* lval_future(lfuture* fut);
+lval* lval_chan(lchan* ch);
+lval* lval_pid(const char* node, long id);
 
 /*
  * lval_del()
@@ -101,9 +273,43 @@ lval* lval_lambda(lval* formals, lval* body);
 void  lval_del(lval* val);
 lval* lval_copy(lval* val);
 
+/*
+ * BUFFER
+ * A growable string for printing values without going through
+ * stdio a token at a time.
+ */
+typedef struct
+{
+    char*   data;
+    size_t  len;
+    size_t  cap;
+} lbuf;
+
+#define LBUF_INITIAL_SIZE   256
+
+void  lbuf_init(lbuf* b);
+void  lbuf_free(lbuf* b);
+void  lbuf_put(lbuf* b, const char* s, size_t n);
+void  lbuf_putc(lbuf* b, char c);
+void  lbuf_puts(lbuf* b, const char* s);
+void  lbuf_put_long(lbuf* b, long x);
+void  lbuf_put_double(lbuf* b, double x);
+/*
+ * lval_to_buffer()
+ * Append the printed form of v to b.
+ */
+void  lval_to_buffer(lbuf* b, lval* v);
+/*
+ * lval_to_string()
+ * The printed form of v as a malloc'd string.
+ */
+char* lval_to_string(lval* v);
+
 // Display
 void  lval_print(lval* v);
 void  lval_println(lval* v);
+void  lval_fprint(FILE* fp, lval* v);
+void  lval_fprintln(FILE* fp, lval* v);
 char* lval_type_str(lval_type t);
 
 // NOTE: We only need a lenv pointer as the first 
@@ -111,11 +317,6 @@ char* lval_type_str(lval_type t);
 // signature. In practice we don't actually do 
 // anything with the pointer that we pass.
 
-/*
- * lval_add()
- * Append an lval to another lval
- */
-lval* lval_add(lval* v, lval* x);
 /*
  * lval_pop()
  * Pop from the list the item at idx
@@ -194,6 +395,7 @@ lval* builtin_cmp(lenv* env, lval* val, char* op);
  * lval_sexpr_print()
  */
 void  lval_sexpr_print(lval* v, char open, char close);
+void  lval_sexpr_fprint(FILE* fp, lval* v, char open, char close);
 
 
 /*
@@ -205,15 +407,61 @@ void  lval_sexpr_print(lval* v, char open, char close);
 struct lenv
 {
     int count;
-    char** syms;
+    char** syms;        // interned, see lval_intern()
     lval** vals;
     lenv*  parent;
+    struct lglobals* globals;   // global scope only
 };
 
+// bytes counted for each binding, see MEMORY STATISTICS
+#define LENV_BINDING_SIZE   (sizeof(char*) + sizeof(lval*))
+
+/*
+ * GLOBAL SCOPE
+ * Tasks read the global scope from other threads while its owner
+ * defines into it, so readers never lock. Bindings are only ever
+ * appended, and a def publishes its value with an atomic store.
+ * Arrays outgrown by an append and values replaced by a def are
+ * retired rather than freed, since a reader may still be looking at
+ * them (see lenv_reclaim()). Writers take the lock among themselves.
+ */
+typedef struct lindex
+{
+    size_t  slots;          // a power of two
+    int     pos[];          // position + 1 by symbol address, 0 if empty
+} lindex;
+
+typedef struct lretired
+{
+    void*            ptr;
+    int              is_val;
+    struct lretired* next;
+} lretired;
+
+typedef struct lglobals
+{
+    pthread_mutex_t lock;
+    int             cap;
+    lindex*         index;
+    lretired*       retired;
+} lglobals;
+
 
 lenv* lenv_new(void);
+/*
+ * lenv_new_global()
+ * An environment for the global scope, see GLOBAL SCOPE
+ */
+lenv* lenv_new_global(void);
 void  lenv_del(lenv* env);
 lenv* lenv_copy(lenv* env);
+/*
+ * lenv_capture()
+ * A new env holding a copy of every local binding visible from env
+ * (inner scopes win) whose parent is the global scope. Code run in
+ * it no longer depends on the local scopes it was written in.
+ */
+lenv* lenv_capture(lenv* env);
 
 /*
  * lenv_get()
@@ -222,6 +470,13 @@ lenv* lenv_copy(lenv* env);
  * lval given by val.
  */
 lval* lenv_get(lenv* env, lval* val);
+/*
+ * lenv_find()
+ * The value bound to sym in env alone (not its parents), or NULL.
+ * This is the value itself rather than a copy. Values in the global
+ * scope stay valid until lenv_reclaim().
+ */
+lval* lenv_find(lenv* env, char* sym);
 /*
  * lenv_put()
  * Puts a new variable into the environment. If the variable already 
@@ -233,6 +488,19 @@ void lenv_put(lenv* env, lval* sym, lval* func);
  * Perform def in the top-most parent of the env
  */
 void lenv_def(lenv* env, lval* sym, lval* func);
+/*
+ * lenv_reclaim()
+ * Free what the global scope env has retired. Only call this when
+ * no other thread can be reading env.
+ */
+void lenv_reclaim(lenv* env);
+/*
+ * lenv_rebound()
+ * Call after binding a name in the global scope of env: forget the
+ * purity verdicts that may rest on the old value (see spec.h) and
+ * free what was replaced once no task can be reading it.
+ */
+void lenv_rebound(lenv* env);
 
 /*
  * ENVIRONMENT BUILTINS
@@ -243,6 +511,9 @@ lval* builtin_head(lenv* env, lval* val);
 lval* builtin_tail(lenv* env, lval* val);
 lval* builtin_eval(lenv* env, lval* val);
 lval* builtin_join(lenv* env, lval* val);
+lval* builtin_str(lenv* env, lval* val);
+lval* builtin_mem_stats(lenv* env, lval* val);
+lval* builtin_builtin_stats(lenv* env, lval* val);
 lval* builtin_lambda(lenv* env, lval* val);
 lval* builtin_def(lenv* env, lval* val);
 lval* builtin_put(lenv* env, lval* val);
@@ -267,6 +538,63 @@ lval* builtin_eq(lenv* env, lval* val);
 lval* builtin_ne(lenv* env, lval* val);
 lval* builtin_if(lenv* env, lval* val);
 
+// parallel list functions (see parallel.c)
+lval* builtin_pmap(lenv* env, lval* val);
+lval* builtin_pforeach(lenv* env, lval* val);
+lval* builtin_preduce(lenv* env, lval* val);
+
+// tasks (see task.c)
+lval* builtin_spawn(lenv* env, lval* val);
+lval* builtin_await(lenv* env, lval* val);
+
+// fibers (see fiber.c)
+lval* builtin_go(lenv* env, lval* val);
+lval* builtin_yield(lenv* env, lval* val);
+lval* builtin_sleep(lenv* env, lval* val);
+
+// channels (see chan.c)
+lval* builtin_chan(lenv* env, lval* val);
+lval* builtin_send(lenv* env, lval* val);
+lval* builtin_recv(lenv* env, lval* val);
+lval* builtin_select(lenv* env, lval* val);
+lval* builtin_close(lenv* env, lval* val);
+
+// actors (see actor.c)
+lval* builtin_spawn_actor(lenv* env, lval* val);
+lval* builtin_send_msg(lenv* env, lval* val);
+lval* builtin_receive(lenv* env, lval* val);
+lval* builtin_nodes(lenv* env, lval* val);
+
+// native modules (see native.c)
+lval* builtin_load_native(lenv* env, lval* val);
+
+// Name/function pair for the builtin table. pure builtins have no
+// effect besides their result (see spec.h).
+typedef struct
+{
+    const char* name;
+    lbuiltin    func;
+    int         pure;
+} lbuiltin_entry;
+
+/*
+ * lval_builtin_lookup()
+ * Find the builtin registered under name. Returns NULL if there
+ * is no such builtin.
+ */
+lbuiltin lval_builtin_lookup(const char* name);
+/*
+ * lval_builtin_name()
+ * Reverse of lval_builtin_lookup(). Returns NULL for functions
+ * that are not in the builtin table.
+ */
+const char* lval_builtin_name(lbuiltin func);
+/*
+ * lval_builtin_pure()
+ * Non-zero if func is a builtin without side effects
+ */
+int lval_builtin_pure(lbuiltin func);
+
 /*
  * lenv_add_builtin()
  */
@@ -98,6 +98,15 @@ typedef struct {
   char mem_full[MPC_INPUT_MEM_NUM];
   mpc_mem_t mem[MPC_INPUT_MEM_NUM];
 
+  struct mpc_memo_t *memo;
+
+  mpc_err_t failed;
+  char *failed_expected;
+  mpc_err_t furthest;
+  int furthest_slots;
+
+  struct mpc_arena_t *arena;
+
 } mpc_input_t;
 
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
@@ -126,6 +135,15 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+  i->failed.filename = i->filename;
+  i->failed.expected = &i->failed_expected;
+  i->furthest.filename = i->filename;
+  i->furthest.expected = NULL;
+  i->furthest_slots = 0;
+
+  i->arena = NULL;
+
   return i;
 }
 
@@ -156,6 +174,15 @@ static mpc_input_t *mpc_input_new_nstring(const char *filename, const char *stri
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+  i->failed.filename = i->filename;
+  i->failed.expected = &i->failed_expected;
+  i->furthest.filename = i->filename;
+  i->furthest.expected = NULL;
+  i->furthest_slots = 0;
+
+  i->arena = NULL;
+
   return i;
 
 }
@@ -185,6 +212,15 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+  i->failed.filename = i->filename;
+  i->failed.expected = &i->failed_expected;
+  i->furthest.filename = i->filename;
+  i->furthest.expected = NULL;
+  i->furthest_slots = 0;
+
+  i->arena = NULL;
+
   return i;
 
 }
@@ -213,13 +249,29 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->mem_index = 0;
   memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
 
+  i->memo = NULL;
+  i->failed.filename = i->filename;
+  i->failed.expected = &i->failed_expected;
+  i->furthest.filename = i->filename;
+  i->furthest.expected = NULL;
+  i->furthest_slots = 0;
+
+  i->arena = NULL;
+
   return i;
 }
 
+static void mpc_memo_delete(struct mpc_memo_t *m);
+static void mpc_arena_delete(struct mpc_arena_t *a);
+
 static void mpc_input_delete(mpc_input_t *i) {
 
   free(i->filename);
 
+  if (i->memo) { mpc_memo_delete(i->memo); }
+  if (i->arena) { mpc_arena_delete(i->arena); }
+  free(i->furthest.expected);
+
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
 
@@ -271,6 +323,7 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
 
   char *q = NULL;
 
+  if (p == NULL) { return mpc_malloc(i, n); }
   if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
 
   if (n > sizeof(mpc_mem_t)) {
@@ -283,8 +336,243 @@ static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   return p;
 }
 
+/*
+** Arena
+**
+** AST nodes built while parsing, their contents and
+** their children arrays are bump allocated from large
+** blocks owned by the input. Tags and error messages
+** come from a small intern table in the same arena,
+** so the "expr|sexpr|..." tags built as rules nest are
+** stored once rather than reallocated for each node.
+**
+** Error structs are also taken from the arena and are
+** kept on a free list to be reused as parsers fail.
+**
+** Nothing in the arena is freed on its own. When a
+** parse succeeds the arena is handed over to the root
+** of the result and `mpc_ast_delete` on that root frees
+** it in one go. Otherwise it is freed with the input.
+** Any arena node passed to a user function is first
+** copied out with `mpc_export`.
+*/
+
+enum {
+  MPC_ARENA_ALIGN       = 16,
+  MPC_ARENA_BLOCK_MIN   = 64 * 1024,
+  MPC_ARENA_BLOCK_MAX   = 16 * 1024 * 1024,
+  MPC_ARENA_STRINGS_MIN = 64
+};
+
+typedef struct mpc_arena_block_t {
+  struct mpc_arena_block_t *next;
+  size_t size;
+  size_t used;
+} mpc_arena_block_t;
+
+#define MPC_ARENA_HEADER \
+  ((sizeof(mpc_arena_block_t) + MPC_ARENA_ALIGN - 1) & ~(size_t)(MPC_ARENA_ALIGN - 1))
+
+typedef struct mpc_arena_t {
+  mpc_arena_block_t *blocks;
+  mpc_ast_t *root;
+  size_t strings_num;
+  size_t strings_slots;
+  char **strings;
+  int foreign_num;
+  mpc_ast_t **foreign;
+} mpc_arena_t;
+
+static mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *a = malloc(sizeof(mpc_arena_t));
+  a->blocks = NULL;
+  a->root = NULL;
+  a->strings_num = 0;
+  a->strings_slots = MPC_ARENA_STRINGS_MIN;
+  a->strings = calloc(a->strings_slots, sizeof(char*));
+  a->foreign_num = 0;
+  a->foreign = NULL;
+  return a;
+}
+
+static void mpc_arena_delete(mpc_arena_t *a) {
+  int j;
+  mpc_arena_block_t *b, *n;
+  for (j = 0; j < a->foreign_num; j++) { mpc_ast_delete(a->foreign[j]); }
+  for (b = a->blocks; b; b = n) { n = b->next; free(b); }
+  free(a->foreign);
+  free(a->strings);
+  free(a);
+}
+
+static void *mpc_arena_alloc(mpc_arena_t *a, size_t n) {
+
+  char *p;
+  size_t size;
+  mpc_arena_block_t *b = a->blocks;
+
+  n = (n + MPC_ARENA_ALIGN - 1) & ~(size_t)(MPC_ARENA_ALIGN - 1);
+
+  if (b == NULL || b->used + n > b->size) {
+    size = b ? b->size * 2 : MPC_ARENA_BLOCK_MIN;
+    if (size > MPC_ARENA_BLOCK_MAX) { size = MPC_ARENA_BLOCK_MAX; }
+    if (size < n) { size = n; }
+    b = malloc(MPC_ARENA_HEADER + size);
+    b->next = a->blocks;
+    b->size = size;
+    b->used = 0;
+    a->blocks = b;
+  }
+
+  p = (char*)b + MPC_ARENA_HEADER + b->used;
+  b->used += n;
+  return p;
+}
+
+static int mpc_arena_owns(mpc_arena_t *a, void *p) {
+  mpc_arena_block_t *b;
+  char *d;
+  for (b = a->blocks; b; b = b->next) {
+    d = (char*)b + MPC_ARENA_HEADER;
+    if ((char*)p >= d && (char*)p < d + b->size) { return 1; }
+  }
+  return 0;
+}
+
+static char *mpc_arena_strdup(mpc_arena_t *a, const char *s) {
+  size_t l = strlen(s);
+  char *c = mpc_arena_alloc(a, l + 1);
+  memcpy(c, s, l + 1);
+  return c;
+}
+
+static size_t mpc_arena_hash(const char *s) {
+  size_t h = 2166136261u;
+  while (*s) { h = (h ^ (unsigned char)*s++) * 16777619u; }
+  return h;
+}
+
+static void mpc_arena_strings_grow(mpc_arena_t *a) {
+
+  size_t j, k;
+  size_t slots = a->strings_slots * 2;
+  char **strings = calloc(slots, sizeof(char*));
+
+  for (j = 0; j < a->strings_slots; j++) {
+    if (a->strings[j] == NULL) { continue; }
+    k = mpc_arena_hash(a->strings[j]) & (slots - 1);
+    while (strings[k]) { k = (k + 1) & (slots - 1); }
+    strings[k] = a->strings[j];
+  }
+
+  free(a->strings);
+  a->strings = strings;
+  a->strings_slots = slots;
+}
+
+static char *mpc_arena_intern(mpc_arena_t *a, const char *s) {
+
+  size_t k;
+
+  if ((a->strings_num + 1) * 2 > a->strings_slots) { mpc_arena_strings_grow(a); }
+
+  k = mpc_arena_hash(s) & (a->strings_slots - 1);
+  while (a->strings[k]) {
+    if (strcmp(a->strings[k], s) == 0) { return a->strings[k]; }
+    k = (k + 1) & (a->strings_slots - 1);
+  }
+
+  a->strings[k] = mpc_arena_strdup(a, s);
+  a->strings_num++;
+  return a->strings[k];
+}
+
+/* Tags made by joining the first `lx` bytes of `x` and `y` with `sep`, interned */
+static char *mpc_arena_intern_cat(mpc_arena_t *a, const char *x, size_t lx, const char *sep, const char *y) {
+
+  char buff[256];
+  char *c, *r;
+  size_t ls = strlen(sep), ly = strlen(y);
+
+  c = lx + ls + ly < sizeof(buff) ? buff : malloc(lx + ls + ly + 1);
+  memcpy(c, x, lx);
+  memcpy(c + lx, sep, ls);
+  memcpy(c + lx + ls, y, ly + 1);
+
+  r = mpc_arena_intern(a, c);
+  if (c != buff) { free(c); }
+  return r;
+}
+
+/* Children arrays hold the next power of two slots so they can grow in place */
+static mpc_ast_t **mpc_arena_children(mpc_arena_t *a, int n) {
+  int slots = 1;
+  if (n == 0) { return NULL; }
+  while (slots < n) { slots *= 2; }
+  return mpc_arena_alloc(a, sizeof(mpc_ast_t*) * slots);
+}
+
+static mpc_ast_t *mpc_arena_ast_new(mpc_arena_t *a, const char *tag, const char *contents) {
+  mpc_ast_t *x = mpc_arena_alloc(a, sizeof(mpc_ast_t));
+  x->tag = mpc_arena_intern(a, tag);
+  x->contents = mpc_arena_strdup(a, contents);
+  x->state = mpc_state_new();
+  x->children_num = 0;
+  x->children = NULL;
+  x->arena = a;
+  return x;
+}
+
+static mpc_ast_t *mpc_arena_ast_copy(mpc_arena_t *a, mpc_ast_t *x) {
+
+  int j;
+  mpc_ast_t *c;
+
+  if (x == NULL) { return NULL; }
+
+  c = mpc_arena_alloc(a, sizeof(mpc_ast_t));
+  c->tag = x->arena == a ? x->tag : mpc_arena_intern(a, x->tag);
+  c->contents = x->arena == a ? x->contents : mpc_arena_strdup(a, x->contents);
+  c->state = x->state;
+  c->children_num = x->children_num;
+  c->children = mpc_arena_children(a, x->children_num);
+  c->arena = a;
+
+  for (j = 0; j < x->children_num; j++) {
+    c->children[j] = mpc_arena_ast_copy(a, x->children[j]);
+  }
+
+  return c;
+}
+
+/* Heap nodes added below arena nodes are deleted along with the arena */
+static void mpc_arena_foreign(mpc_arena_t *a, mpc_ast_t *x) {
+  a->foreign_num++;
+  a->foreign = realloc(a->foreign, sizeof(mpc_ast_t*) * a->foreign_num);
+  a->foreign[a->foreign_num-1] = x;
+}
+
+static mpc_arena_t *mpc_input_arena(mpc_input_t *i) {
+  if (i->arena == NULL) { i->arena = mpc_arena_new(); }
+  return i->arena;
+}
+
+static int mpc_arena_ptr(mpc_input_t *i, void *p) {
+  return i->arena && mpc_arena_owns(i->arena, p);
+}
+
+/* For values that may be arena nodes, which are freed with the arena */
+static void mpc_free_val(mpc_input_t *i, void *p) {
+  if (p == NULL) { return; }
+  if (!mpc_mem_ptr(i, p) && mpc_arena_ptr(i, p)) { return; }
+  mpc_free(i, p);
+}
+
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a);
+
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
+  if (mpc_arena_ptr(i, p)) { return mpc_ast_copy(p); }
   if (!mpc_mem_ptr(i, p)) { return p; }
   q = malloc(sizeof(mpc_mem_t));
   memcpy(q, p, sizeof(mpc_mem_t));
@@ -568,12 +856,14 @@ static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
 ** Error Type
 */
 
+/*
+** Errors handed to the user are a single allocation
+** holding the struct and every string it points to
+** (see `mpc_err_block`). While parsing the strings are
+** borrowed from the input, the parsers or the arena.
+*/
+
 void mpc_err_delete(mpc_err_t *x) {
-  int i;
-  for (i = 0; i < x->expected_num; i++) { free(x->expected[i]); }
-  free(x->expected);
-  free(x->filename);
-  free(x->failure);
   free(x);
 }
 
@@ -597,9 +887,8 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+/* Uses the caller's buffer so that errors can be printed from any thread */
+static const char *mpc_err_char_unescape(char c, char *char_unescape_buffer) {
 
   char_unescape_buffer[0] = '\'';
   char_unescape_buffer[1] = ' ';
@@ -629,6 +918,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int pos = 0;
   int max = 1023;
   char *buffer = calloc(1, 1024);
+  char received[4];
 
   if (x->failure) {
     mpc_err_string_cat(buffer, &pos, &max,
@@ -653,201 +943,130 @@ char *mpc_err_string(mpc_err_t *x) {
   }
 
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, received));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
 
   return realloc(buffer, strlen(buffer) + 1);
 }
 
+static mpc_err_t *mpc_err_block(mpc_err_t *x) {
+
+  int j;
+  char *c;
+  mpc_err_t *y;
+  size_t l = sizeof(mpc_err_t) + sizeof(char*) * x->expected_num + strlen(x->filename) + 1;
+
+  if (x->failure) { l += strlen(x->failure) + 1; }
+  for (j = 0; j < x->expected_num; j++) { l += strlen(x->expected[j]) + 1; }
+
+  y = malloc(l);
+  *y = *x;
+  y->expected = x->expected_num ? (char**)(y + 1) : NULL;
+  c = (char*)(y + 1) + sizeof(char*) * x->expected_num;
+
+  y->filename = strcpy(c, x->filename); c += strlen(c) + 1;
+  if (x->failure) { y->failure = strcpy(c, x->failure); c += strlen(c) + 1; }
+  for (j = 0; j < x->expected_num; j++) {
+    y->expected[j] = strcpy(c, x->expected[j]); c += strlen(c) + 1;
+  }
+
+  return y;
+}
+
+/*
+** Errors are built lazily. A parser that fails leaves
+** at most one error behind in `i->failed`, holding a
+** single expected string or failure message borrowed
+** from the parser. Parsers that recover from a failure
+** (`or`, `maybe`, `many`) fold it into `i->furthest`,
+** which keeps the furthest position any parser failed
+** at and the set of strings expected there. Errors
+** behind that position can never be reported so they
+** are dropped as soon as they happen.
+**
+** Only if the whole parse fails is `i->furthest` copied
+** out into an `mpc_err_t` for the user.
+*/
+
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
+  mpc_err_t *x = &i->failed;
+  if (i->suppress || i->state.pos < i->furthest.state.pos) { return NULL; }
   x->state = i->state;
   x->expected_num = 1;
-  x->expected = mpc_malloc(i, sizeof(char*));
-  x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
+  x->expected[0] = (char*)expected;
   x->failure = NULL;
   x->recieved = mpc_input_peekc(i);
   return x;
 }
 
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
-  mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
+  mpc_err_t *x = &i->failed;
+  if (i->suppress || i->state.pos < i->furthest.state.pos) { return NULL; }
   x->state = i->state;
   x->expected_num = 0;
-  x->expected = NULL;
-  x->failure = mpc_malloc(i, strlen(failure) + 1);
-  strcpy(x->failure, failure);
+  x->failure = (char*)failure;
   x->recieved = ' ';
   return x;
 }
 
 static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
-  mpc_err_t *x;
-  x = malloc(sizeof(mpc_err_t));
-  x->filename = malloc(strlen(filename) + 1);
-  strcpy(x->filename, filename);
-  x->state = mpc_state_new();
-  x->expected_num = 0;
-  x->expected = NULL;
-  x->failure = malloc(strlen(failure) + 1);
-  strcpy(x->failure, failure);
-  x->recieved = ' ';
-  return x;
-}
-
-static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
-  int j;
-  if (x == NULL) { return; }
-  for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-  mpc_free(i, x->expected);
-  mpc_free(i, x->filename);
-  mpc_free(i, x->failure);
-  mpc_free(i, x);
-}
-
-static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
-  int j;
-  for (j = 0; j < x->expected_num; j++) {
-    x->expected[j] = mpc_export(i, x->expected[j]);
-  }
-  x->expected = mpc_export(i, x->expected);
-  x->filename = mpc_export(i, x->filename);
-  x->failure = mpc_export(i, x->failure);
-  return mpc_export(i, x);
+  mpc_err_t x;
+  x.filename = (char*)filename;
+  x.state = mpc_state_new();
+  x.expected_num = 0;
+  x.expected = NULL;
+  x.failure = (char*)failure;
+  x.recieved = ' ';
+  return mpc_err_block(&x);
 }
 
-static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
+static int mpc_err_contains_expected(mpc_err_t *x, char *expected) {
   int j;
-  (void)i;
   for (j = 0; j < x->expected_num; j++) {
     if (strcmp(x->expected[j], expected) == 0) { return 1; }
   }
   return 0;
 }
 
-static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  (void)i;
-  x->expected_num++;
-  x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
-}
-
-static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
-
-  int j, k, fst;
-  mpc_err_t *e;
-
-  fst = -1;
-  for (j = 0; j < n; j++) {
-    if (x[j] != NULL) { fst = j; }
-  }
-
-  if (fst == -1) { return NULL; }
-
-  e = mpc_malloc(i, sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = mpc_malloc(i, strlen(x[fst]->filename)+1);
-  strcpy(e->filename, x[fst]->filename);
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos > e->state.pos) { e->state = x[j]->state; }
+static void mpc_err_add_expected(mpc_input_t *i, char *expected) {
+  mpc_err_t *x = &i->furthest;
+  if (x->expected_num == i->furthest_slots) {
+    i->furthest_slots = i->furthest_slots ? i->furthest_slots * 2 : 4;
+    x->expected = realloc(x->expected, sizeof(char*) * i->furthest_slots);
   }
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos < e->state.pos) { continue; }
-
-    if (x[j]->failure) {
-      e->failure = mpc_malloc(i, strlen(x[j]->failure)+1);
-      strcpy(e->failure, x[j]->failure);
-      break;
-    }
-
-    e->recieved = x[j]->recieved;
-
-    for (k = 0; k < x[j]->expected_num; k++) {
-      if (!mpc_err_contains_expected(i, e, x[j]->expected[k])) {
-        mpc_err_add_expected(i, e, x[j]->expected[k]);
-      }
-    }
-  }
-
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    mpc_err_delete_internal(i, x[j]);
-  }
-
-  return e;
+  x->expected[x->expected_num++] = expected;
 }
 
-static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
+static void mpc_err_furthest(mpc_input_t *i, mpc_err_t *x) {
 
-  int j = 0;
-  size_t l = 0;
-  char *expect = NULL;
+  mpc_err_t *e = &i->furthest;
 
-  if (x == NULL) { return NULL; }
+  if (x == NULL || x->state.pos < e->state.pos) { return; }
 
-  if (x->expected_num == 0) {
-    expect = mpc_calloc(i, 1, 1);
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
+  if (x->state.pos > e->state.pos) {
+    e->state = x->state;
+    e->expected_num = 0;
+    e->failure = NULL;
+  } else if (e->failure) {
+    return;
   }
 
-  else if (x->expected_num == 1) {
-    expect = mpc_malloc(i, strlen(prefix) + strlen(x->expected[0]) + 1);
-    strcpy(expect, prefix);
-    strcat(expect, x->expected[0]);
-    mpc_free(i, x->expected[0]);
-    x->expected[0] = expect;
-    return x;
+  if (x->failure) {
+    e->failure = x->failure;
+    return;
   }
 
-  else if (x->expected_num > 1) {
-
-    l += strlen(prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      l += strlen(x->expected[j]) + strlen(", ");
-    }
-    l += strlen(x->expected[x->expected_num-2]);
-    l += strlen(" or ");
-    l += strlen(x->expected[x->expected_num-1]);
-
-    expect = mpc_malloc(i, l + 1);
+  e->recieved = x->recieved;
 
-    strcpy(expect, prefix);
-    for (j = 0; j < x->expected_num-2; j++) {
-      strcat(expect, x->expected[j]); strcat(expect, ", ");
-    }
-    strcat(expect, x->expected[x->expected_num-2]);
-    strcat(expect, " or ");
-    strcat(expect, x->expected[x->expected_num-1]);
-
-    for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-
-    x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
-    return x;
+  if (x->expected_num && !mpc_err_contains_expected(e, x->expected[0])) {
+    mpc_err_add_expected(i, x->expected[0]);
   }
+}
 
-  return NULL;
+static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
+  if (x == NULL || x->failure) { return x; }
+  x->expected[0] = mpc_arena_intern_cat(mpc_input_arena(i), prefix, strlen(prefix), "", x->expected[0]);
+  return x;
 }
 
 static mpc_err_t *mpc_err_many1(mpc_input_t *i, mpc_err_t *x) {
@@ -855,21 +1074,9 @@ static mpc_err_t *mpc_err_many1(mpc_input_t *i, mpc_err_t *x) {
 }
 
 static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
-  mpc_err_t *y;
-  int digits = n/10 + 1;
-  char *prefix;
-  prefix = mpc_malloc(i, digits + strlen(" of ") + 1);
+  char prefix[32];
   sprintf(prefix, "%i of ", n);
-  y = mpc_err_repeat(i, x, prefix);
-  mpc_free(i, prefix);
-  return y;
-}
-
-static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
-  mpc_err_t *errs[2];
-  errs[0] = x;
-  errs[1] = y;
-  return mpc_err_or(i, errs, 2);
+  return mpc_err_repeat(i, x, prefix);
 }
 
 /*
@@ -910,7 +1117,9 @@ enum {
   MPC_TYPE_CHECK_WITH = 26,
 
   MPC_TYPE_SOI        = 27,
-  MPC_TYPE_EOI        = 28
+  MPC_TYPE_EOI        = 28,
+
+  MPC_TYPE_DFA        = 29
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -930,6 +1139,7 @@ typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
 typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { struct mpc_dfa_t *d; mpc_parser_t *x; } mpc_pdata_dfa_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -949,6 +1159,7 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_dfa_t dfa;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -956,11 +1167,12 @@ struct mpc_parser_t {
   mpc_pdata_t data;
   char type;
   char retained;
+  char memo;
 };
 
 static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
   int j;
-  for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
+  for (j = 0; j < n; j++) { if (j != x) { mpc_free_val(i, xs[j]); } }
   return xs[x];
 }
 
@@ -987,6 +1199,60 @@ static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
   return a;
 }
 
+/* Nodes from user functions are moved into the arena before being joined */
+static mpc_ast_t *mpc_input_ast_adopt(mpc_input_t *i, mpc_ast_t *a) {
+  mpc_ast_t *c;
+  if (a == NULL || a->arena == i->arena) { return a; }
+  c = mpc_arena_ast_copy(i->arena, a);
+  mpc_ast_delete(a);
+  return c;
+}
+
+static mpc_val_t *mpcf_input_fold_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+
+  int j, k, m;
+  mpc_ast_t **as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
+
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+
+  mpc_input_arena(i);
+
+  for (j = 0, m = 0; j < n; j++) {
+    as[j] = mpc_input_ast_adopt(i, as[j]);
+    if (as[j] == NULL) { continue; }
+    m += as[j]->children_num >= 2 ? as[j]->children_num : 1;
+  }
+
+  r = mpc_arena_ast_new(i->arena, ">", "");
+  r->children = mpc_arena_children(i->arena, m);
+
+  for (j = 0; j < n; j++) {
+
+    if (as[j] == NULL) { continue; }
+
+    if        (as[j]->children_num == 0) {
+      r->children[r->children_num++] = as[j];
+    } else if (as[j]->children_num == 1) {
+      r->children[r->children_num++] = mpc_ast_add_root_tag(as[j]->children[0], as[j]->tag);
+    } else {
+      for (k = 0; k < as[j]->children_num; k++) {
+        r->children[r->children_num++] = as[j]->children[k];
+      }
+    }
+
+  }
+
+  if (r->children_num) {
+    r->state = r->children[0]->state;
+  }
+
+  return r;
+}
+
 static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
   int j;
   if (f == mpcf_null)      { return mpcf_null(n, xs); }
@@ -998,33 +1264,45 @@ static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t
   if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
   if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
   if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  if (f == mpcf_fold_ast)  { return mpcf_input_fold_ast(i, n, xs); }
   for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
   return f(j, xs);
 }
 
 static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
-  mpc_free(i, x);
+  mpc_free_val(i, x);
   return NULL;
 }
 
 static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_ast_t *a = mpc_arena_ast_new(mpc_input_arena(i), "", c);
   mpc_free(i, c);
   return a;
 }
 
+/* The AST functions below work on arena nodes directly so skip the export */
+
 static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
   if (f == mpcf_free)     { return mpcf_input_free(i, x); }
   if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  if (f == (mpc_apply_t)mpc_ast_add_root) { return mpc_ast_add_root(x); }
   return f(mpc_export(i, x));
 }
 
 static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  if (f == (mpc_apply_to_t)mpc_ast_tag)     { return mpc_ast_tag(x, d); }
+  if (f == (mpc_apply_to_t)mpc_ast_add_tag) { return mpc_ast_add_tag(x, d); }
   return f(mpc_export(i, x), d);
 }
 
+static mpc_val_t *mpc_parse_lift(mpc_input_t *i, mpc_ctor_t f) {
+  if (f == mpcf_ctor_str) { return mpc_calloc(i, 1, 1); }
+  return f();
+}
+
 static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
-  if (d == free) { mpc_free(i, x); return; }
+  if (d == free) { mpc_free_val(i, x); return; }
+  if (d == (mpc_dtor_t)mpc_ast_delete) { mpc_ast_delete(x); return; }
   d(mpc_export(i, x));
 }
 
@@ -1038,7 +1316,283 @@ enum {
   if (x) { MPC_SUCCESS(r->output); } \
   else { MPC_FAILURE(NULL); }
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+/*
+** DFA Matching
+**
+** Regular expressions built with `MPC_RE_DFA` are,
+** where possible, compiled to a table driven DFA (see
+** `mpc_re_dfa`). Bytes are first mapped through a
+** 256 entry class table so that the transition table
+** only needs one column per class of bytes that the
+** expression cannot tell apart.
+**
+** Matching walks the raw string buffer once and keeps
+** the longest accepting prefix. Other input types use
+** the original combinator parser, which is kept along
+** side the table.
+**
+** The DFA does not build errors. It is only used when
+** errors are suppressed, as they are for every regex in
+** `mpca_lang`, or when the combinators would not build
+** any errors either.
+*/
+
+typedef struct mpc_dfa_t {
+  int states_num;
+  int classes_num;
+  unsigned char classes[256];
+  int *trans;
+  char *accept;
+  int quiet;
+} mpc_dfa_t;
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  free(d->trans);
+  free(d->accept);
+  free(d);
+}
+
+static mpc_dfa_t *mpc_dfa_copy(mpc_dfa_t *a) {
+  mpc_dfa_t *d = malloc(sizeof(mpc_dfa_t));
+  *d = *a;
+  d->trans = malloc(sizeof(int) * a->states_num * a->classes_num);
+  d->accept = malloc(a->states_num);
+  memcpy(d->trans, a->trans, sizeof(int) * a->states_num * a->classes_num);
+  memcpy(d->accept, a->accept, a->states_num);
+  return d;
+}
+
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, char **o) {
+
+  const unsigned char *s = (const unsigned char*)i->string + i->state.pos;
+  long n = 0, m = d->accept[0] ? 0 : -1;
+  int x = 0;
+
+  while (s[n]) {
+    x = d->trans[x * d->classes_num + d->classes[s[n]]];
+    if (x < 0) { break; }
+    n++;
+    if (d->accept[x]) { m = n; }
+  }
+
+  if (m < 0) { return 0; }
+
+  for (n = 0; n < m; n++) {
+    i->state.col++;
+    if (s[n] == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+
+  if (m > 0) { i->last = s[m-1]; }
+  i->state.pos += m;
+
+  if (o) {
+    (*o) = mpc_malloc(i, m + 1);
+    memcpy(*o, s, m);
+    (*o)[m] = '\0';
+  }
+
+  return 1;
+}
+
+/*
+** Memoization
+**
+** Grammars built with `MPCA_LANG_MEMOIZE` mark each
+** rule so that its result at a given input position
+** is remembered. When `or` backtracks and the same
+** rule is tried again at the same position the result
+** is copied out of the table instead of parsed again.
+** This is packrat parsing and means each rule runs at
+** most once per position.
+**
+** Only string inputs are memoized, since that is the
+** only input that can jump back for free. Once the
+** table holds `mpc_memo_limit` bytes it stops growing
+** and rules that miss are parsed as normal.
+**
+** Stored results are copies kept in the parse arena.
+** A stored failure also keeps the error it left behind.
+** Anything the rule added to the furthest failure (see
+** `mpc_err_furthest`) is already there when it is read
+** back, so errors come out the same as without the table.
+** Since nothing is recorded while errors are suppressed
+** those results are stored separately.
+*/
+
+static size_t mpc_memo_max = MPC_MEMO_LIMIT_DEFAULT;
+
+void mpc_memo_limit(size_t bytes) { mpc_memo_max = bytes; }
+
+enum {
+  MPC_MEMO_SLOTS_MIN = 256
+};
+
+enum {
+  MPC_MEMO_TERM      = 1,
+  MPC_MEMO_BACKTRACK = 2,
+  MPC_MEMO_SUPPRESS  = 4
+};
+
+typedef struct {
+  mpc_parser_t *p;
+  long pos;
+  int flags;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_ast_t *output;
+  char recieved;
+  char *expected;
+  char *failure;
+} mpc_memo_entry_t;
+
+typedef struct mpc_memo_t {
+  size_t slots;
+  size_t num;
+  size_t bytes;
+  mpc_memo_entry_t *entries;
+} mpc_memo_t;
+
+static size_t mpc_ast_bytes(mpc_ast_t *a);
+
+static mpc_memo_t *mpc_memo_new(void) {
+  mpc_memo_t *m = malloc(sizeof(mpc_memo_t));
+  m->slots = MPC_MEMO_SLOTS_MIN;
+  m->num = 0;
+  m->bytes = sizeof(mpc_memo_t) + sizeof(mpc_memo_entry_t) * m->slots;
+  m->entries = calloc(m->slots, sizeof(mpc_memo_entry_t));
+  return m;
+}
+
+static void mpc_memo_delete(mpc_memo_t *m) {
+  free(m->entries);
+  free(m);
+}
+
+static size_t mpc_memo_hash(mpc_parser_t *p, long pos, int flags) {
+  size_t h = (size_t)p;
+  h ^= (size_t)pos * 0x9E3779B1u + (h << 6) + (h >> 2);
+  h ^= (size_t)flags * 0x85EBCA6Bu;
+  return h;
+}
+
+/* Returns the entry for the key, or the empty slot it would go in */
+static mpc_memo_entry_t *mpc_memo_find(mpc_memo_t *m, mpc_parser_t *p, long pos, int flags) {
+  size_t j = mpc_memo_hash(p, pos, flags) & (m->slots-1);
+  while (m->entries[j].p) {
+    if (m->entries[j].p == p
+    &&  m->entries[j].pos == pos
+    &&  m->entries[j].flags == flags) { return &m->entries[j]; }
+    j = (j+1) & (m->slots-1);
+  }
+  return &m->entries[j];
+}
+
+static int mpc_memo_grow(mpc_memo_t *m) {
+
+  size_t j;
+  mpc_memo_entry_t *old = m->entries;
+  size_t old_slots = m->slots;
+  size_t extra = sizeof(mpc_memo_entry_t) * old_slots;
+
+  if (m->bytes + extra > mpc_memo_max) { return 0; }
+
+  m->slots = old_slots * 2;
+  m->bytes += extra;
+  m->entries = calloc(m->slots, sizeof(mpc_memo_entry_t));
+
+  for (j = 0; j < old_slots; j++) {
+    if (old[j].p) {
+      *mpc_memo_find(m, old[j].p, old[j].pos, old[j].flags) = old[j];
+    }
+  }
+
+  free(old);
+  return 1;
+}
+
+static int mpc_memo_flags(mpc_input_t *i) {
+  return (i->state.term ? MPC_MEMO_TERM : 0)
+       | (i->backtrack > 0 ? MPC_MEMO_BACKTRACK : 0)
+       | (i->suppress > 0 ? MPC_MEMO_SUPPRESS : 0);
+}
+
+static int mpc_memo_active(mpc_input_t *i) {
+  return i->type == MPC_INPUT_STRING;
+}
+
+static void mpc_memo_insert(mpc_input_t *i, mpc_parser_t *p, long pos, int flags, int success, mpc_result_t *r) {
+
+  mpc_memo_t *m = i->memo;
+  mpc_memo_entry_t *x;
+  mpc_err_t *e = success ? NULL : r->error;
+  size_t bytes = success ? mpc_ast_bytes(r->output) : 0;
+
+  if (m->bytes + bytes > mpc_memo_max) { return; }
+  if ((m->num+1) * 2 > m->slots && !mpc_memo_grow(m)) { return; }
+
+  x = mpc_memo_find(m, p, pos, flags);
+  x->p = p;
+  x->pos = pos;
+  x->flags = flags;
+  x->success = success;
+  x->state = e ? e->state : i->state;
+  x->last = i->last;
+  x->output = success ? mpc_arena_ast_copy(mpc_input_arena(i), r->output) : NULL;
+  x->recieved = e ? e->recieved : ' ';
+  x->expected = e && e->expected_num ? e->expected[0] : NULL;
+  x->failure = e ? e->failure : NULL;
+
+  m->num++;
+  m->bytes += bytes;
+}
+
+/* Returns the error a stored failure left behind, if any */
+static mpc_err_t *mpc_memo_error(mpc_input_t *i, mpc_memo_entry_t *m) {
+  mpc_err_t *x = &i->failed;
+  if (m->expected == NULL && m->failure == NULL) { return NULL; }
+  x->state = m->state;
+  x->expected_num = m->expected ? 1 : 0;
+  x->expected[0] = m->expected;
+  x->failure = m->failure;
+  x->recieved = m->recieved;
+  return x;
+}
+
+static int mpc_parse_step(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r);
+
+static int mpc_memo_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+
+  int x;
+  mpc_memo_entry_t *m;
+  long pos = i->state.pos;
+  int flags = mpc_memo_flags(i);
+
+  if (i->memo == NULL) { i->memo = mpc_memo_new(); }
+
+  m = mpc_memo_find(i->memo, p, pos, flags);
+  if (m->p) {
+    if (!m->success) { r->error = mpc_memo_error(i, m); return 0; }
+    i->state = m->state;
+    i->last = m->last;
+    r->output = mpc_arena_ast_copy(mpc_input_arena(i), m->output);
+    return 1;
+  }
+
+  x = mpc_parse_step(i, p, r);
+  mpc_memo_insert(i, p, pos, flags, x, r);
+  return x;
+}
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
+  if (p->memo && mpc_memo_active(i)) { return mpc_memo_run(i, p, r); }
+  return mpc_parse_step(i, p, r);
+}
+
+static int mpc_parse_step(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
 
   int j = 0, k = 0;
   mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
@@ -1060,33 +1614,39 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_SOI:     MPC_PRIMITIVE(mpc_input_soi(i, (char**)&r->output));
     case MPC_TYPE_EOI:     MPC_PRIMITIVE(mpc_input_eoi(i, (char**)&r->output));
 
+    case MPC_TYPE_DFA:
+      if (i->type == MPC_INPUT_STRING && (i->suppress || p->data.dfa.d->quiet)) {
+        MPC_PRIMITIVE(mpc_input_dfa(i, p->data.dfa.d, (char**)&r->output));
+      }
+      return mpc_parse_run(i, p->data.dfa.x, r);
+
     /* Other parsers */
 
     case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
     case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
     case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(mpc_parse_lift(i, p->data.lift.lf));
     case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
     case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
 
     /* Application Parsers */
 
     case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
+      if (mpc_parse_run(i, p->data.apply.x, r)) {
         MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
       } else {
         MPC_FAILURE(r->output);
       }
 
     case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
+      if (mpc_parse_run(i, p->data.apply_to.x, r)) {
         MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
       } else {
         MPC_FAILURE(r->error);
       }
 
     case MPC_TYPE_CHECK:
-      if (mpc_parse_run(i, p->data.check.x, r, e)) {
+      if (mpc_parse_run(i, p->data.check.x, r)) {
         if (p->data.check.f(&r->output)) {
           MPC_SUCCESS(r->output);
         } else {
@@ -1097,7 +1657,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       }
 
     case MPC_TYPE_CHECK_WITH:
-      if (mpc_parse_run(i, p->data.check_with.x, r, e)) {
+      if (mpc_parse_run(i, p->data.check_with.x, r)) {
         if (p->data.check_with.f(&r->output, p->data.check_with.d)) {
           MPC_SUCCESS(r->output);
         } else {
@@ -1109,7 +1669,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
     case MPC_TYPE_EXPECT:
       mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
+      if (mpc_parse_run(i, p->data.expect.x, r)) {
         mpc_input_suppress_disable(i);
         MPC_SUCCESS(r->output);
       } else {
@@ -1119,7 +1679,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
     case MPC_TYPE_PREDICT:
       mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {
+      if (mpc_parse_run(i, p->data.predict.x, r)) {
         mpc_input_backtrack_enable(i);
         MPC_SUCCESS(r->output);
       } else {
@@ -1134,7 +1694,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
     case MPC_TYPE_NOT:
       mpc_input_mark(i);
       mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      if (mpc_parse_run(i, p->data.not.x, r)) {
         mpc_input_rewind(i);
         mpc_input_suppress_disable(i);
         mpc_parse_dtor(i, p->data.not.dx, r->output);
@@ -1142,15 +1702,15 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
       } else {
         mpc_input_unmark(i);
         mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
+        MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
       }
 
     case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
+      if (mpc_parse_run(i, p->data.not.x, r)) {
         MPC_SUCCESS(r->output);
       } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
+        mpc_err_furthest(i, r->error);
+        MPC_SUCCESS(mpc_parse_lift(i, p->data.not.lf));
       }
 
     /* Repeat Parsers */
@@ -1159,7 +1719,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
       results = results_stk;
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j])) {
         j++;
         if (j == MPC_PARSE_STACK_MIN) {
           results_slots = j + j / 2;
@@ -1171,7 +1731,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         }
       }
 
-      *e = mpc_err_merge(i, *e, results[j].error);
+      mpc_err_furthest(i, results[j].error);
 
       MPC_SUCCESS(
         mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
@@ -1181,7 +1741,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
       results = results_stk;
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j])) {
         j++;
         if (j == MPC_PARSE_STACK_MIN) {
           results_slots = j + j / 2;
@@ -1199,7 +1759,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
           if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
       } else {
 
-        *e = mpc_err_merge(i, *e, results[j].error);
+        mpc_err_furthest(i, results[j].error);
 
         MPC_SUCCESS(
           mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
@@ -1212,7 +1772,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
         : results_stk;
 
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
+      while (mpc_parse_run(i, p->data.repeat.x, &results[j])) {
         j++;
         if (j == p->data.repeat.n) { break; }
       }
@@ -1241,11 +1801,11 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
         : results_stk;
 
       for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
+        if (mpc_parse_run(i, p->data.or.xs[j], &results[j])) {
           MPC_SUCCESS(results[j].output;
             if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
         } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
+          mpc_err_furthest(i, results[j].error);
         }
       }
 
@@ -1262,7 +1822,7 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
       mpc_input_mark(i);
       for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
+        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j])) {
           mpc_input_rewind(i);
           for (k = 0; k < j; k++) {
             mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
@@ -1293,14 +1853,22 @@ static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_e
 
 int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  e->state = mpc_state_invalid();
-  x = mpc_parse_run(i, p, r, &e);
+  i->furthest.state = mpc_state_invalid();
+  i->furthest.expected_num = 0;
+  i->furthest.failure = "Unknown Error";
+  i->furthest.recieved = ' ';
+  x = mpc_parse_run(i, p, r);
   if (x) {
-    mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
+    if (mpc_arena_ptr(i, r->output)) {
+      /* The result owns the arena from here on */
+      i->arena->root = r->output;
+      i->arena = NULL;
+    } else {
+      r->output = mpc_export(i, r->output);
+    }
   } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+    mpc_err_furthest(i, r->error);
+    r->error = mpc_err_block(&i->furthest);
   }
   return x;
 }
@@ -1427,6 +1995,11 @@ static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
       free(p->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      mpc_undefine_unretained(p->data.dfa.x, 0);
+      mpc_dfa_delete(p->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -1551,6 +2124,11 @@ mpc_parser_t *mpc_copy(mpc_parser_t *a) {
       strcpy(p->data.check_with.e, a->data.check_with.e);
       break;
 
+    case MPC_TYPE_DFA:
+      p->data.dfa.x = mpc_copy(a->data.dfa.x);
+      p->data.dfa.d = mpc_dfa_copy(a->data.dfa.d);
+      break;
+
     default: break;
   }
 
@@ -2335,6 +2913,255 @@ static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
   return out;
 }
 
+/*
+** Regular Expression DFA Compiler
+**
+** Builds the Glushkov (position) automaton of a regex
+** parser: one state per character set in the expression
+** plus a start state. The DFA is only used when this
+** automaton is already deterministic, in which case it
+** matches exactly what the combinator parser does,
+** since at every byte there is only one way forward.
+**
+** Anything else - anchors, negated escapes, counted
+** repeats, loops over parsers that can match nothing,
+** or expressions that would need the combinators to
+** backtrack - is left to the combinator parser.
+*/
+
+enum {
+  MPC_DFA_POSITIONS_MAX = 255
+};
+
+typedef struct {
+  unsigned int bits[(MPC_DFA_POSITIONS_MAX + 1) / 32];
+} mpc_dfa_set_t;
+
+typedef struct {
+  int nullable;
+  mpc_dfa_set_t first;
+  mpc_dfa_set_t last;
+} mpc_dfa_info_t;
+
+typedef struct {
+  int num;
+  int expects;
+  unsigned char chars[MPC_DFA_POSITIONS_MAX + 1][32];
+  mpc_dfa_set_t follow[MPC_DFA_POSITIONS_MAX + 1];
+} mpc_dfa_builder_t;
+
+static void mpc_dfa_set_add(mpc_dfa_set_t *s, int k) { s->bits[k / 32] |= 1u << (k % 32); }
+static int mpc_dfa_set_has(mpc_dfa_set_t *s, int k) { return (s->bits[k / 32] >> (k % 32)) & 1; }
+
+static void mpc_dfa_set_union(mpc_dfa_set_t *s, mpc_dfa_set_t *t) {
+  size_t j;
+  for (j = 0; j < sizeof(s->bits) / sizeof(s->bits[0]); j++) { s->bits[j] |= t->bits[j]; }
+}
+
+static void mpc_dfa_chars_add(unsigned char *chars, unsigned char c) { chars[c / 8] |= 1 << (c % 8); }
+static int mpc_dfa_chars_has(unsigned char *chars, unsigned char c) { return (chars[c / 8] >> (c % 8)) & 1; }
+
+static void mpc_dfa_follow(mpc_dfa_builder_t *b, mpc_dfa_set_t *from, mpc_dfa_set_t *to) {
+  int k;
+  for (k = 1; k <= b->num; k++) {
+    if (mpc_dfa_set_has(from, k)) { mpc_dfa_set_union(&b->follow[k], to); }
+  }
+}
+
+static void mpc_dfa_seq(mpc_dfa_builder_t *b, mpc_dfa_info_t *x, mpc_dfa_info_t *y) {
+  mpc_dfa_follow(b, &x->last, &y->first);
+  if (x->nullable) { mpc_dfa_set_union(&x->first, &y->first); }
+  if (y->nullable) { mpc_dfa_set_union(&y->last, &x->last); }
+  x->last = y->last;
+  x->nullable = x->nullable && y->nullable;
+}
+
+static int mpc_dfa_build(mpc_dfa_builder_t *b, mpc_parser_t *p, mpc_dfa_info_t *info) {
+
+  int j, c;
+  unsigned char chars[32];
+  mpc_dfa_info_t x;
+
+  memset(info, 0, sizeof(mpc_dfa_info_t));
+  memset(chars, 0, sizeof(chars));
+
+  if (p->retained) { return 0; }
+
+  switch (p->type) {
+
+    /* Character Sets */
+
+    case MPC_TYPE_ANY:
+      for (c = 1; c < 256; c++) { mpc_dfa_chars_add(chars, c); }
+      break;
+    case MPC_TYPE_SINGLE:
+      if (p->data.single.x == '\0') { return 0; }
+      mpc_dfa_chars_add(chars, p->data.single.x);
+      break;
+    case MPC_TYPE_RANGE:
+      for (c = 1; c < 256; c++) {
+        if ((char)c >= p->data.range.x && (char)c <= p->data.range.y) { mpc_dfa_chars_add(chars, c); }
+      }
+      break;
+    case MPC_TYPE_ONEOF:
+      for (c = 1; c < 256; c++) {
+        if (strchr(p->data.string.x, c)) { mpc_dfa_chars_add(chars, c); }
+      }
+      break;
+    case MPC_TYPE_NONEOF:
+      for (c = 1; c < 256; c++) {
+        if (!strchr(p->data.string.x, c)) { mpc_dfa_chars_add(chars, c); }
+      }
+      break;
+
+    /* Errors come from the combinators, see `mpc_dfa_t` */
+
+    case MPC_TYPE_EXPECT:
+      b->expects++;
+      return mpc_dfa_build(b, p->data.expect.x, info);
+
+    /* Empty String */
+
+    case MPC_TYPE_LIFT:
+      if (p->data.lift.lf != mpcf_ctor_str) { return 0; }
+      info->nullable = 1;
+      return 1;
+
+    /* Repetition */
+
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      if (!mpc_dfa_build(b, p->data.not.x, info)) { return 0; }
+      info->nullable = 1;
+      return 1;
+
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      if (p->data.repeat.f != mpcf_strfold) { return 0; }
+      if (!mpc_dfa_build(b, p->data.repeat.x, info)) { return 0; }
+      if (info->nullable) { return 0; }
+      mpc_dfa_follow(b, &info->last, &info->first);
+      info->nullable = p->type == MPC_TYPE_MANY;
+      return 1;
+
+    /* A failed `count` does not give back what it consumed */
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_strfold || p->data.repeat.n > 1) { return 0; }
+      if (p->data.repeat.n == 0) { info->nullable = 1; return 1; }
+      return mpc_dfa_build(b, p->data.repeat.x, info);
+
+    /* Choice and Sequence */
+
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_dfa_build(b, p->data.or.xs[j], &x)) { return 0; }
+        if (x.nullable && j < p->data.or.n-1) { return 0; }
+        mpc_dfa_set_union(&info->first, &x.first);
+        mpc_dfa_set_union(&info->last, &x.last);
+        info->nullable = info->nullable || x.nullable;
+      }
+      return 1;
+
+    case MPC_TYPE_AND:
+      if (p->data.and.f != mpcf_strfold) { return 0; }
+      info->nullable = 1;
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_dfa_build(b, p->data.and.xs[j], &x)) { return 0; }
+        mpc_dfa_seq(b, info, &x);
+      }
+      return 1;
+
+    default: return 0;
+  }
+
+  if (b->num == MPC_DFA_POSITIONS_MAX) { return 0; }
+
+  b->num++;
+  memcpy(b->chars[b->num], chars, sizeof(chars));
+  mpc_dfa_set_add(&info->first, b->num);
+  mpc_dfa_set_add(&info->last, b->num);
+  return 1;
+}
+
+static mpc_dfa_t *mpc_dfa_compile(mpc_dfa_builder_t *b, mpc_parser_t *p) {
+
+  int j, k, c, x, n;
+  unsigned char reps[256];
+  mpc_dfa_set_t *from;
+  mpc_dfa_info_t info;
+  mpc_dfa_t *d;
+
+  if (!mpc_dfa_build(b, p, &info)) { return NULL; }
+
+  d = malloc(sizeof(mpc_dfa_t));
+  d->states_num = b->num + 1;
+  d->quiet = b->expects == 0;
+
+  /* Bytes no position accepts share class 0, which has no transitions */
+  d->classes_num = 1;
+  reps[0] = 0;
+  for (c = 0; c < 256; c++) {
+
+    d->classes[c] = 0;
+    for (k = 1; k <= b->num; k++) {
+      if (mpc_dfa_chars_has(b->chars[k], c)) { break; }
+    }
+    if (c == 0 || k > b->num) { continue; }
+
+    for (j = 1; j < d->classes_num; j++) {
+      for (k = 1; k <= b->num; k++) {
+        if (mpc_dfa_chars_has(b->chars[k], c) != mpc_dfa_chars_has(b->chars[k], reps[j])) { break; }
+      }
+      if (k > b->num) { break; }
+    }
+
+    if (j == d->classes_num) { reps[d->classes_num++] = c; }
+    d->classes[c] = j;
+  }
+
+  d->trans = malloc(sizeof(int) * d->states_num * d->classes_num);
+  d->accept = malloc(d->states_num);
+
+  for (x = 0; x < d->states_num; x++) {
+
+    from = x == 0 ? &info.first : &b->follow[x];
+    d->accept[x] = x == 0 ? info.nullable : mpc_dfa_set_has(&info.last, x);
+
+    for (j = 0; j < d->classes_num; j++) {
+      d->trans[x * d->classes_num + j] = -1;
+      if (j == 0) { continue; }
+      for (k = 1, n = 0; k <= b->num; k++) {
+        if (mpc_dfa_set_has(from, k) && mpc_dfa_chars_has(b->chars[k], reps[j])) {
+          d->trans[x * d->classes_num + j] = k;
+          n++;
+        }
+      }
+      /* Not deterministic, the combinators would need to backtrack */
+      if (n > 1) { mpc_dfa_delete(d); return NULL; }
+    }
+  }
+
+  return d;
+}
+
+static mpc_parser_t *mpc_re_dfa(mpc_parser_t *a) {
+
+  mpc_parser_t *p;
+  mpc_dfa_t *d;
+  mpc_dfa_builder_t *b = calloc(1, sizeof(mpc_dfa_builder_t));
+
+  d = mpc_dfa_compile(b, a);
+  free(b);
+
+  if (d == NULL) { return a; }
+
+  p = mpc_undefined();
+  p->type = MPC_TYPE_DFA;
+  p->data.dfa.d = d;
+  p->data.dfa.x = a;
+  return p;
+}
+
 mpc_parser_t *mpc_re(const char *re) {
   return mpc_re_mode(re, MPC_RE_DEFAULT);
 }
@@ -2402,6 +3229,8 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode) {
 
   mpc_optimise(r.output);
 
+  if (mode & MPC_RE_DFA) { r.output = mpc_re_dfa(r.output); }
+
   return r.output;
 
 }
@@ -2792,6 +3621,8 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     printf("->?");
   }
 
+  if (p->type == MPC_TYPE_DFA) { mpc_print_unretained(p->data.dfa.x, 0); }
+
 }
 
 void mpc_print(mpc_parser_t *p) {
@@ -2875,6 +3706,11 @@ void mpc_ast_delete(mpc_ast_t *a) {
 
   if (a == NULL) { return; }
 
+  if (a->arena) {
+    if (a->arena->root == a) { mpc_arena_delete(a->arena); }
+    return;
+  }
+
   for (i = 0; i < a->children_num; i++) {
     mpc_ast_delete(a->children[i]);
   }
@@ -2907,10 +3743,47 @@ mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
 
   a->children_num = 0;
   a->children = NULL;
+  a->arena = NULL;
   return a;
 
 }
 
+static mpc_ast_t *mpc_ast_copy(mpc_ast_t *a) {
+
+  int i;
+  mpc_ast_t *c;
+
+  if (a == NULL) { return NULL; }
+
+  c = mpc_ast_new(a->tag, a->contents);
+  c->state = a->state;
+  c->children_num = a->children_num;
+  c->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+
+  for (i = 0; i < a->children_num; i++) {
+    c->children[i] = mpc_ast_copy(a->children[i]);
+  }
+
+  return c;
+}
+
+static size_t mpc_ast_bytes(mpc_ast_t *a) {
+
+  int i;
+  size_t total;
+
+  if (a == NULL) { return 0; }
+
+  total = sizeof(mpc_ast_t) + strlen(a->tag) + strlen(a->contents) + 2
+    + sizeof(mpc_ast_t*) * a->children_num;
+
+  for (i = 0; i < a->children_num; i++) {
+    total += mpc_ast_bytes(a->children[i]);
+  }
+
+  return total;
+}
+
 mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
 
   mpc_ast_t *a = mpc_ast_new(tag, "");
@@ -2937,7 +3810,13 @@ mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
   if (a->children_num == 0) { return a; }
   if (a->children_num == 1) { return a; }
 
-  r = mpc_ast_new(">", "");
+  if (a->arena) {
+    r = mpc_arena_ast_new(a->arena, ">", "");
+    if (a->arena->root == a) { a->arena->root = r; }
+  } else {
+    r = mpc_ast_new(">", "");
+  }
+
   mpc_ast_add_child(r, a);
   return r;
 }
@@ -2958,6 +3837,21 @@ int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
 }
 
 mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+
+  mpc_ast_t **children;
+
+  if (r->arena) {
+    if (a && a->arena != r->arena) { mpc_arena_foreign(r->arena, a); }
+    /* Full when the count is zero or a power of two, see `mpc_arena_children` */
+    if ((r->children_num & (r->children_num - 1)) == 0) {
+      children = mpc_arena_children(r->arena, r->children_num + 1);
+      if (r->children_num) { memcpy(children, r->children, sizeof(mpc_ast_t*) * r->children_num); }
+      r->children = children;
+    }
+    r->children[r->children_num++] = a;
+    return r;
+  }
+
   r->children_num++;
   r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
   r->children[r->children_num-1] = a;
@@ -2966,6 +3860,10 @@ mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
 
 mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  if (a->arena) {
+    a->tag = mpc_arena_intern_cat(a->arena, t, strlen(t), "|", a->tag);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
   memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, strlen(t));
@@ -2975,6 +3873,10 @@ mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
 
 mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
   if (a == NULL) { return a; }
+  if (a->arena) {
+    a->tag = mpc_arena_intern_cat(a->arena, t, strlen(t)-1, "", a->tag);
+    return a;
+  }
   a->tag = realloc(a->tag, (strlen(t)-1) + strlen(a->tag) + 1);
   memmove(a->tag + (strlen(t)-1), a->tag, strlen(a->tag)+1);
   memmove(a->tag, t, (strlen(t)-1));
@@ -2982,6 +3884,10 @@ mpc_ast_t *mpc_ast_add_root_tag(mpc_ast_t *a, const char *t) {
 }
 
 mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  if (a->arena) {
+    a->tag = mpc_arena_intern(a->arena, t);
+    return a;
+  }
   a->tag = realloc(a->tag, strlen(t) + 1);
   strcpy(a->tag, t);
   return a;
@@ -3427,6 +4333,7 @@ static mpc_val_t *mpcaf_fold_regex(int n, mpc_val_t **xs) {
   (void)n;
   if (strchr(m, 'm')) { mode |= MPC_RE_MULTILINE; }
   if (strchr(m, 's')) { mode |= MPC_RE_DOTALL; }
+  if (strchr(m, 'd') || (st->flags & MPCA_LANG_DFA)) { mode |= MPC_RE_DFA; }
   y = mpcf_unescape_regex(y);
   p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re_mode(y, mode) : mpc_tok(mpc_re_mode(y, mode));
   free(y);
@@ -3544,7 +4451,7 @@ mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
   mpc_define(Base, mpc_or(5,
     mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
     mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("msd")), mpc_lift_val(st), free, free)),
     mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
     mpc_tok_parens(Grammar, mpc_soft_delete)
   ));
@@ -3649,6 +4556,7 @@ static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
     if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
     mpc_optimise(stmt->grammar);
     mpc_define(left, stmt->grammar);
+    if (st->flags & MPCA_LANG_MEMOIZE) { left->memo = 1; }
     free(stmt->ident);
     free(stmt->name);
     free(stmt);
@@ -3706,7 +4614,7 @@ static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
   mpc_define(Base, mpc_or(5,
     mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
     mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("ms")), mpc_lift_val(st), free, free)),
+    mpc_tok(mpc_and(3, mpcaf_fold_regex, mpc_regex_lit(), mpc_many(mpcf_strfold, mpc_oneof("msd")), mpc_lift_val(st), free, free)),
     mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
     mpc_tok_parens(Grammar, mpc_soft_delete)
   ));
@@ -3844,6 +4752,7 @@ static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
 
   if (p->type == MPC_TYPE_CHECK)    { return 1 + mpc_nodecount_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { return 1 + mpc_nodecount_unretained(p->data.check_with.x, 0); }
+  if (p->type == MPC_TYPE_DFA)      { return 1 + mpc_nodecount_unretained(p->data.dfa.x, 0); }
 
   if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
@@ -3892,6 +4801,7 @@ static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   if (p->type == MPC_TYPE_APPLY_TO)   { mpc_optimise_unretained(p->data.apply_to.x, 0); }
   if (p->type == MPC_TYPE_CHECK)      { mpc_optimise_unretained(p->data.check.x, 0); }
   if (p->type == MPC_TYPE_CHECK_WITH) { mpc_optimise_unretained(p->data.check_with.x, 0); }
+  if (p->type == MPC_TYPE_DFA)        { mpc_optimise_unretained(p->data.dfa.x, 0); }
   if (p->type == MPC_TYPE_PREDICT)    { mpc_optimise_unretained(p->data.predict.x, 0); }
   if (p->type == MPC_TYPE_NOT)        { mpc_optimise_unretained(p->data.not.x, 0); }
   if (p->type == MPC_TYPE_MAYBE)      { mpc_optimise_unretained(p->data.not.x, 0); }
@@ -71,6 +71,19 @@ int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r);
 
+/*
+** Memoization
+**
+** Upper bound in bytes on the memo table a single
+** parse may build (see `MPCA_LANG_MEMOIZE`).
+*/
+
+enum {
+  MPC_MEMO_LIMIT_DEFAULT = 16 * 1024 * 1024
+};
+
+void mpc_memo_limit(size_t bytes);
+
 /*
 ** Function Types
 */
@@ -269,8 +282,10 @@ enum {
   MPC_RE_DEFAULT   = 0,
   MPC_RE_M         = 1,
   MPC_RE_S         = 2,
+  MPC_RE_D         = 4,
   MPC_RE_MULTILINE = 1,
-  MPC_RE_DOTALL    = 2
+  MPC_RE_DOTALL    = 2,
+  MPC_RE_DFA       = 4
 };
 
 mpc_parser_t *mpc_re(const char *re);
@@ -278,6 +293,11 @@ mpc_parser_t *mpc_re_mode(const char *re, int mode);
   
 /*
 ** AST
+**
+** Trees returned by a parse are allocated from a single
+** arena. Deleting the root frees the whole tree, while
+** deleting any other node of it does nothing. Nodes made
+** with `mpc_ast_new` are allocated on their own as before.
 */
 
 typedef struct mpc_ast_t {
@@ -286,6 +306,7 @@ typedef struct mpc_ast_t {
   mpc_state_t state;
   int children_num;
   struct mpc_ast_t** children;
+  struct mpc_arena_t *arena;
 } mpc_ast_t;
 
 mpc_ast_t *mpc_ast_new(const char *tag, const char *contents);
@@ -353,7 +374,9 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_MEMOIZE              = 4,
+  MPCA_LANG_DFA                  = 8
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
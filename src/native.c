@@ -0,0 +1,178 @@
+/*
+ * NATIVE
+ * Native modules
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "context.h"
+#include "native.h"
+
+// the names registered by the module being loaded on this thread
+static __thread lval* lnative_loading = NULL;
+// every function a module has registered, see lnative_is_builtin()
+static pthread_mutex_t lnative_lock = PTHREAD_MUTEX_INITIALIZER;
+static lbuiltin* lnative_funcs = NULL;
+static int       lnative_num_funcs = 0;
+
+static void  lnative_add_builtin(lenv* env, const char* name, lbuiltin func);
+static lval* lnative_get(lenv* env, const char* name);
+static lbuiltin lnative_get_builtin(const lval* v);
+
+static const lnative_api lnative_api_table = {
+    .version     = LNATIVE_API_VERSION,
+    .size        = sizeof(lnative_api),
+    .add_builtin = lnative_add_builtin,
+    .num         = lval_num,
+    .decimal     = lval_decimal,
+    .err         = lval_err,
+    .sym         = lval_sym,
+    .sexpr       = lval_sexpr,
+    .qexpr       = lval_qexpr,
+    .add         = lval_add,
+    .copy        = lval_copy,
+    .del         = lval_del,
+    .type        = lispy_value_type,
+    .get_num     = lispy_value_num,
+    .get_decimal = lispy_value_decimal,
+    .get_text    = lispy_value_text,
+    .count       = lispy_value_count,
+    .item        = lispy_value_item,
+    .get         = lnative_get,
+    .call        = lval_call,
+    .get_builtin = lnative_get_builtin
+};
+
+
+/*
+ * lnative_add_builtin()
+ * Builtins are global, wherever load-native was called from
+ */
+static void lnative_add_builtin(lenv* env, const char* name, lbuiltin func)
+{
+    if(!lnative_is_builtin(func))
+    {
+        pthread_mutex_lock(&lnative_lock);
+        lnative_funcs = realloc(lnative_funcs, sizeof(lbuiltin) * (lnative_num_funcs + 1));
+        lnative_funcs[lnative_num_funcs++] = func;
+        pthread_mutex_unlock(&lnative_lock);
+    }
+
+    lval* sym = lval_sym((char*) name);
+    lval* function = lval_func(func);
+    lenv_def(env, sym, function);
+    lval_del(function);
+    lenv_rebound(env);
+
+    if(lnative_loading != NULL)
+        lval_add(lnative_loading, sym);
+    else
+        lval_del(sym);
+}
+
+/*
+ * lnative_get()
+ */
+static lval* lnative_get(lenv* env, const char* name)
+{
+    lval* sym = lval_sym((char*) name);
+    lval* v = lenv_get(env, sym);
+    lval_del(sym);
+
+    return v;
+}
+
+/*
+ * lnative_get_builtin()
+ */
+static lbuiltin lnative_get_builtin(const lval* v)
+{
+    return (v->type == LVAL_FUNC) ? v->builtin : NULL;
+}
+
+/*
+ * lnative_is_builtin()
+ */
+int lnative_is_builtin(lbuiltin func)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&lnative_lock);
+    for(int i = 0; i < lnative_num_funcs && !found; ++i)
+        found = (lnative_funcs[i] == func);
+    pthread_mutex_unlock(&lnative_lock);
+
+    return found;
+}
+
+/*
+ * lnative_load()
+ * Modules stay loaded, since their builtins may be bound anywhere.
+ */
+lval* lnative_load(lenv* env, const char* path)
+{
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if(handle == NULL)
+        return lval_err("[%s] failed to load [%s]: %s", __func__, path, dlerror());
+
+    lnative_init init;
+    *(void**) (&init) = dlsym(handle, LNATIVE_ENTRY);
+    if(init == NULL)
+    {
+        dlclose(handle);
+        return lval_err("[%s] [%s] has no %s()", __func__, path, LNATIVE_ENTRY);
+    }
+
+    lval* prev = lnative_loading;
+    lval* names = lval_qexpr();
+    lnative_loading = names;
+    int status = init(env, &lnative_api_table);
+    lnative_loading = prev;
+
+    if(status != 0)
+    {
+        lval_del(names);
+        return lval_err("[%s] %s() of [%s] failed with %d", __func__, LNATIVE_ENTRY, path, status);
+    }
+
+    return names;
+}
+
+/*
+ * builtin_load_native()
+ * (load-native {lib/libfoo}) -> {names...}, the builtins that
+ * lib/libfoo.so registered. The grammar has no strings, so the path
+ * is a symbol and ".so" is added unless the file name has a dot in
+ * it. A string (see builtin_str()) is taken as it is.
+ */
+lval* builtin_load_native(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("load-native", val, 1);
+
+    lval* arg = val->cell[0];
+    const char* name = NULL;
+    if(arg->type == LVAL_STR)
+        name = arg->str;
+    else if(arg->type == LVAL_QEXPR && arg->count == 1 && arg->cell[0]->type == LVAL_SYM)
+        name = arg->cell[0]->sym;
+    LVAL_ASSERT(val, name != NULL,
+            "[%s] Function 'load-native': expected {path} or a string, got %s",
+            __func__, lval_type_str(arg->type));
+
+    const char* base = strrchr(name, '/');
+    int has_ext = strchr((base != NULL) ? base : name, '.') != NULL;
+    size_t len = strlen(name) + 4;
+    char* path = malloc(len);
+    snprintf(path, len, "%s%s", name, (arg->type == LVAL_STR || has_ext) ? "" : ".so");
+
+    lval* result = lnative_load(env, path);
+    free(path);
+    lval_del(val);
+
+    return result;
+}
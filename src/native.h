@@ -0,0 +1,82 @@
+/*
+ * NATIVE
+ * Builtins written in C and loaded at run time. A native module is a
+ * shared object that exports
+ *
+ *   int lispy_native_init(lenv* env, const lnative_api* api);
+ *
+ * which load-native calls once the module is loaded. It registers its
+ * builtins with api->add_builtin() and returns 0, or anything else to
+ * fail the load. Modules reach the interpreter only through the
+ * table, so they link against nothing and work the same in the repl
+ * and in programs embedding liblispy.
+ *
+ * A module should check that api->version is the LNATIVE_API_VERSION
+ * it was built with, or at least that api->size covers every member
+ * it uses. Members are only ever added at the end of the table.
+ */
+
+#ifndef __BYOL_NATIVE_H
+#define __BYOL_NATIVE_H
+
+#include <stddef.h>
+#include "lispy.h"
+
+#define LNATIVE_API_VERSION     1
+#define LNATIVE_ENTRY           "lispy_native_init"
+
+typedef struct lnative_api
+{
+    int         version;    // LNATIVE_API_VERSION
+    size_t      size;       // sizeof(lnative_api)
+
+    // bind name to func in env, see lispy_add_builtin()
+    void        (*add_builtin)(lenv* env, const char* name, lbuiltin func);
+
+    // making values
+    lval*       (*num)(long x);
+    lval*       (*decimal)(double x);
+    lval*       (*err)(char* fmt, ...);
+    lval*       (*sym)(char* s);
+    lval*       (*sexpr)(void);
+    lval*       (*qexpr)(void);
+    // append x to the S- or Q-Expression v, which takes x over
+    lval*       (*add)(lval* v, lval* x);
+    lval*       (*copy)(lval* v);
+    void        (*del)(lval* v);
+
+    // inspecting values, see lispy_value_type() and the rest
+    lval_type   (*type)(const lval* v);
+    long        (*get_num)(const lval* v);
+    double      (*get_decimal)(const lval* v);
+    const char* (*get_text)(const lval* v);
+    int         (*count)(const lval* v);
+    lval*       (*item)(const lval* v, int i);
+
+    // a copy of the value bound to name, as seen from env, or an error
+    lval*       (*get)(lenv* env, const char* name);
+    // call the function f with the arguments in args, an S-Expression
+    // that is taken over. f is not, but calling a lambda binds its
+    // formals, so pass a copy of any lambda that is kept.
+    lval*       (*call)(lenv* env, lval* f, lval* args);
+    // the C function of a builtin, or NULL for anything else
+    lbuiltin    (*get_builtin)(const lval* v);
+} lnative_api;
+
+typedef int (*lnative_init)(lenv* env, const lnative_api* api);
+
+/*
+ * lnative_load()
+ * Load the module at path and let it register its builtins in env.
+ * Returns a Q-Expression of the names it registered, or an error.
+ */
+lval* lnative_load(lenv* env, const char* path);
+/*
+ * lnative_is_builtin()
+ * func was registered by a module. Such builtins only exist once
+ * their module is loaded, so they cannot be saved in a snapshot.
+ */
+int   lnative_is_builtin(lbuiltin func);
+
+
+#endif /*__BYOL_NATIVE_H*/
@@ -0,0 +1,400 @@
+/*
+ * PARALLEL
+ * Worker pool and the parallel list builtins
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "context.h"
+#include "parallel.h"
+
+// Chunks per thread. More chunks balance uneven work better, fewer
+// chunks mean less contention on the shared counter.
+#define LPOOL_CHUNKS_PER_THREAD 4
+
+typedef enum
+{
+    LPOOL_MAP,          // results[i] = f(list[i])
+    LPOOL_REDUCE        // results[c] = f(...f(f(list[s]), list[s+1])...) over chunk c
+} lpool_kind;
+
+/*
+ * JOB
+ * One call to a parallel builtin. Threads claim chunks of the list
+ * through next until it runs off the end.
+ */
+typedef struct lpool_job
+{
+    lpool_kind  kind;
+    lenv*       env;        // env the builtin was called in
+    lval*       func;       // read only, every call works on a copy
+    lval*       list;       // read only
+    lval**      results;
+    int         chunk;
+    int         next;
+} lpool_job;
+
+// depth of parallel builtins running on this thread
+static __thread int lpool_depth = 0;
+
+
+/*
+ * lpool_apply()
+ * Call func on args through lval_call(), the same way as
+ * lval_eval_sexpr() does. Each call gets a scratch env under the
+ * caller's env so that anything it puts there stays private.
+ */
+static lval* lpool_apply(lpool_job* job, lval* args)
+{
+    lenv* scratch = lenv_new();
+    lval* f = lval_copy(job->func);
+
+    scratch->parent = job->env;
+    lval* result = lval_call(scratch, f, args);
+    lval_del(f);
+    lenv_del(scratch);
+
+    return result;
+}
+
+/*
+ * lpool_job_work()
+ * Run chunks of job until there are none left
+ */
+static void lpool_job_work(lpool_job* job)
+{
+    int count = job->list->count;
+    lval** cell = job->list->cell;
+
+    lpool_depth++;
+    while(1)
+    {
+        int start = __atomic_fetch_add(&job->next, job->chunk, __ATOMIC_RELAXED);
+        if(start >= count)
+            break;
+        int end = (start + job->chunk < count) ? start + job->chunk : count;
+
+        if(job->kind == LPOOL_MAP)
+        {
+            for(int i = start; i < end; ++i)
+                job->results[i] = lpool_apply(job, lval_add(lval_sexpr(), lval_copy(cell[i])));
+        }
+        else
+        {
+            lval* acc = lval_copy(cell[start]);
+            for(int i = start + 1; i < end && acc->type != LVAL_ERR; ++i)
+            {
+                lval* args = lval_add(lval_sexpr(), acc);
+                acc = lpool_apply(job, lval_add(args, lval_copy(cell[i])));
+            }
+            job->results[start / job->chunk] = acc;
+        }
+    }
+    lpool_depth--;
+}
+
+/*
+ * lpool_worker()
+ */
+static void* lpool_worker(void* arg)
+{
+    lpool* pool = arg;
+    long seen = 0;
+    int id;
+
+    pthread_mutex_lock(&pool->lock);
+    for(id = 0; !pthread_equal(pool->workers[id], pthread_self()); ++id)
+        ;
+    lheap_set_current(&pool->heaps[id]);
+
+    while(1)
+    {
+        while(!pool->shutdown && (pool->job == NULL || pool->generation == seen))
+            pthread_cond_wait(&pool->posted, &pool->lock);
+        if(pool->shutdown)
+            break;
+
+        lpool_job* job = pool->job;
+        seen = pool->generation;
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+
+        lpool_job_work(job);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->active == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/*
+ * lpool_new()
+ */
+lpool* lpool_new(int num_threads, lheap* owner)
+{
+    lpool* pool = malloc(sizeof(*pool));
+    if(!pool)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for pool\n", __func__, sizeof(*pool));
+        return NULL;
+    }
+
+    pool->num_workers = (num_threads > 1) ? num_threads - 1 : 0;
+    pool->workers     = malloc(sizeof(pthread_t) * (pool->num_workers + 1));
+    pool->heaps       = malloc(sizeof(lheap) * (pool->num_workers + 1));
+    pool->job         = NULL;
+    pool->generation  = 0;
+    pool->active      = 0;
+    pool->shutdown    = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->posted, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    // workers find their heap by thread id, so hold the lock until
+    // every id is written
+    pthread_mutex_lock(&pool->lock);
+    for(int i = 0; i < pool->num_workers; ++i)
+    {
+        lheap_init(&pool->heaps[i], owner);
+        if(pthread_create(&pool->workers[i], NULL, lpool_worker, pool) != 0)
+        {
+            fprintf(stderr, "[%s] failed to start worker %d\n", __func__, i);
+            lheap_destroy(&pool->heaps[i]);
+            pool->num_workers = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return pool;
+}
+
+/*
+ * lpool_del()
+ */
+void lpool_del(lpool* pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->posted);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(int i = 0; i < pool->num_workers; ++i)
+    {
+        pthread_join(pool->workers[i], NULL);
+        lheap_destroy(&pool->heaps[i]);
+    }
+
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->posted);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->heaps);
+    free(pool);
+}
+
+/*
+ * lpool_default_size()
+ */
+int lpool_default_size(void)
+{
+    const char* env = getenv("LISPY_THREADS");
+    if(env != NULL && atoi(env) > 0)
+        return atoi(env);
+
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int) n : 1;
+}
+
+/*
+ * lpool_active()
+ */
+int lpool_active(void)
+{
+    return lpool_depth > 0;
+}
+
+/*
+ * lpool_run()
+ * Run job to completion. The job is posted to the pool of the
+ * current context and the caller works on it alongside the
+ * workers. Nested parallel builtins, and threads with no context,
+ * run the job alone.
+ */
+static void lpool_run(lpool_job* job)
+{
+    lispy_ctx* ctx = lispy_ctx_current();
+    lpool* pool = (ctx != NULL && lpool_depth == 0) ? lispy_ctx_pool(ctx) : NULL;
+    int threads = (pool != NULL) ? pool->num_workers + 1 : 1;
+
+    job->next  = 0;
+    job->chunk = job->list->count / (threads * LPOOL_CHUNKS_PER_THREAD);
+    if(job->chunk < 1)
+        job->chunk = 1;
+
+    if(threads == 1)
+    {
+        lpool_job_work(job);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job = job;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->posted);
+    pthread_mutex_unlock(&pool->lock);
+
+    lpool_job_work(job);
+
+    // every chunk is claimed, wait for the workers still running one
+    pthread_mutex_lock(&pool->lock);
+    pool->job = NULL;
+    while(pool->active > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * lpool_first_err()
+ * Index of the first error in results, or -1
+ */
+static int lpool_first_err(lval** results, int count)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        if(results[i]->type == LVAL_ERR)
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * lpool_take()
+ * Delete all but results[idx] and return it
+ */
+static lval* lpool_take(lval** results, int count, int idx)
+{
+    lval* x = results[idx];
+    for(int i = 0; i < count; ++i)
+    {
+        if(i != idx)
+            lval_del(results[i]);
+    }
+    free(results);
+
+    return x;
+}
+
+
+// ======== BUILTINS ======== //
+
+/*
+ * builtin_pmap()
+ * (pmap f {a b c}) -> {(f a) (f b) (f c)}
+ */
+lval* builtin_pmap(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("pmap", val, 2);
+    LVAL_ASSERT_TYPE("pmap", val, 0, LVAL_FUNC);
+    LVAL_ASSERT_TYPE("pmap", val, 1, LVAL_QEXPR);
+
+    lpool_job job;
+    int count = val->cell[1]->count;
+
+    job.kind    = LPOOL_MAP;
+    job.env     = env;
+    job.func    = val->cell[0];
+    job.list    = val->cell[1];
+    job.results = malloc(sizeof(lval*) * (count + 1));
+    lpool_run(&job);
+    lval_del(val);
+
+    int err = lpool_first_err(job.results, count);
+    if(err >= 0)
+        return lpool_take(job.results, count, err);
+
+    // results are in list order, hand the array over as the cells
+    lval* out = lval_qexpr();
+    out->count = count;
+    out->cell  = job.results;
+    if(count > 0)
+        lmem_count(LMEM_CELL, 1, 1, sizeof(lval*) * count);
+
+    return out;
+}
+
+/*
+ * builtin_pforeach()
+ * (pfor-each f {a b c}) -> () after calling f on every element
+ */
+lval* builtin_pforeach(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("pfor-each", val, 2);
+    LVAL_ASSERT_TYPE("pfor-each", val, 0, LVAL_FUNC);
+    LVAL_ASSERT_TYPE("pfor-each", val, 1, LVAL_QEXPR);
+
+    lval* out = builtin_pmap(env, val);
+    if(out->type == LVAL_ERR)
+        return out;
+    lval_del(out);
+
+    return lval_sexpr();
+}
+
+/*
+ * builtin_preduce()
+ * (preduce f init {a b c}) -> (f (f (f init a) b) c)
+ * Chunks are reduced in parallel and then combined in order, so f
+ * must be associative for the result to match a serial fold.
+ */
+lval* builtin_preduce(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("preduce", val, 3);
+    LVAL_ASSERT_TYPE("preduce", val, 0, LVAL_FUNC);
+    LVAL_ASSERT_TYPE("preduce", val, 2, LVAL_QEXPR);
+
+    lpool_job job;
+    int count = val->cell[2]->count;
+    lval* acc = lval_pop(val, 1);
+
+    job.kind    = LPOOL_REDUCE;
+    job.env     = env;
+    job.func    = val->cell[0];
+    job.list    = val->cell[1];
+    job.results = malloc(sizeof(lval*) * (count + 1));
+    lpool_run(&job);
+
+    int chunks = (count + job.chunk - 1) / job.chunk;
+    int err = lpool_first_err(job.results, chunks);
+    if(err >= 0)
+    {
+        lval_del(acc);
+        lval_del(val);
+        return lpool_take(job.results, chunks, err);
+    }
+
+    // fold the chunk results into init, in order
+    for(int i = 0; i < chunks; ++i)
+    {
+        if(acc->type == LVAL_ERR)
+        {
+            lval_del(job.results[i]);
+            continue;
+        }
+        lpool_depth++;
+        acc = lpool_apply(&job, lval_add(lval_add(lval_sexpr(), acc), job.results[i]));
+        lpool_depth--;
+    }
+    free(job.results);
+    lval_del(val);
+
+    return acc;
+}
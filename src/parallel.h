@@ -0,0 +1,55 @@
+/*
+ * PARALLEL
+ * A fixed pool of worker threads for the parallel list builtins
+ * (pmap, pfor-each, preduce).
+ */
+
+#ifndef __BYOL_PARALLEL_H
+#define __BYOL_PARALLEL_H
+
+#include <pthread.h>
+#include "lval.h"
+
+struct lpool_job;
+
+/*
+ * POOL
+ * Each interpreter context starts its pool the first time it is
+ * needed (see lispy_ctx_pool()). The thread that runs a job works
+ * on it too, so a pool of n threads has n-1 workers.
+ */
+typedef struct lpool
+{
+    int               num_workers;
+    pthread_t*        workers;
+    lheap*            heaps;        // one per worker
+    pthread_mutex_t   lock;
+    pthread_cond_t    posted;       // a job was posted, or shutdown
+    pthread_cond_t    idle;         // a worker let go of the job
+    struct lpool_job* job;
+    long              generation;   // bumped on every job
+    int               active;       // workers holding the job
+    int               shutdown;
+} lpool;
+
+/*
+ * lpool_new()
+ * Start a pool of num_threads threads (including the caller).
+ * Worker heaps share the symbol table of owner.
+ */
+lpool* lpool_new(int num_threads, lheap* owner);
+void   lpool_del(lpool* pool);
+/*
+ * lpool_default_size()
+ * $LISPY_THREADS if set, otherwise the number of online cores
+ */
+int    lpool_default_size(void);
+/*
+ * lpool_active()
+ * Non-zero while the calling thread is running part of a parallel
+ * builtin. The global environment is read only during that time.
+ */
+int    lpool_active(void);
+
+
+#endif /*__BYOL_PARALLEL_H*/
@@ -0,0 +1,422 @@
+/*
+ * PROF
+ * Sampling profiler
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "prof.h"
+
+/*
+ * SAMPLES
+ * Sampled stacks by hash, open addressing. The frames of a stack are
+ * the names at frames[first .. first + depth), outermost first.
+ */
+typedef struct
+{
+    uint64_t    hash;
+    int         first;
+    int         depth;
+    long        count;          // 0 if the slot is free
+} lprof_entry;
+
+/*
+ * NAMES
+ * Copies of the names seen by the handler, by the address they were
+ * pushed with. An address can be reused for another name once the
+ * heap it came from is gone, so a hit is checked against the text.
+ */
+typedef struct
+{
+    const char* ptr;
+    const char* copy;
+} lprof_name_entry;
+
+typedef struct
+{
+    lprof_entry*        stacks;
+    int                 num_stacks;
+    const char**        frames;
+    int                 num_frames;
+    lprof_name_entry*   names;
+    int                 num_names;
+    char*               name_bytes;
+    size_t              name_len;
+    long                samples;
+    long                dropped;
+    char                busy;       // the tables are in use
+} lprof_state;
+
+int lprof_on = 0;
+
+static lprof_state lprof;
+static __thread lprof_stack  lprof_own;
+static __thread lprof_stack* lprof_here = NULL;
+
+
+static inline lprof_stack* lprof_current(void)
+{
+    return (lprof_here != NULL) ? lprof_here : &lprof_own;
+}
+
+/*
+ * lprof_push()
+ */
+int lprof_push(const char* name)
+{
+    lprof_stack* s = lprof_current();
+    int depth = s->depth;
+
+    s->frames[depth & (LPROF_MAX_DEPTH - 1)] = name;
+    // the handler runs on this thread, it only has to see the frame
+    // before the depth that covers it
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    s->depth = depth + 1;
+
+    return depth;
+}
+
+/*
+ * lprof_pop()
+ */
+void lprof_pop(int depth)
+{
+    lprof_current()->depth = depth;
+}
+
+/*
+ * lprof_switch()
+ */
+lprof_stack* lprof_switch(lprof_stack* stack)
+{
+    lprof_stack* prev = lprof_here;
+    lprof_here = stack;
+
+    return prev;
+}
+
+// ======== SIGNAL HANDLER ======== //
+
+/*
+ * lprof_name()
+ * The copy of name, made on first sight. Called from the handler.
+ */
+static const char* lprof_name(const char* name)
+{
+    if(name == NULL)
+        name = "?";
+
+    uintptr_t h = ((uintptr_t) name >> 3) * 0x9e3779b97f4a7c15u;
+    for(int i = 0; i < LPROF_NAMES; ++i)
+    {
+        lprof_name_entry* e = &lprof.names[(h + i) & (LPROF_NAMES - 1)];
+        if(e->ptr == NULL)
+        {
+            size_t len = strlen(name) + 1;
+            if(lprof.num_names >= LPROF_NAMES / 2 || lprof.name_len + len > LPROF_NAME_BYTES)
+                return "?";
+            char* copy = lprof.name_bytes + lprof.name_len;
+            memcpy(copy, name, len);
+            lprof.name_len += len;
+            lprof.num_names++;
+            e->ptr  = name;
+            e->copy = copy;
+            return copy;
+        }
+        if(e->ptr == name && strcmp(e->copy, name) == 0)
+            return e->copy;
+    }
+
+    return "?";
+}
+
+/*
+ * lprof_record()
+ * Count one sample of frames. Called from the handler.
+ */
+static void lprof_record(const char** frames, int depth)
+{
+    uint64_t hash = 14695981039346656037u;
+    for(int i = 0; i < depth; ++i)
+        hash = (hash ^ (uintptr_t) frames[i]) * 1099511628211u;
+
+    for(int i = 0; i < LPROF_STACKS; ++i)
+    {
+        lprof_entry* e = &lprof.stacks[(hash + i) & (LPROF_STACKS - 1)];
+        if(e->count == 0)
+        {
+            if(lprof.num_stacks >= LPROF_STACKS / 2 || lprof.num_frames + depth > LPROF_FRAMES)
+                break;
+            memcpy(&lprof.frames[lprof.num_frames], frames, sizeof(char*) * depth);
+            e->hash  = hash;
+            e->first = lprof.num_frames;
+            e->depth = depth;
+            e->count = 1;
+            lprof.num_frames += depth;
+            lprof.num_stacks++;
+            return;
+        }
+        if(e->hash == hash && e->depth == depth &&
+           memcmp(&lprof.frames[e->first], frames, sizeof(char*) * depth) == 0)
+        {
+            e->count++;
+            return;
+        }
+    }
+    __atomic_fetch_add(&lprof.dropped, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * lprof_handler()
+ */
+static void lprof_handler(int sig)
+{
+    int saved = errno;
+
+    if(!__atomic_load_n(&lprof_on, __ATOMIC_RELAXED))
+    {
+        errno = saved;
+        return;
+    }
+    // another thread is taking a sample
+    if(__atomic_test_and_set(&lprof.busy, __ATOMIC_ACQUIRE))
+    {
+        __atomic_fetch_add(&lprof.dropped, 1, __ATOMIC_RELAXED);
+        errno = saved;
+        return;
+    }
+
+    lprof_stack* s = lprof_current();
+    const char* frames[LPROF_MAX_DEPTH + 1];
+    int depth = s->depth;
+    int n = 0;
+
+    if(depth > LPROF_MAX_DEPTH)
+        frames[n++] = lprof_name("...");
+    for(int i = (depth > LPROF_MAX_DEPTH) ? depth - LPROF_MAX_DEPTH : 0; i < depth; ++i)
+        frames[n++] = lprof_name(s->frames[i & (LPROF_MAX_DEPTH - 1)]);
+    // time spent outside of any call
+    if(n == 0)
+        frames[n++] = lprof_name("<toplevel>");
+
+    lprof.samples++;
+    lprof_record(frames, n);
+
+    __atomic_clear(&lprof.busy, __ATOMIC_RELEASE);
+    errno = saved;
+}
+
+// ======== START / STOP ======== //
+
+/*
+ * lprof_start()
+ */
+int lprof_start(void)
+{
+    if(lprof_on)
+        return -1;
+
+    if(lprof.stacks == NULL)
+    {
+        lprof.stacks     = calloc(LPROF_STACKS, sizeof(lprof_entry));
+        lprof.frames     = malloc(sizeof(char*) * LPROF_FRAMES);
+        lprof.names      = calloc(LPROF_NAMES, sizeof(lprof_name_entry));
+        lprof.name_bytes = malloc(LPROF_NAME_BYTES);
+        if(!lprof.stacks || !lprof.frames || !lprof.names || !lprof.name_bytes)
+        {
+            fprintf(stderr, "[%s] failed to allocate the profile\n", __func__);
+            return -1;
+        }
+    }
+    memset(lprof.stacks, 0, sizeof(lprof_entry) * LPROF_STACKS);
+    memset(lprof.names, 0, sizeof(lprof_name_entry) * LPROF_NAMES);
+    lprof.num_stacks = 0;
+    lprof.num_frames = 0;
+    lprof.num_names  = 0;
+    lprof.name_len   = 0;
+    lprof.samples    = 0;
+    lprof.dropped    = 0;
+
+    // stays installed after lprof_stop(), since a sample may still be
+    // pending and SIGPROF would otherwise end the process
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = lprof_handler;
+    action.sa_flags   = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if(sigaction(SIGPROF, &action, NULL) != 0)
+    {
+        fprintf(stderr, "[%s] failed to install the SIGPROF handler\n", __func__);
+        return -1;
+    }
+
+    __atomic_clear(&lprof.busy, __ATOMIC_RELEASE);
+    __atomic_store_n(&lprof_on, 1, __ATOMIC_RELEASE);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec  = 0;
+    timer.it_interval.tv_usec = LPROF_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    if(setitimer(ITIMER_PROF, &timer, NULL) != 0)
+    {
+        fprintf(stderr, "[%s] failed to start the profiling timer\n", __func__);
+        __atomic_store_n(&lprof_on, 0, __ATOMIC_RELEASE);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * lprof_stop()
+ * Leaves the tables marked busy, so that they can be read without a
+ * handler on another thread changing them.
+ */
+void lprof_stop(void)
+{
+    if(!lprof_on)
+        return;
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    __atomic_store_n(&lprof_on, 0, __ATOMIC_RELEASE);
+
+    while(__atomic_test_and_set(&lprof.busy, __ATOMIC_ACQUIRE))
+        sched_yield();
+}
+
+// ======== REPORTS ======== //
+
+/*
+ * lprof_write_folded()
+ */
+int lprof_write_folded(const char* path)
+{
+    FILE* fp = fopen(path, "w");
+    if(!fp)
+    {
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, path);
+        return -1;
+    }
+
+    for(int i = 0; i < LPROF_STACKS && lprof.stacks != NULL; ++i)
+    {
+        lprof_entry* e = &lprof.stacks[i];
+        if(e->count == 0)
+            continue;
+        for(int f = 0; f < e->depth; ++f)
+        {
+            if(f > 0)
+                fputc(';', fp);
+            fputs(lprof.frames[e->first + f], fp);
+        }
+        fprintf(fp, " %ld\n", e->count);
+    }
+
+    return (fclose(fp) == 0) ? 0 : -1;
+}
+
+typedef struct
+{
+    const char* name;
+    long        self;
+    long        total;
+    int         last;       // the last stack that counted towards total
+} lprof_row;
+
+static int lprof_row_cmp(const void* a, const void* b)
+{
+    const lprof_row* x = a;
+    const lprof_row* y = b;
+
+    if(x->self != y->self)
+        return (x->self < y->self) ? 1 : -1;
+    if(x->total != y->total)
+        return (x->total < y->total) ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * lprof_row_find()
+ * The row for name in a table of size slots, by text
+ */
+static lprof_row* lprof_row_find(lprof_row* rows, int size, const char* name)
+{
+    uint64_t h = 14695981039346656037u;
+    for(const char* c = name; *c; ++c)
+        h = (h ^ (unsigned char) *c) * 1099511628211u;
+
+    for(int i = 0; i < size; ++i)
+    {
+        lprof_row* r = &rows[(h + i) & (size - 1)];
+        if(r->name == NULL)
+        {
+            r->name = name;
+            r->last = -1;
+            return r;
+        }
+        if(strcmp(r->name, name) == 0)
+            return r;
+    }
+
+    return NULL;
+}
+
+/*
+ * lprof_fprint_top()
+ */
+void lprof_fprint_top(FILE* fp, int n)
+{
+    if(lprof.stacks == NULL)
+        return;
+
+    // twice as many slots as there can be names
+    int size = 2 * LPROF_NAMES;
+    lprof_row* rows = calloc(size, sizeof(lprof_row));
+
+    for(int i = 0; i < LPROF_STACKS; ++i)
+    {
+        lprof_entry* e = &lprof.stacks[i];
+        if(e->count == 0)
+            continue;
+        for(int f = 0; f < e->depth; ++f)
+        {
+            lprof_row* r = lprof_row_find(rows, size, lprof.frames[e->first + f]);
+            // recursive calls count once towards total
+            if(r->last != i)
+                r->total += e->count;
+            r->last = i;
+            if(f == e->depth - 1)
+                r->self += e->count;
+        }
+    }
+
+    int used = 0;
+    for(int i = 0; i < size; ++i)
+    {
+        if(rows[i].name != NULL)
+            rows[used++] = rows[i];
+    }
+    qsort(rows, used, sizeof(lprof_row), lprof_row_cmp);
+
+    long samples = (lprof.samples > 0) ? lprof.samples : 1;
+    fprintf(fp, "[profile] %ld samples every %d us, %ld dropped\n",
+            lprof.samples, LPROF_INTERVAL_US, lprof.dropped);
+    fprintf(fp, "%8s %8s %8s %8s  %s\n", "self%", "self", "total%", "total", "function");
+    for(int i = 0; i < used && i < n; ++i)
+    {
+        fprintf(fp, "%7.2f%% %8ld %7.2f%% %8ld  %s\n",
+                100.0 * rows[i].self / samples, rows[i].self,
+                100.0 * rows[i].total / samples, rows[i].total, rows[i].name);
+    }
+
+    free(rows);
+}
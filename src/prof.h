@@ -0,0 +1,86 @@
+/*
+ * PROF
+ * Sampling profiler for Lispy code. While it runs, lval_eval_sexpr()
+ * pushes the name of every function it calls (the symbol it was
+ * called by, or the builtin name or "lambda" for a function value)
+ * onto a shadow stack of the calling thread or fiber, and a SIGPROF
+ * timer samples the shadow stack of whichever thread is using the
+ * CPU. The signal handler counts samples by stack in tables made by
+ * lprof_start(), so it never allocates, and copies each name it sees
+ * so that the profile outlives the interpreters that made it.
+ */
+
+#ifndef __BYOL_PROF_H
+#define __BYOL_PROF_H
+
+#include <stdio.h>
+
+// CPU time between samples
+#define LPROF_INTERVAL_US   1000
+// innermost frames kept per stack, a power of two
+#define LPROF_MAX_DEPTH     128
+// distinct stacks, frames of those stacks and bytes of names
+#define LPROF_STACKS        (1 << 14)
+#define LPROF_FRAMES        (1 << 20)
+#define LPROF_NAMES         (1 << 14)
+#define LPROF_NAME_BYTES    (1 << 20)
+// rows in the table printed by lprof_fprint_top()
+#define LPROF_TOP           20
+
+/*
+ * SHADOW STACK
+ * Kept as a ring, so past LPROF_MAX_DEPTH only the innermost frames
+ * are there. Only its own thread writes it, and the signal handler
+ * reads it on that same thread.
+ */
+typedef struct lprof_stack
+{
+    const char*     frames[LPROF_MAX_DEPTH];
+    int             depth;
+} lprof_stack;
+
+// set while the profiler runs
+extern int lprof_on;
+
+/*
+ * lprof_start()
+ * Start sampling. Returns 0, or -1 if it is already running or the
+ * timer cannot be set.
+ */
+int          lprof_start(void);
+/*
+ * lprof_stop()
+ * Stop sampling. The samples are kept until the next lprof_start().
+ */
+void         lprof_stop(void);
+/*
+ * lprof_push()
+ * Push name on the shadow stack of the caller. Returns the depth to
+ * hand to lprof_pop() once the call is done.
+ */
+int          lprof_push(const char* name);
+void         lprof_pop(int depth);
+/*
+ * lprof_switch()
+ * Make stack the shadow stack of the calling thread (NULL for the
+ * thread's own) and return the previous one. Fibers switch to a
+ * stack of their own while they run.
+ */
+lprof_stack* lprof_switch(lprof_stack* stack);
+
+/*
+ * lprof_write_folded()
+ * Write one line per sampled stack, outermost frame first, as
+ * "f;g;h count", which flame graph tools read. Returns 0, or -1 if
+ * the file cannot be written.
+ */
+int          lprof_write_folded(const char* path);
+/*
+ * lprof_fprint_top()
+ * The n functions with the most samples of their own (self), with
+ * the samples of every stack they are on (total).
+ */
+void         lprof_fprint_top(FILE* fp, int n);
+
+
+#endif /*__BYOL_PROF_H*/
@@ -5,16 +5,23 @@
 
 #define _GNU_SOURCE     // for getline. TODO : find an alternative
 
+#include <libgen.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>          // GNU has getline here, but may not work generally
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>         // for getopt
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
 // editline
 #include <editline/readline.h>
 //#include <editline/history.h>
 // MPC library 
+#include "aot.h"
 #include "repl.h"
+#include "snapshot.h"
 
 
 // =============== REPL OPTS 
@@ -33,7 +40,19 @@ ReplOpts* repl_opts_create(void)
     }
 
     // set defaulfs
-    opts->filename = NULL;
+    opts->filenames     = NULL;
+    opts->num_files     = 0;
+    opts->jobs          = 0;
+    opts->out_dir       = NULL;
+    opts->snapshot_in   = NULL;
+    opts->snapshot_out  = NULL;
+    opts->node          = NULL;
+    opts->mem_stats     = 0;
+    opts->profile       = NULL;
+    opts->builtin_stats = 0;
+    opts->trace         = NULL;
+    memset(&opts->budget, 0, sizeof(opts->budget));
+    opts->emit_c        = NULL;
 
     return opts;
 }
@@ -44,7 +63,16 @@ ReplOpts* repl_opts_create(void)
  */
 void repl_opts_destroy(ReplOpts* opts)
 {
-    free(opts->filename);
+    for(int i = 0; i < opts->num_files; ++i)
+        free(opts->filenames[i]);
+    free(opts->filenames);
+    free(opts->out_dir);
+    free(opts->snapshot_in);
+    free(opts->snapshot_out);
+    free(opts->node);
+    free(opts->profile);
+    free(opts->trace);
+    free(opts->emit_c);
     free(opts);
 }
 
@@ -53,206 +81,850 @@ void repl_opts_destroy(ReplOpts* opts)
  */
 void repl_opts_add_filename(ReplOpts* opts, char* filename)
 {
-    if(opts->filename != NULL)
-        opts->filename = realloc(opts->filename, sizeof(char) * strlen(filename) + 1);
-    else
-        opts->filename = malloc(sizeof(char) * strlen(filename) + 1);
+    opts->filenames = realloc(opts->filenames, sizeof(char*) * (opts->num_files + 1));
+    opts->filenames[opts->num_files] = malloc(sizeof(char) * strlen(filename) + 1);
+    strcpy(opts->filenames[opts->num_files], filename);
+    opts->num_files++;
+}
 
-    strcpy(opts->filename, filename);
+/*
+ * repl_opts_set_str()
+ */
+void repl_opts_set_str(char** opt, char* str)
+{
+    free(*opt);
+    *opt = malloc(strlen(str) + 1);
+    strcpy(*opt, str);
 }
 
 
+//char* readline(char* prompt) {
+//    fputs(prompt, stdout);
+//    fgets(buffer, 2048, stdin);
+//    char* cpy = malloc(strlen(buffer)+1);
+//    strcpy(cpy, buffer);
+//    cpy[strlen(cpy)-1] = '\0';
+//
+//    return cpy;
+//}
+
+// =============== SCRIPTS
 /*
- * lval_read_num()
+ * repl_run_file()
+ * A line at a time. Lines that fail to parse count as errors too.
  */
-lval* lval_read_num(mpc_ast_t* ast)
+int repl_run_file(lispy_ctx* ctx, const char* filename, FILE* out)
 {
-    long x;
+    FILE*  fp;
+    size_t len = 0;
+    char*  line = NULL;
+    int    errors = 0;
 
-    errno = 0;
-    x = strtol(ast->contents, NULL, 10);
-    if(errno == ERANGE)
-        return lval_err("Invalid number");
-    else
-        return lval_num(x);
+    fp = fopen(filename, "r");
+    if(!fp)
+    {
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, filename);
+        return -1;
+    }
+
+    while(1)
+    {
+        ssize_t read = getline(&line, &len, fp);
+        if(read == -1)
+            break;
+
+        char* err;
+        lval* expr = lispy_read(ctx, "<stdin>", line, &err);
+        if(expr != NULL)
+        {
+            lval* x = lispy_eval(ctx, expr);
+            // TODO : need to print only the result of eval (or have print function later...)
+            lval_fprintln(out, x);
+            errors += (x->type == LVAL_ERR);
+            lval_del(x);
+        }
+        else
+        {
+            fputs(err, out);
+            free(err);
+            errors++;
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    return errors;
 }
 
+
+// =============== PIPELINE
 /*
- * lval_read_decimal()
+ * A script run by repl_run_pipelined() goes through three threads.
+ * The reader parses forms ahead of the evaluator and the printer
+ * formats results behind it, each into a heap of its own that shares
+ * the symbols of the interpreter, so values can be passed along.
  */
-lval* lval_read_decimal(mpc_ast_t* ast)
+typedef struct
 {
-    char* end;
-    double dec; 
+    lval*   val;        // NULL for a parse error
+    char*   err;
+} ReplItem;
 
-    errno = 0;
-    dec = strtod(ast->contents, &end);
-    if(errno == ERANGE)
-        return lval_err("Invalid number");
-    else
-        return lval_decimal(dec);
+typedef struct
+{
+    ReplItem        items[REPL_QUEUE_SIZE];
+    int             head;
+    int             count;
+    int             closed;
+    pthread_mutex_t lock;
+    pthread_cond_t  not_empty;
+    pthread_cond_t  not_full;
+} ReplQueue;
+
+typedef struct
+{
+    lispy_ctx*  ctx;
+    FILE*       in;
+    FILE*       out;
+    ReplQueue   parsed;
+    ReplQueue   results;
+} ReplPipeline;
+
+static void repl_queue_init(ReplQueue* q)
+{
+    q->head   = 0;
+    q->count  = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+static void repl_queue_destroy(ReplQueue* q)
+{
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+}
+
+/*
+ * repl_queue_put()
+ * Waits while q is full
+ */
+static void repl_queue_put(ReplQueue* q, ReplItem item)
+{
+    pthread_mutex_lock(&q->lock);
+    while(q->count == REPL_QUEUE_SIZE)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % REPL_QUEUE_SIZE] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
 }
 
 /*
- * lval_read()
+ * repl_queue_close()
+ * Nothing more will be put in q
  */
-lval* lval_read(mpc_ast_t* ast)
+static void repl_queue_close(ReplQueue* q)
 {
-    // If input is a symbol or a number then return a conversion to that type
-    if(strstr(ast->tag, "number"))
-        return lval_read_num(ast);
-    //if(strstr(ast->tag, "decimal"))
-    //    return lval_read_decimal(ast);
-    if(strstr(ast->tag, "symbol"))
-        return lval_sym(ast->contents);
-
-    // If this is the root (>) or an S-expr then create an empty list 
-    lval* val = NULL;
-    if(strcmp(ast->tag, ">") == 0)  // TODO :never evaluates true?
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * repl_queue_get()
+ * Returns 1 with the oldest item, 0 once q is closed and empty, or
+ * -1 if q is empty and wait is 0.
+ */
+static int repl_queue_get(ReplQueue* q, ReplItem* item, int wait)
+{
+    int status = 1;
+
+    pthread_mutex_lock(&q->lock);
+    while(q->count == 0 && !q->closed && wait)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if(q->count > 0)
     {
-        val = lval_sexpr();
+        *item = q->items[q->head];
+        q->head = (q->head + 1) % REPL_QUEUE_SIZE;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
     }
-    if(strstr(ast->tag, "sexpr"))
-        val = lval_sexpr();
-    if(strstr(ast->tag, "qexpr"))
-        val = lval_qexpr();
+    else
+        status = q->closed ? 0 : -1;
+    pthread_mutex_unlock(&q->lock);
 
-    // Fill the list with valid expressions in the sexpr
-    for(int i = 0; i < ast->children_num; ++i)
+    return status;
+}
+
+/*
+ * repl_reader()
+ */
+static void* repl_reader(void* arg)
+{
+    ReplPipeline* p = arg;
+    lheap heap;
+    size_t len = 0;
+    char* line = NULL;
+
+    lheap_init(&heap, &p->ctx->heap);
+    lheap_set_current(&heap);
+    while(getline(&line, &len, p->in) != -1)
     {
-        // unpack parens
-        if(strncmp(ast->children[i]->contents, "(", 1) == 0)
-            continue;
-        if(strncmp(ast->children[i]->contents, ")", 1) == 0)
-            continue;
-        if(strncmp(ast->children[i]->contents, "{", 1) == 0)
-            continue;
-        if(strncmp(ast->children[i]->contents, "}", 1) == 0)
-            continue;
-        if(strncmp(ast->children[i]->tag, "regex", 5) == 0)
-            continue;
-        val = lval_add(val, lval_read(ast->children[i]));
+        ReplItem item = {NULL, NULL};
+        item.val = lispy_parse(p->ctx, "<stdin>", line, &item.err);
+        repl_queue_put(&p->parsed, item);
     }
+    repl_queue_close(&p->parsed);
+    free(line);
 
-    return val;
+    lheap_set_current(NULL);
+    lheap_destroy(&heap);
+    return NULL;
 }
 
-//char* readline(char* prompt) {
-//    fputs(prompt, stdout);
-//    fgets(buffer, 2048, stdin);
-//    char* cpy = malloc(strlen(buffer)+1);
-//    strcpy(cpy, buffer);
-//    cpy[strlen(cpy)-1] = '\0';
-//
-//    return cpy;
-//}
-
-int main(int argc, char *argv[])
+/*
+ * repl_printer()
+ * Formats into a buffer, which is written out whenever it fills up
+ * or the printer catches up with the evaluator.
+ */
+static void* repl_printer(void* arg)
 {
-    // Deal with args
-    int opt;
-    extern int optind;  // for checking filename
+    ReplPipeline* p = arg;
+    lheap heap;
+    lbuf buf;
+    ReplItem item;
+    int status;
 
-    ReplOpts* repl_opts = repl_opts_create();
+    lbuf_init(&buf);
 
-    do
+    lheap_init(&heap, &p->ctx->heap);
+    lheap_set_current(&heap);
+    while(1)
     {
-        opt = getopt(argc, argv, "");
-    } while(opt != -1);
+        status = repl_queue_get(&p->results, &item, 0);
+        if(buf.len > 0 && (status <= 0 || buf.len >= REPL_PRINT_BUFFER))
+        {
+            fwrite(buf.data, 1, buf.len, p->out);
+            fflush(p->out);
+            buf.len = 0;
+        }
+        if(status < 0)
+            status = repl_queue_get(&p->results, &item, 1);
+        if(status == 0)
+            break;
 
-    if(optind < argc)
-    {
-        char* filename = argv[optind];
-        // Move to options 
-        repl_opts_add_filename(repl_opts, filename);
+        if(item.val != NULL)
+        {
+            lval_to_buffer(&buf, item.val);
+            lbuf_putc(&buf, '\n');
+            lval_del(item.val);
+        }
+        else
+        {
+            lbuf_puts(&buf, item.err);
+            free(item.err);
+        }
     }
+    lbuf_free(&buf);
+
+    lheap_set_current(NULL);
+    lheap_destroy(&heap);
+    return NULL;
+}
 
-    // Parsers for individual components
-    mpc_parser_t* Number  = mpc_new("number");
-    mpc_parser_t* Decimal = mpc_new("decimal");
-    mpc_parser_t* Symbol  = mpc_new("symbol");
-    mpc_parser_t* Sexpr   = mpc_new("sexpr");
-    mpc_parser_t* Qexpr   = mpc_new("qexpr");
-    mpc_parser_t* Expr    = mpc_new("expr");
-    mpc_parser_t* Lispy   = mpc_new("lispy");
-
-    /* Define them with the following Language */
-    mpca_lang(MPCA_LANG_DEFAULT,
-      "                                                       \
-        number   : /-?[0-9]+/  ;                              \
-        decimal  : /-?([0-9]*[.])?[0-9]+/  ;                  \
-        symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/;          \
-        sexpr    : '(' <expr>* ')';                           \
-        qexpr    : '{' <expr>* '}';                           \
-        expr     : <number> | <symbol> | <sexpr> | <qexpr> ;  \
-        lispy    : /^/ <expr>* /$/ ;                          \
-      ",
-      Number, Decimal, Symbol, Sexpr, Qexpr, Expr, Lispy
-    );
-
-    // get a new lisp environment
-    lenv* env = lenv_new();
-    lenv_init_builtins(env);
-
-    if(repl_opts->filename != NULL)
+/*
+ * repl_run_pipelined()
+ */
+int repl_run_pipelined(lispy_ctx* ctx, const char* filename, FILE* out)
+{
+    ReplPipeline p;
+    pthread_t reader, printer;
+    ReplItem item;
+    int errors = 0;
+
+    p.ctx = ctx;
+    p.out = out;
+    p.in  = fopen(filename, "r");
+    if(!p.in)
     {
-        FILE*  fp;
-        size_t len = 0;
-        char*  line = NULL;
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, filename);
+        return -1;
+    }
+    repl_queue_init(&p.parsed);
+    repl_queue_init(&p.results);
+    pthread_create(&reader, NULL, repl_reader, &p);
+    pthread_create(&printer, NULL, repl_printer, &p);
 
-        fp = fopen(repl_opts->filename, "r");
-        if(!fp)
+    while(repl_queue_get(&p.parsed, &item, 1) > 0)
+    {
+        if(item.val != NULL)
         {
-            fprintf(stderr, "[%s] failed to open file [%s]\n",
-                    __func__, repl_opts->filename);
-            goto CLEANUP;
+            item.val = lispy_eval(ctx, item.val);
+            errors += (item.val->type == LVAL_ERR);
         }
+        else
+            errors++;
+        repl_queue_put(&p.results, item);
+    }
+    repl_queue_close(&p.results);
 
-        while(1)
+    pthread_join(reader, NULL);
+    pthread_join(printer, NULL);
+    repl_queue_destroy(&p.results);
+    repl_queue_destroy(&p.parsed);
+    fclose(p.in);
+
+    return errors;
+}
+
+
+// =============== BATCH
+typedef struct
+{
+    ReplOpts*       opts;
+    ReplJob*        jobs;
+    int             next;           // next job to start
+    char*           snapshot;       // -r, read once for every script
+    size_t          snapshot_len;
+    lmemstats       mem;            // of every script, for --mem-stats
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;           // a job is done
+} ReplBatch;
+
+static double repl_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * repl_read_file()
+ * The whole of filename, or NULL
+ */
+static char* repl_read_file(const char* filename, size_t* len)
+{
+    FILE* fp = fopen(filename, "rb");
+    if(!fp)
+    {
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, filename);
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    char* data = malloc(size > 0 ? size : 1);
+    if(data != NULL && fread(data, 1, size, fp) != (size_t) size)
+    {
+        fprintf(stderr, "[%s] failed to read file [%s]\n", __func__, filename);
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    *len = size;
+
+    return data;
+}
+
+/*
+ * repl_batch_paths()
+ * Name the output file of each job after its script, out_dir/<file>.out.
+ * Two scripts with the same name would write the same file, so that is
+ * an error, as is a path too long to hold.
+ */
+static int repl_batch_paths(ReplBatch* batch)
+{
+    int n = batch->opts->num_files;
+
+    for(int i = 0; i < n; ++i)
+    {
+        ReplJob* job = &batch->jobs[i];
+        char* copy = strdup(job->filename);
+        char path[4096];
+        int len = snprintf(path, sizeof(path), "%s/%s.out", batch->opts->out_dir, basename(copy));
+        free(copy);
+        if(len < 0 || len >= (int) sizeof(path))
         {
-            ssize_t read = getline(&line, &len, fp);
-            if(read == -1)
-                break;
+            fprintf(stderr, "[%s] output path for [%s] is too long\n", __func__, job->filename);
+            return -1;
+        }
 
-            mpc_result_t r;
-            if(mpc_parse("<stdin>", line, Lispy, &r))
+        for(int j = 0; j < i; ++j)
+        {
+            if(strcmp(batch->jobs[j].out_path, path) == 0)
             {
-                lval* x = lval_eval(env, lval_read(r.output));
-                // TODO : need to print only the result of eval (or have print function later...)
-                lval_println(x);
-                lval_del(x);
-                mpc_ast_delete(r.output);
+                fprintf(stderr, "[%s] [%s] and [%s] would both write [%s]\n",
+                        __func__, batch->jobs[j].filename, job->filename, path);
+                return -1;
             }
+        }
+        job->out_path = strdup(path);
+    }
+
+    return 0;
+}
+
+static void repl_batch_free_paths(ReplBatch* batch)
+{
+    for(int i = 0; i < batch->opts->num_files; ++i)
+        free(batch->jobs[i].out_path);
+}
+
+/*
+ * repl_batch_open()
+ * Where the output of job goes: its file in out_dir, or a buffer.
+ */
+static FILE* repl_batch_open(ReplBatch* batch, ReplJob* job)
+{
+    if(batch->opts->out_dir == NULL)
+        return open_memstream(&job->output, &job->len);
+
+    FILE* fp = fopen(job->out_path, "w");
+    if(!fp)
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, job->out_path);
+
+    return fp;
+}
+
+/*
+ * repl_batch_run()
+ * Run job in an interpreter of its own
+ */
+static void repl_batch_run(ReplBatch* batch, ReplJob* job)
+{
+    double start = repl_now();
+    FILE* out = repl_batch_open(batch, job);
+    lispy_ctx* ctx = (out != NULL) ? lispy_ctx_new() : NULL;
+
+    job->errors = -1;
+    if(ctx != NULL)
+    {
+        ctx->budget = batch->opts->budget;
+        lispy_ctx_use(ctx);
+        if(batch->snapshot == NULL ||
+           lenv_snapshot_restore(ctx->env, batch->snapshot, batch->snapshot_len, batch->opts->snapshot_in) == 0)
+        {
+            lactor_bind_self(ctx->env, ctx->mailbox);
+            job->errors = repl_run_file(ctx, job->filename, out);
+        }
+        if(batch->opts->mem_stats)
+        {
+            lmemstats stats;
+            lheap_stats(&ctx->heap, &stats);
+            pthread_mutex_lock(&batch->lock);
+            lmemstats_add(&batch->mem, &stats);
+            pthread_mutex_unlock(&batch->lock);
+        }
+        lispy_ctx_use(NULL);
+        lispy_ctx_del(ctx);
+    }
+    if(out != NULL)
+        fclose(out);
+    job->seconds = repl_now() - start;
+}
+
+/*
+ * repl_batch_worker()
+ */
+static void* repl_batch_worker(void* arg)
+{
+    ReplBatch* batch = arg;
+    int n = batch->opts->num_files;
+
+    while(1)
+    {
+        int i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if(i >= n)
+            break;
+        repl_batch_run(batch, &batch->jobs[i]);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->jobs[i].done = 1;
+        pthread_cond_broadcast(&batch->cond);
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * repl_batch()
+ * Captured output is printed in file order as soon as each file (and
+ * every one before it) is done. A summary goes to stderr.
+ */
+int repl_batch(ReplOpts* opts)
+{
+    ReplBatch batch;
+    int n = opts->num_files;
+    int workers = (opts->jobs < n) ? opts->jobs : n;
+    int failed = 0;
+    double cpu = 0.0;
+    double start = repl_now();
+
+    batch.opts     = opts;
+    batch.next     = 0;
+    batch.snapshot = NULL;
+    batch.jobs     = calloc(n, sizeof(ReplJob));
+    memset(&batch.mem, 0, sizeof(batch.mem));
+    for(int i = 0; i < n; ++i)
+        batch.jobs[i].filename = opts->filenames[i];
+    if(opts->out_dir != NULL && repl_batch_paths(&batch) != 0)
+    {
+        repl_batch_free_paths(&batch);
+        free(batch.jobs);
+        return 1;
+    }
+    if(opts->snapshot_in != NULL)
+    {
+        batch.snapshot = repl_read_file(opts->snapshot_in, &batch.snapshot_len);
+        if(batch.snapshot == NULL)
+        {
+            repl_batch_free_paths(&batch);
+            free(batch.jobs);
+            return 1;
+        }
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.cond, NULL);
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * workers);
+    for(int t = 0; t < workers; ++t)
+        pthread_create(&threads[t], NULL, repl_batch_worker, &batch);
+
+    for(int i = 0; i < n; ++i)
+    {
+        ReplJob* job = &batch.jobs[i];
+
+        pthread_mutex_lock(&batch.lock);
+        while(!job->done)
+            pthread_cond_wait(&batch.cond, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        if(job->output != NULL)
+        {
+            fwrite(job->output, 1, job->len, stdout);
+            fflush(stdout);
+            free(job->output);
+        }
+        if(job->errors != 0)
+        {
+            failed++;
+            if(job->errors < 0)
+                fprintf(stderr, "[batch] %s: could not be run\n", job->filename);
             else
+                fprintf(stderr, "[batch] %s: %d error(s)\n", job->filename, job->errors);
+        }
+        cpu += job->seconds;
+    }
+
+    for(int t = 0; t < workers; ++t)
+        pthread_join(threads[t], NULL);
+    double wall = repl_now() - start;
+
+    fprintf(stderr, "[batch] %d files on %d workers: %d ok, %d failed in %.3f s (%.1f files/s, %.3f s in scripts)\n",
+            n, workers, n - failed, failed, wall, n / wall, cpu);
+    if(opts->mem_stats)
+        lmemstats_fprint(stderr, &batch.mem);
+    if(opts->builtin_stats)
+        lstats_fprint(stderr);
+
+    pthread_cond_destroy(&batch.cond);
+    pthread_mutex_destroy(&batch.lock);
+    free(threads);
+    repl_batch_free_paths(&batch);
+    free(batch.jobs);
+    free(batch.snapshot);
+
+    return (failed == 0) ? 0 : 1;
+}
+
+
+/*
+ * repl_emit_c()
+ * Compile the definitions in filename to filename.c and filename.so,
+ * run filename, and load the module over the lambdas it defined.
+ */
+static int repl_emit_c(lispy_ctx* ctx, const char* filename)
+{
+    size_t len = strlen(filename) + 8;
+    char* c_path = malloc(len);
+    char* so_path = malloc(len);
+    snprintf(c_path, len, "%s.c", filename);
+    // dlopen() only searches for names without a slash
+    snprintf(so_path, len, "%s%s.so", (strchr(filename, '/') != NULL) ? "" : "./", filename);
+
+    int status = -1;
+    int n = laot_compile(ctx, filename, c_path, so_path);
+    if(n >= 0 && repl_run_file(ctx, filename, stdout) >= 0)
+    {
+        status = 0;
+        if(n > 0)
+        {
+            lval* names = laot_load(ctx, so_path);
+            if(names->type == LVAL_ERR)
+                status = -1;
+            fprintf(stderr, "[%s] %s: ", __func__, so_path);
+            lval_fprintln(stderr, names);
+            lval_del(names);
+        }
+    }
+    free(c_path);
+    free(so_path);
+
+    return status;
+}
+
+
+/*
+ * repl_on_signal()
+ * Remove the node socket, then die of the signal as usual
+ */
+static void repl_on_signal(int sig)
+{
+    lactor_stop();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+
+// long options without a short form
+enum
+{
+    REPL_OPT_MEM_STATS = 256,
+    REPL_OPT_PROFILE,
+    REPL_OPT_BUILTIN_STATS,
+    REPL_OPT_TRACE,
+    REPL_OPT_MAX_STEPS,
+    REPL_OPT_MAX_DEPTH,
+    REPL_OPT_MAX_BYTES,
+    REPL_OPT_TIMEOUT,
+    REPL_OPT_EMIT_C
+};
+
+static const struct option repl_long_opts[] = {
+    {"restore",       required_argument, NULL, 'r'},
+    {"save",          required_argument, NULL, 's'},
+    {"node",          required_argument, NULL, 'n'},
+    {"jobs",          required_argument, NULL, 'j'},
+    {"output",        required_argument, NULL, 'o'},
+    {"mem-stats",     no_argument,       NULL, REPL_OPT_MEM_STATS},
+    {"profile",       required_argument, NULL, REPL_OPT_PROFILE},
+    {"builtin-stats", no_argument,       NULL, REPL_OPT_BUILTIN_STATS},
+    {"trace",         required_argument, NULL, REPL_OPT_TRACE},
+    {"max-steps",     required_argument, NULL, REPL_OPT_MAX_STEPS},
+    {"max-depth",     required_argument, NULL, REPL_OPT_MAX_DEPTH},
+    {"max-bytes",     required_argument, NULL, REPL_OPT_MAX_BYTES},
+    {"timeout",       required_argument, NULL, REPL_OPT_TIMEOUT},
+    {"emit-c",        required_argument, NULL, REPL_OPT_EMIT_C},
+    {NULL, 0, NULL, 0}
+};
+
+int main(int argc, char *argv[])
+{
+    // Deal with args
+    int opt;
+    extern int optind;  // for checking filename
+
+    ReplOpts* repl_opts = repl_opts_create();
+
+    // -r <snapshot> : restore the environment from a snapshot
+    // -s <snapshot> : snapshot the environment after running the file
+    // -n <name>     : run as an actor node (after running the file)
+    // -j <jobs>     : run the files in parallel, each on its own
+    // -o <dir>      : with -j, write the output of each file to dir
+    // --mem-stats   : print memory statistics to stderr at exit
+    // --profile <f> : sample the Lispy call stack, write folded stacks to f
+    // --builtin-stats : count and time every call, print the counts at exit
+    // --trace <f>   : record calls, parses and forms, write a Chrome trace to f
+    // --max-steps <n>, --max-depth <n>, --max-bytes <n>, --timeout <ms> :
+    //                 limits on the evaluation of each top-level form
+    // --emit-c <f>  : compile the definitions in f to C, run f, then load
+    //                 the compiled ones in place of the lambdas
+    while((opt = getopt_long(argc, argv, "r:s:n:j:o:", repl_long_opts, NULL)) != -1)
+    {
+        switch(opt)
+        {
+            case 'r':
+                repl_opts_set_str(&repl_opts->snapshot_in, optarg);
+                break;
+            case 's':
+                repl_opts_set_str(&repl_opts->snapshot_out, optarg);
+                break;
+            case 'n':
+                repl_opts_set_str(&repl_opts->node, optarg);
+                break;
+            case 'j':
+                repl_opts->jobs = atoi(optarg);
+                if(repl_opts->jobs > 0)
+                    break;
+                fprintf(stderr, "%s: -j needs a positive number of jobs\n", argv[0]);
+                repl_opts_destroy(repl_opts);
+                return 1;
+            case 'o':
+                repl_opts_set_str(&repl_opts->out_dir, optarg);
+                break;
+            case REPL_OPT_MEM_STATS:
+                repl_opts->mem_stats = 1;
+                break;
+            case REPL_OPT_PROFILE:
+                repl_opts_set_str(&repl_opts->profile, optarg);
+                break;
+            case REPL_OPT_BUILTIN_STATS:
+                repl_opts->builtin_stats = 1;
+                break;
+            case REPL_OPT_TRACE:
+                repl_opts_set_str(&repl_opts->trace, optarg);
+                break;
+            case REPL_OPT_MAX_STEPS:
+            case REPL_OPT_MAX_DEPTH:
+            case REPL_OPT_MAX_BYTES:
+            case REPL_OPT_TIMEOUT:
             {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+                long limit = atol(optarg);
+                if(limit <= 0)
+                {
+                    fprintf(stderr, "%s: budgets need a positive limit\n", argv[0]);
+                    repl_opts_destroy(repl_opts);
+                    return 1;
+                }
+                if(opt == REPL_OPT_MAX_STEPS)
+                    repl_opts->budget.max_steps = limit;
+                else if(opt == REPL_OPT_MAX_DEPTH)
+                    repl_opts->budget.max_depth = limit;
+                else if(opt == REPL_OPT_MAX_BYTES)
+                    repl_opts->budget.max_bytes = limit;
+                else
+                    repl_opts->budget.timeout_ms = limit;
+                break;
             }
+            case REPL_OPT_EMIT_C:
+                repl_opts_set_str(&repl_opts->emit_c, optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r snapshot] [-s snapshot] [-n node] [--mem-stats] [--builtin-stats] [--profile out.folded] [--trace trace.json] [--max-steps n] [--max-depth n] [--max-bytes n] [--timeout ms] [--emit-c lib.l] [filename]\n", argv[0]);
+                fprintf(stderr, "       %s [-r snapshot] [-j jobs] [-o dir] [--mem-stats] [--builtin-stats] [--trace trace.json] [--max-steps n] [--max-depth n] [--max-bytes n] [--timeout ms] filename...\n", argv[0]);
+                repl_opts_destroy(repl_opts);
+                return 1;
         }
     }
-    else
+
+    // Move to options 
+    for(int i = optind; i < argc; ++i)
+        repl_opts_add_filename(repl_opts, argv[i]);
+
+    if(repl_opts->builtin_stats)
+        lstats_on = 1;
+    if(repl_opts->trace != NULL)
+        ltrace_start();
+    // remote sends and spawns listen too, so any run may leave a socket
+    atexit(lactor_stop);
+
+    // more than one file is a batch, on one worker per core unless
+    // -j says otherwise
+    if(repl_opts->num_files > 1 && repl_opts->jobs == 0)
+        repl_opts->jobs = lpool_default_size();
+    if(repl_opts->jobs > 0 || repl_opts->out_dir != NULL)
+    {
+        int status = 1;
+        if(repl_opts->num_files == 0)
+            fprintf(stderr, "%s: batch mode needs at least one file\n", argv[0]);
+        else if(repl_opts->snapshot_out != NULL || repl_opts->node != NULL || repl_opts->profile != NULL ||
+                repl_opts->emit_c != NULL)
+            fprintf(stderr, "%s: -s, -n, --profile and --emit-c cannot be used with more than one file\n", argv[0]);
+        else
+        {
+            if(repl_opts->jobs == 0)
+                repl_opts->jobs = 1;
+            status = repl_batch(repl_opts);
+        }
+        if(repl_opts->trace != NULL)
+        {
+            ltrace_stop();
+            ltrace_write(repl_opts->trace);
+        }
+        repl_opts_destroy(repl_opts);
+        return status;
+    }
+
+    // the node has to be named before any pid is made
+    if(repl_opts->node != NULL && lactor_serve(repl_opts->node) != 0)
+    {
+        repl_opts_destroy(repl_opts);
+        return 1;
+    }
+    // a node is only ever stopped by a signal
+    if(repl_opts->node != NULL)
+    {
+        signal(SIGINT, repl_on_signal);
+        signal(SIGTERM, repl_on_signal);
+    }
+
+    // get a new interpreter, which stays current on this thread
+    lispy_ctx* ctx = lispy_ctx_new();
+    if(ctx == NULL)
+    {
+        repl_opts_destroy(repl_opts);
+        return 1;
+    }
+    ctx->budget = repl_opts->budget;
+    lispy_ctx_use(ctx);
+    if(repl_opts->snapshot_in != NULL)
+    {
+        if(lenv_snapshot_load(ctx->env, repl_opts->snapshot_in) != 0)
+            goto CLEANUP;
+        // the snapshot has the self of whoever saved it
+        lactor_bind_self(ctx->env, ctx->mailbox);
+    }
+    if(repl_opts->profile != NULL && lprof_start() != 0)
+        goto CLEANUP;
+    if(repl_opts->emit_c != NULL && repl_emit_c(ctx, repl_opts->emit_c) != 0)
+        goto CLEANUP;
+
+    if(repl_opts->num_files == 1)
     {
-        fprintf(stdout, "Lispy 0.0001\n");
+        if(repl_run_pipelined(ctx, repl_opts->filenames[0], stdout) < 0)
+            goto CLEANUP;
+
+        if(repl_opts->snapshot_out != NULL)
+            lenv_snapshot_save(ctx->env, repl_opts->snapshot_out);
+    }
+
+    if(repl_opts->node != NULL)
+    {
+        // actors run on their own threads until we are killed
+        fflush(stdout);
+        while(1)
+            pause();
+    }
+    else if(repl_opts->num_files == 0)
+    {
+        fprintf(stdout, "Lispy %s\n", lispy_version());
         // main loop
         while(1)
         {
             char* input = readline("lispy> ");
+            if(input == NULL)
+                break;
             add_history(input);
 
             // attempt to parse the input 
-            mpc_result_t r;
-            if(mpc_parse("<stdin>", input, Lispy, &r))
+            char* err;
+            lval* expr = lispy_read(ctx, "<stdin>", input, &err);
+            if(expr != NULL)
             {
-                // debug print the expressions
-                lval* x = lval_eval(env, lval_read(r.output));
+                lval* x = lispy_eval(ctx, expr);
                 lval_println(x);
                 lval_del(x);
-                mpc_ast_delete(r.output);
             }
             else
             {
-                mpc_err_print(r.error);
-                mpc_err_delete(r.error);
+                fputs(err, stdout);
+                free(err);
             }
             free(input);
         }
@@ -261,11 +933,27 @@ int main(int argc, char *argv[])
 CLEANUP:
     // Since we quit with sigterm, we are actually letting the OS 
     // clean up after us. 
-    lenv_del(env);
+    if(repl_opts->profile != NULL && lprof_on)
+    {
+        lprof_stop();
+        lprof_write_folded(repl_opts->profile);
+        lprof_fprint_top(stderr, LPROF_TOP);
+    }
+    if(repl_opts->builtin_stats)
+        lstats_fprint(stderr);
+    if(repl_opts->trace != NULL)
+    {
+        ltrace_stop();
+        ltrace_write(repl_opts->trace);
+    }
+    if(repl_opts->mem_stats)
+    {
+        lmemstats stats;
+        lheap_stats(&ctx->heap, &stats);
+        lmemstats_fprint(stderr, &stats);
+    }
+    lispy_ctx_del(ctx);
     repl_opts_destroy(repl_opts);
 
-    // cleanup parsers 
-    mpc_cleanup(6, Number, Decimal, Symbol, Sexpr, Qexpr, Expr, Lispy);
-
     return 0;
 }
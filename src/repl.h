@@ -9,27 +9,73 @@
 #ifndef __BYOL_REPL_H
 #define __BYOL_REPL_H
 
-#include "lval.h"
-#include "mpc.h"
+#include "context.h"
 
-const char* LISPY_VERSION = "0.0.0.2";
-
-// Convert MPC expressions to lvals
-lval* lval_read_num(mpc_ast_t* ast);
-lval* lval_read(mpc_ast_t* ast);
+// forms parsed ahead of (and results waiting behind) the evaluator
+#define REPL_QUEUE_SIZE     64
+// bytes of output the printer collects before writing them
+#define REPL_PRINT_BUFFER   (1 << 16)
 
 /*
  * repl options 
  */
 typedef struct 
 {
-    char* filename;
+    char** filenames;
+    int    num_files;
+    int    jobs;            // > 0 to evaluate the files in parallel
+    char*  out_dir;         // batch output goes to one file per script here
+    char* snapshot_in;      // restore the environment from here 
+    char* snapshot_out;     // save the environment here after running filename
+    char* node;             // serve actors as this node (see actor.h)
+    int   mem_stats;        // print memory statistics (see lval.h) at exit
+    char* profile;          // write a profile (see prof.h) here at exit
+    int   builtin_stats;    // count calls (see stats.h), print them at exit
+    char* trace;            // write a trace (see trace.h) here at exit
+    lbudget budget;         // limits of each top-level form (see lispy.h)
+    char* emit_c;           // compile this file to C (see aot.h) first
 } ReplOpts;
 
 
+/*
+ * batch job
+ * One script of a batch, see repl_batch()
+ */
+typedef struct
+{
+    const char* filename;
+    char*       output;         // captured, unless written to out_dir
+    char*       out_path;       // the file in out_dir, or NULL
+    size_t      len;
+    int         errors;         // -1 if the script could not be run
+    double      seconds;
+    int         done;
+} ReplJob;
+
+
 ReplOpts* repl_opts_create(void);
 void      repl_opts_destroy(ReplOpts* opts);
 void      repl_opts_add_filename(ReplOpts* opts, char* filename);
+void      repl_opts_set_str(char** opt, char* str);
+
+/*
+ * repl_run_file()
+ * Evaluate filename in ctx, printing each result to out. Returns the
+ * number of errors, or -1 if the file cannot be opened.
+ */
+int       repl_run_file(lispy_ctx* ctx, const char* filename, FILE* out);
+/*
+ * repl_run_pipelined()
+ * repl_run_file() with parsing and printing on threads of their own,
+ * so that they overlap with evaluation.
+ */
+int       repl_run_pipelined(lispy_ctx* ctx, const char* filename, FILE* out);
+/*
+ * repl_batch()
+ * Evaluate the files in opts on opts->jobs threads, each in its own
+ * interpreter. Returns 0 if none of them had errors.
+ */
+int       repl_batch(ReplOpts* opts);
 
 
 #endif /*__BYOL_REPL_H*/
@@ -0,0 +1,664 @@
+/*
+ * SNAPSHOT
+ * Save a fully initialized environment to disk and restore it
+ * later without re-evaluating the code that built it.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "snapshot.h"
+#include "native.h"
+
+
+// ======== WRITER ======== //
+typedef struct
+{
+    char*    data;
+    size_t   len;
+    size_t   cap;
+    // relocation table for builtins
+    lbuiltin* builtins;
+    int       num_builtins;
+    lenv*     root;
+    int       skip;         // leave out bindings that cannot be saved
+    int       error;
+} lsnap_writer;
+
+/*
+ * lsnap_put()
+ */
+static void lsnap_put(lsnap_writer* w, const void* src, size_t n)
+{
+    if(w->len + n > w->cap)
+    {
+        size_t cap = (w->cap == 0) ? 4096 : w->cap;
+        while(w->len + n > cap)
+            cap *= 2;
+        char* data = realloc(w->data, cap);
+        if(!data)
+        {
+            fprintf(stderr, "[%s] failed to allocate %ld bytes for snapshot\n", __func__, cap);
+            w->error = 1;
+            return;
+        }
+        w->data = data;
+        w->cap  = cap;
+    }
+    memcpy(w->data + w->len, src, n);
+    w->len += n;
+}
+
+static void lsnap_put_u8(lsnap_writer* w, uint8_t x)   { lsnap_put(w, &x, sizeof(x)); }
+static void lsnap_put_u32(lsnap_writer* w, uint32_t x) { lsnap_put(w, &x, sizeof(x)); }
+
+static void lsnap_put_str(lsnap_writer* w, const char* s)
+{
+    uint32_t len = strlen(s);
+    lsnap_put_u32(w, len);
+    lsnap_put(w, s, len);
+}
+
+/*
+ * lsnap_builtin_index()
+ * Find (or add) the relocation table entry for func
+ */
+static uint32_t lsnap_builtin_index(lsnap_writer* w, lbuiltin func)
+{
+    for(int i = 0; i < w->num_builtins; ++i)
+    {
+        if(w->builtins[i] == func)
+            return i;
+    }
+
+    w->num_builtins++;
+    w->builtins = realloc(w->builtins, sizeof(lbuiltin) * w->num_builtins);
+    w->builtins[w->num_builtins - 1] = func;
+
+    return w->num_builtins - 1;
+}
+
+/*
+ * lsnap_builtin_name()
+ * Builtins in the builtin table use their registered name, anything
+ * else added with lenv_add_builtin() is named by its binding in the
+ * root environment.
+ */
+static const char* lsnap_builtin_name(lsnap_writer* w, lbuiltin func)
+{
+    const char* name = lval_builtin_name(func);
+    if(name != NULL)
+        return name;
+
+    for(int i = 0; i < w->root->count; ++i)
+    {
+        lval* v = w->root->vals[i];
+        if(v->type == LVAL_FUNC && v->builtin == func)
+            return w->root->syms[i];
+    }
+
+    return NULL;
+}
+
+static void lsnap_put_env(lsnap_writer* w, lenv* env);
+
+/*
+ * lsnap_put_val()
+ */
+static void lsnap_put_val(lsnap_writer* w, lval* v)
+{
+    lsnap_put_u8(w, v->type);
+    switch(v->type)
+    {
+        case LVAL_NUM:
+        {
+            int64_t n = v->num;
+            lsnap_put(w, &n, sizeof(n));
+            break;
+        }
+        case LVAL_DECIMAL:
+            lsnap_put(w, &v->decimal, sizeof(v->decimal));
+            break;
+        case LVAL_ERR:
+            lsnap_put_str(w, v->err);
+            break;
+        case LVAL_STR:
+            lsnap_put_str(w, v->str);
+            break;
+        case LVAL_SYM:
+            lsnap_put_str(w, v->sym);
+            break;
+        case LVAL_FUNC:
+            if(v->builtin != NULL && lnative_is_builtin(v->builtin))
+            {
+                const char* name = lsnap_builtin_name(w, v->builtin);
+                fprintf(stderr, "[%s] builtin '%s' of a native module cannot be saved\n",
+                        __func__, (name != NULL) ? name : "?");
+                w->error = 1;
+                break;
+            }
+            lsnap_put_u8(w, v->builtin != NULL);
+            if(v->builtin)
+                lsnap_put_u32(w, lsnap_builtin_index(w, v->builtin));
+            else
+            {
+                lsnap_put_env(w, v->env);
+                lsnap_put_val(w, v->formals);
+                lsnap_put_val(w, v->body);
+            }
+            break;
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            lsnap_put_u32(w, v->count);
+            for(int i = 0; i < v->count; ++i)
+                lsnap_put_val(w, v->cell[i]);
+            break;
+        case LVAL_PID:
+        {
+            int64_t id = v->num;
+            lsnap_put_str(w, v->sym);
+            lsnap_put(w, &id, sizeof(id));
+            break;
+        }
+        case LVAL_FUTURE:
+        case LVAL_CHAN:
+            fprintf(stderr, "[%s] %s values cannot be saved\n", __func__, lval_type_str(v->type));
+            w->error = 1;
+            break;
+    }
+}
+
+/*
+ * lsnap_saveable()
+ * Futures, channels and the builtins of native modules only mean
+ * something inside this process
+ */
+static int lsnap_saveable(lval* v)
+{
+    switch(v->type)
+    {
+        case LVAL_FUTURE:
+        case LVAL_CHAN:
+            return 0;
+        case LVAL_FUNC:
+            if(v->builtin == NULL)
+            {
+                for(int i = 0; i < v->env->count; ++i)
+                {
+                    if(!lsnap_saveable(v->env->vals[i]))
+                        return 0;
+                }
+                return lsnap_saveable(v->body);
+            }
+            return !lnative_is_builtin(v->builtin);
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for(int i = 0; i < v->count; ++i)
+            {
+                if(!lsnap_saveable(v->cell[i]))
+                    return 0;
+            }
+            return 1;
+        default:
+            return 1;
+    }
+}
+
+/*
+ * lsnap_put_env()
+ * Parents are not saved. A lambda's parent is only set for the
+ * duration of a call and the root environment has none.
+ */
+static void lsnap_put_env(lsnap_writer* w, lenv* env)
+{
+    uint32_t count = env->count;
+    if(w->skip)
+    {
+        for(int i = 0; i < env->count; ++i)
+            count -= !lsnap_saveable(env->vals[i]);
+    }
+
+    lsnap_put_u32(w, count);
+    for(int i = 0; i < env->count; ++i)
+    {
+        if(w->skip && !lsnap_saveable(env->vals[i]))
+            continue;
+        lsnap_put_str(w, env->syms[i]);
+        lsnap_put_val(w, env->vals[i]);
+    }
+}
+
+/*
+ * lsnap_finish()
+ * Put the header (with the relocation table body ended up needing)
+ * in front of body. Returns the whole snapshot, or NULL on failure.
+ * Frees body either way.
+ */
+static char* lsnap_finish(lsnap_writer* body, size_t* len)
+{
+    lsnap_writer head = {0};
+    char* data = NULL;
+
+    lsnap_put_u32(&head, LSNAP_MAGIC);
+    lsnap_put_u32(&head, LSNAP_VERSION);
+    lsnap_put_u32(&head, body->num_builtins);
+    for(int i = 0; i < body->num_builtins; ++i)
+    {
+        const char* name = lsnap_builtin_name(body, body->builtins[i]);
+        if(name == NULL)
+        {
+            fprintf(stderr, "[%s] cannot snapshot builtin %p, it is not bound in the environment\n",
+                    __func__, (void*) body->builtins[i]);
+            head.error = 1;
+            break;
+        }
+        lsnap_put_str(&head, name);
+    }
+    lsnap_put(&head, body->data, body->len);
+
+    if(!head.error && !body->error)
+    {
+        data = head.data;
+        *len = head.len;
+    }
+    else
+        free(head.data);
+    free(body->data);
+    free(body->builtins);
+
+    return data;
+}
+
+/*
+ * lenv_snapshot_dump()
+ */
+char* lenv_snapshot_dump(lenv* env, int skip, size_t* len)
+{
+    lsnap_writer body = {0};
+
+    body.root = env;
+    body.skip = skip;
+    lsnap_put_env(&body, env);
+
+    return lsnap_finish(&body, len);
+}
+
+/*
+ * lval_snapshot_dump()
+ */
+char* lval_snapshot_dump(lval* v, lenv* root, size_t* len)
+{
+    lsnap_writer body = {0};
+
+    body.root = root;
+    lsnap_put_val(&body, v);
+
+    return lsnap_finish(&body, len);
+}
+
+/*
+ * lenv_snapshot_save()
+ */
+int lenv_snapshot_save(lenv* env, const char* filename)
+{
+    int status = -1;
+    size_t len;
+    FILE* fp;
+
+    char* data = lenv_snapshot_dump(env, 0, &len);
+    if(data == NULL)
+        return -1;
+
+    fp = fopen(filename, "wb");
+    if(!fp)
+    {
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, filename);
+        free(data);
+        return -1;
+    }
+    if(fwrite(data, 1, len, fp) == len)
+        status = 0;
+    else
+        fprintf(stderr, "[%s] failed to write file [%s]\n", __func__, filename);
+    fclose(fp);
+    free(data);
+
+    return status;
+}
+
+
+// ======== READER ======== //
+typedef struct
+{
+    const char* data;
+    size_t      len;
+    size_t      pos;
+    // relocation table, resolved against this process
+    lbuiltin*   builtins;
+    uint32_t    num_builtins;
+    int         error;
+} lsnap_reader;
+
+/*
+ * lsnap_get()
+ */
+static int lsnap_get(lsnap_reader* r, void* dst, size_t n)
+{
+    if(r->error || r->len - r->pos < n)
+    {
+        r->error = 1;
+        memset(dst, 0, n);
+        return 0;
+    }
+    memcpy(dst, r->data + r->pos, n);
+    r->pos += n;
+
+    return 1;
+}
+
+static uint8_t  lsnap_get_u8(lsnap_reader* r)  { uint8_t x;  lsnap_get(r, &x, sizeof(x)); return x; }
+static uint32_t lsnap_get_u32(lsnap_reader* r) { uint32_t x; lsnap_get(r, &x, sizeof(x)); return x; }
+
+/*
+ * lsnap_get_str()
+ * Caller owns the returned string
+ */
+static char* lsnap_get_str(lsnap_reader* r)
+{
+    uint32_t len = lsnap_get_u32(r);
+    if(r->error || r->len - r->pos < len)
+    {
+        r->error = 1;
+        return NULL;
+    }
+    char* s = malloc(len + 1);
+    memcpy(s, r->data + r->pos, len);
+    s[len] = '\0';
+    r->pos += len;
+
+    return s;
+}
+
+static int lsnap_get_env(lsnap_reader* r, lenv* env);
+
+/*
+ * lsnap_get_val()
+ * Returns NULL if the snapshot is malformed
+ */
+static lval* lsnap_get_val(lsnap_reader* r)
+{
+    lval* v = NULL;
+    char* s;
+    uint8_t type = lsnap_get_u8(r);
+
+    if(r->error)
+        return NULL;
+
+    switch(type)
+    {
+        case LVAL_NUM:
+        {
+            int64_t n;
+            if(lsnap_get(r, &n, sizeof(n)))
+                v = lval_num(n);
+            break;
+        }
+        case LVAL_DECIMAL:
+        {
+            double d;
+            if(lsnap_get(r, &d, sizeof(d)))
+                v = lval_decimal(d);
+            break;
+        }
+        case LVAL_ERR:
+            s = lsnap_get_str(r);
+            if(s != NULL)
+                v = lval_err("%s", s);
+            free(s);
+            break;
+        case LVAL_SYM:
+            s = lsnap_get_str(r);
+            if(s != NULL)
+                v = lval_sym(s);
+            free(s);
+            break;
+        case LVAL_FUNC:
+            if(lsnap_get_u8(r))
+            {
+                uint32_t idx = lsnap_get_u32(r);
+                if(r->error || idx >= r->num_builtins)
+                    break;
+                v = lval_func(r->builtins[idx]);
+            }
+            else
+            {
+                lenv* env = lenv_new();
+                lval* formals;
+                lval* body;
+
+                formals = lsnap_get_env(r, env) ? lsnap_get_val(r) : NULL;
+                body    = formals ? lsnap_get_val(r) : NULL;
+                if(body == NULL)
+                {
+                    if(formals)
+                        lval_del(formals);
+                    lenv_del(env);
+                    break;
+                }
+                v = lval_lambda(formals, body);
+                lenv_del(v->env);
+                v->env = env;
+            }
+            break;
+        case LVAL_STR:
+            s = lsnap_get_str(r);
+            if(s != NULL)
+                v = lval_str(s);
+            free(s);
+            break;
+        case LVAL_PID:
+        {
+            int64_t id;
+            s = lsnap_get_str(r);
+            if(s != NULL && lsnap_get(r, &id, sizeof(id)))
+                v = lval_pid(s, id);
+            free(s);
+            break;
+        }
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+        {
+            uint32_t count = lsnap_get_u32(r);
+            v = (type == LVAL_SEXPR) ? lval_sexpr() : lval_qexpr();
+            for(uint32_t i = 0; i < count && !r->error; ++i)
+            {
+                lval* x = lsnap_get_val(r);
+                if(x == NULL)
+                    break;
+                lval_add(v, x);
+            }
+            if(r->error)
+            {
+                lval_del(v);
+                v = NULL;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    if(v == NULL)
+        r->error = 1;
+
+    return v;
+}
+
+/*
+ * lsnap_get_env()
+ */
+static int lsnap_get_env(lsnap_reader* r, lenv* env)
+{
+    uint32_t count = lsnap_get_u32(r);
+
+    for(uint32_t i = 0; i < count && !r->error; ++i)
+    {
+        char* name = lsnap_get_str(r);
+        if(name == NULL)
+            break;
+        lval* val = lsnap_get_val(r);
+        if(val == NULL)
+        {
+            free(name);
+            break;
+        }
+        lval* sym = lval_sym(name);
+        lenv_put(env, sym, val);
+        lval_del(sym);
+        lval_del(val);
+        free(name);
+    }
+
+    return !r->error;
+}
+
+/*
+ * lsnap_resolve_builtin()
+ */
+static lbuiltin lsnap_resolve_builtin(lenv* env, const char* name)
+{
+    lbuiltin func = lval_builtin_lookup(name);
+    if(func != NULL)
+        return func;
+
+    for(int i = 0; i < env->count; ++i)
+    {
+        lval* v = env->vals[i];
+        if(v->type == LVAL_FUNC && v->builtin && strcmp(env->syms[i], name) == 0)
+            return v->builtin;
+    }
+
+    return NULL;
+}
+
+/*
+ * lsnap_open()
+ * Check the header and relocate builtins against env. what names the
+ * snapshot in messages. Returns 0, or -1 if the snapshot is no good.
+ */
+static int lsnap_open(lsnap_reader* r, lenv* env, const char* what)
+{
+    if(lsnap_get_u32(r) != LSNAP_MAGIC || lsnap_get_u32(r) != LSNAP_VERSION)
+    {
+        fprintf(stderr, "[%s] [%s] is not a version %d snapshot\n",
+                __func__, what, LSNAP_VERSION);
+        return -1;
+    }
+
+    // relocate builtins
+    r->num_builtins = lsnap_get_u32(r);
+    if(r->error || r->num_builtins > r->len)
+        goto OPEN_CORRUPT;
+    r->builtins = malloc(sizeof(lbuiltin) * (r->num_builtins + 1));
+    for(uint32_t i = 0; i < r->num_builtins; ++i)
+    {
+        char* name = lsnap_get_str(r);
+        if(name == NULL)
+            goto OPEN_CORRUPT;
+        r->builtins[i] = lsnap_resolve_builtin(env, name);
+        if(r->builtins[i] == NULL)
+        {
+            fprintf(stderr, "[%s] snapshot [%s] needs unknown builtin '%s'\n",
+                    __func__, what, name);
+            free(name);
+            return -1;
+        }
+        free(name);
+    }
+
+    return 0;
+
+OPEN_CORRUPT:
+    fprintf(stderr, "[%s] snapshot [%s] is truncated or corrupt\n", __func__, what);
+    return -1;
+}
+
+/*
+ * lenv_snapshot_restore()
+ */
+int lenv_snapshot_restore(lenv* env, const char* data, size_t len, const char* what)
+{
+    lsnap_reader r = {0};
+    int status = -1;
+
+    r.data = data;
+    r.len  = len;
+    if(lsnap_open(&r, env, what) == 0)
+    {
+        if(lsnap_get_env(&r, env) && r.pos == r.len)
+            status = 0;
+        else
+            fprintf(stderr, "[%s] snapshot [%s] is truncated or corrupt\n", __func__, what);
+    }
+    free(r.builtins);
+
+    return status;
+}
+
+/*
+ * lval_snapshot_restore()
+ */
+lval* lval_snapshot_restore(lenv* root, const char* data, size_t len)
+{
+    lsnap_reader r = {0};
+    lval* v = NULL;
+
+    r.data = data;
+    r.len  = len;
+    if(lsnap_open(&r, root, "<value>") == 0)
+    {
+        v = lsnap_get_val(&r);
+        if(v != NULL && r.pos != r.len)
+        {
+            lval_del(v);
+            v = NULL;
+        }
+        if(v == NULL)
+            fprintf(stderr, "[%s] value snapshot is truncated or corrupt\n", __func__);
+    }
+    free(r.builtins);
+
+    return v;
+}
+
+/*
+ * lenv_snapshot_load()
+ */
+int lenv_snapshot_load(lenv* env, const char* filename)
+{
+    char* data = NULL;
+    int status = -1;
+    long len;
+    FILE* fp;
+
+    fp = fopen(filename, "rb");
+    if(!fp)
+    {
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, filename);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    data = malloc(len > 0 ? len : 1);
+    if(!data || fread(data, 1, len, fp) != (size_t) len)
+        fprintf(stderr, "[%s] failed to read file [%s]\n", __func__, filename);
+    else
+        status = lenv_snapshot_restore(env, data, len, filename);
+    fclose(fp);
+    free(data);
+
+    return status;
+}
@@ -0,0 +1,83 @@
+/*
+ * SNAPSHOT
+ * Save a fully initialized environment to disk and restore it
+ * later without re-evaluating the code that built it.
+ */
+
+#ifndef __BYOL_SNAPSHOT_H
+#define __BYOL_SNAPSHOT_H
+
+#include "lval.h"
+
+#define LSNAP_MAGIC   0x5950534c     // "LSPY"
+#define LSNAP_VERSION 1
+
+/*
+ * Snapshot layout (native byte order, this is a cache and not an
+ * interchange format)
+ *
+ *   u32 magic, u32 version
+ *   u32 nbuiltins, nbuiltins * str       -- relocation table
+ *   env                                  -- the global environment
+ *                                           (or one val, for a value
+ *                                           snapshot)
+ *
+ *   env   : u32 count, count * (str sym, val)
+ *   val   : u8 type, then
+ *           NUM      i64
+ *           DECIMAL  f64
+ *           ERR/SYM  str
+ *           STR      str
+ *           S/QEXPR  u32 count, count * val
+ *           FUNC     u8 is_builtin, then either u32 index into the
+ *                    relocation table, or env formals body
+ *           PID      str node, i64 id
+ *   str   : u32 len, len bytes (no terminator)
+ *
+ * Builtins are written as the name they are registered under and
+ * resolved back to a function pointer on load. Futures, channels and
+ * the builtins of native modules (see native.h) cannot be saved.
+ */
+
+/*
+ * lenv_snapshot_dump()
+ * Encode env as a snapshot in memory. If skip is non-zero, bindings
+ * whose values cannot be saved are left out instead of failing.
+ * Returns a malloc'd buffer of *len bytes, or NULL on failure.
+ */
+char* lenv_snapshot_dump(lenv* env, int skip, size_t* len);
+/*
+ * lenv_snapshot_restore()
+ * Restore the bindings in a snapshot made by lenv_snapshot_dump()
+ * into env. what names the snapshot in error messages. Returns 0 on
+ * success, -1 on failure.
+ */
+int   lenv_snapshot_restore(lenv* env, const char* data, size_t len, const char* what);
+/*
+ * lval_snapshot_dump()
+ * Encode the single value v. Builtins are named after their binding
+ * in root. Returns a malloc'd buffer of *len bytes, or NULL on failure.
+ */
+char* lval_snapshot_dump(lval* v, lenv* root, size_t* len);
+/*
+ * lval_snapshot_restore()
+ * Decode a value made by lval_snapshot_dump(), resolving builtins in
+ * root. Returns NULL if the data is no good.
+ */
+lval* lval_snapshot_restore(lenv* root, const char* data, size_t len);
+
+/*
+ * lenv_snapshot_save()
+ * Write env (and everything reachable from it) to filename.
+ * Returns 0 on success, -1 on failure.
+ */
+int lenv_snapshot_save(lenv* env, const char* filename);
+/*
+ * lenv_snapshot_load()
+ * Restore the bindings in filename into env. Builtins that are not
+ * in the builtin table must already be bound in env under the name
+ * they were saved with. Returns 0 on success, -1 on failure.
+ */
+int lenv_snapshot_load(lenv* env, const char* filename);
+
+#endif /*__BYOL_SNAPSHOT_H*/
@@ -0,0 +1,294 @@
+/*
+ * SPEC
+ * Speculative argument evaluation
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "context.h"
+#include "spec.h"
+
+// bumped whenever a global scope changes. The purity cached on a
+// lambda is (generation << 1) | pure, so 0 is never valid.
+static long lspec_generation = 1;
+
+/*
+ * SCOPE
+ * Where the symbols of an expression are looked up during analysis.
+ * The expression being evaluated uses the live chain of env. Lambda
+ * bodies use the lambda's own env and then the global scope, with
+ * their formals unknown until the call.
+ */
+typedef struct
+{
+    lval*   formals;
+    lenv*   env;
+    int     chain;      // look in the parents of env too
+    lenv*   global;
+} lspec_scope;
+
+static int lspec_pure_func(lval* f, lenv* global, lval** stack, int depth);
+
+
+/*
+ * lspec_default_threshold()
+ */
+long lspec_default_threshold(void)
+{
+    const char* env = getenv("LISPY_SPECULATE");
+    if(env != NULL && atol(env) > 0)
+        return atol(env);
+
+    return 0;
+}
+
+/*
+ * lspec_invalidate()
+ */
+void lspec_invalidate(void)
+{
+    __atomic_add_fetch(&lspec_generation, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * lspec_resolve()
+ * The value of sym in scope, or NULL if it is unbound. Sets unknown
+ * if sym is a formal, or unbound, so could be anything at run time.
+ */
+static lval* lspec_resolve(lspec_scope* scope, char* sym, int* unknown)
+{
+    lval* v = NULL;
+
+    *unknown = 1;
+    if(scope->formals != NULL)
+    {
+        for(int i = 0; i < scope->formals->count; ++i)
+        {
+            if(scope->formals->cell[i]->sym == sym)
+                return NULL;
+        }
+    }
+
+    if(scope->chain)
+    {
+        for(lenv* e = scope->env; e != NULL && v == NULL; e = e->parent)
+            v = lenv_find(e, sym);
+    }
+    else
+    {
+        v = lenv_find(scope->env, sym);
+        if(v == NULL)
+            v = lenv_find(scope->global, sym);
+    }
+    *unknown = (v == NULL);
+
+    return v;
+}
+
+/*
+ * lspec_pure_expr()
+ * Code and data look the same, so every list is checked as though it
+ * might be evaluated (Q-Expressions are the bodies of if and \).
+ */
+static int lspec_pure_expr(lspec_scope* scope, lval* x, lval** stack, int depth)
+{
+    int unknown;
+
+    switch(x->type)
+    {
+        case LVAL_SYM:
+        {
+            lval* v = lspec_resolve(scope, x->sym, &unknown);
+            if(v != NULL && v->type == LVAL_FUNC)
+                return lspec_pure_func(v, scope->global, stack, depth);
+            return 1;
+        }
+
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            // a call through a formal may call anything
+            if(x->count > 1 && x->cell[0]->type == LVAL_SYM)
+            {
+                lspec_resolve(scope, x->cell[0]->sym, &unknown);
+                if(unknown)
+                    return 0;
+            }
+            for(int i = 0; i < x->count; ++i)
+            {
+                if(!lspec_pure_expr(scope, x->cell[i], stack, depth))
+                    return 0;
+            }
+            return 1;
+
+        case LVAL_FUNC:
+            return lspec_pure_func(x, scope->global, stack, depth);
+
+        default:
+            return 1;
+    }
+}
+
+/*
+ * lspec_pure_func()
+ * Recursive calls are assumed pure while the body is checked, so
+ * only results that do not rest on that assumption (the outermost
+ * one, or any impure one) are cached.
+ */
+static int lspec_pure_func(lval* f, lenv* global, lval** stack, int depth)
+{
+    if(f->builtin != NULL)
+        return lval_builtin_pure(f->builtin);
+
+    long gen = __atomic_load_n(&lspec_generation, __ATOMIC_RELAXED);
+    long cached = __atomic_load_n(&f->purity, __ATOMIC_RELAXED);
+    if((cached >> 1) == gen)
+        return cached & 1;
+
+    for(int i = 0; i < depth; ++i)
+    {
+        if(stack[i] == f)
+            return 1;
+    }
+    if(depth == LSPEC_MAX_DEPTH)
+        return 0;
+
+    lspec_scope scope = {f->formals, f->env, 0, global};
+    stack[depth] = f;
+    int pure = lspec_pure_expr(&scope, f->body, stack, depth + 1);
+
+    if(depth == 0 || !pure)
+        __atomic_store_n(&f->purity, (gen << 1) | pure, __ATOMIC_RELAXED);
+
+    return pure;
+}
+
+/*
+ * lspec_cost()
+ * Rough cost of evaluating x. Lambdas are not looked into, a call to
+ * one just costs LSPEC_CALL_COST.
+ */
+static long lspec_cost(lspec_scope* scope, lval* x)
+{
+    int unknown;
+    long cost = 1;
+
+    switch(x->type)
+    {
+        case LVAL_SYM:
+        {
+            lval* v = lspec_resolve(scope, x->sym, &unknown);
+            if(v != NULL && v->type == LVAL_FUNC && v->builtin == NULL)
+                cost = LSPEC_CALL_COST;
+            break;
+        }
+
+        case LVAL_SEXPR:
+        case LVAL_QEXPR:
+            for(int i = 0; i < x->count; ++i)
+                cost += lspec_cost(scope, x->cell[i]);
+            break;
+
+        default:
+            break;
+    }
+
+    return cost;
+}
+
+/*
+ * lspec_global()
+ */
+static lenv* lspec_global(lenv* env)
+{
+    while(env->parent != NULL)
+        env = env->parent;
+
+    return env;
+}
+
+/*
+ * lspec_threshold()
+ * Tasks run on behalf of the context that started their scheduler
+ */
+static long lspec_threshold(void)
+{
+    lispy_ctx* ctx = lispy_ctx_current();
+
+    if(ctx != NULL)
+        return ctx->speculate;
+    if(ltask_current() != NULL)
+        return ltask_current()->speculate;
+
+    return 0;
+}
+
+/*
+ * lspec_eval_args()
+ */
+int lspec_eval_args(lenv* env, lval* val)
+{
+    long threshold = lspec_threshold();
+    if(threshold <= 0 || val->count < 3 || lpool_active())
+        return 0;
+
+    // most calls have fewer than two calls as arguments, so skip the
+    // analysis for them
+    int calls = 0;
+    for(int i = 1; i < val->count; ++i)
+    {
+        if(val->cell[i]->type == LVAL_SEXPR && val->cell[i]->count > 0)
+            calls++;
+    }
+    if(calls < 2 || ltask_busy())
+        return 0;
+
+    // evaluation order can only be ignored if nothing has effects
+    lval* stack[LSPEC_MAX_DEPTH];
+    lspec_scope scope = {NULL, env, 1, lspec_global(env)};
+    int fork[val->count];
+    int num_fork = 0;
+    int last = 0;
+    int pure = 1;
+
+    for(int i = 0; i < val->count && pure; ++i)
+    {
+        lval* x = val->cell[i];
+        pure = lspec_pure_expr(&scope, x, stack, 0);
+        fork[i] = (i > 0 && x->type == LVAL_SEXPR && lspec_cost(&scope, x) >= threshold);
+        if(fork[i])
+        {
+            num_fork++;
+            last = i;
+        }
+    }
+    if(!pure || num_fork < 2)
+        return 0;
+
+    // the last expensive argument runs here while the others run as
+    // tasks, then each result takes the place of its expression
+    lfuture* futs[val->count];
+    for(int i = 0; i < val->count; ++i)
+    {
+        futs[i] = NULL;
+        if(fork[i] && i != last)
+        {
+            futs[i] = ltask_spawn(val->cell[i], env);
+            val->cell[i] = NULL;
+        }
+    }
+    for(int i = 0; i < val->count; ++i)
+    {
+        if(futs[i] == NULL)
+            val->cell[i] = lval_eval(env, val->cell[i]);
+    }
+    for(int i = 0; i < val->count; ++i)
+    {
+        if(futs[i] != NULL)
+        {
+            val->cell[i] = ltask_await(futs[i]);
+            lfuture_release(futs[i]);
+        }
+    }
+
+    return 1;
+}
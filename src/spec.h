@@ -0,0 +1,43 @@
+/*
+ * SPEC
+ * Purity analysis and speculative (parallel) evaluation of the
+ * arguments of a call.
+ */
+
+#ifndef __BYOL_SPEC_H
+#define __BYOL_SPEC_H
+
+#include "lval.h"
+
+// estimated cost of calling a lambda, everything else costs 1
+#define LSPEC_CALL_COST     1000
+// lambdas calling lambdas deeper than this are taken to be impure
+#define LSPEC_MAX_DEPTH     32
+
+/*
+ * lspec_default_threshold()
+ * Cost above which arguments are evaluated in parallel, from
+ * $LISPY_SPECULATE. 0 (the default) turns speculation off.
+ */
+long lspec_default_threshold(void);
+/*
+ * lspec_invalidate()
+ * Forget the purity of every lambda. Called whenever the global
+ * scope changes, since a lambda is only as pure as the globals it
+ * calls.
+ */
+void lspec_invalidate(void);
+/*
+ * lspec_eval_args()
+ * Evaluate the elements of the S-Expression val in place, running
+ * the expensive ones in parallel as tasks if every element is pure
+ * and at least two cost more than the threshold. Builtins are pure
+ * if the builtin table says so and lambdas are pure if their bodies
+ * only call pure functions. Calls through symbols that are only
+ * bound when a lambda runs (its formals) are taken to be impure.
+ * Returns 0 (and evaluates nothing) if it is not worth it.
+ */
+int  lspec_eval_args(lenv* env, lval* val);
+
+
+#endif /*__BYOL_SPEC_H*/
@@ -0,0 +1,289 @@
+/*
+ * STATS
+ * Call counters and latency histograms
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+#include "lval.h"
+
+typedef struct
+{
+    const void* key;
+    const char* name;           // a copy, or the name of the builtin
+    int         is_builtin;
+    long        calls;
+    long        total_ns;
+    long        max_ns;
+    long        buckets[LSTATS_BUCKETS];
+} lstats_entry;
+
+/*
+ * TABLE
+ * The functions counted by one thread, by key. Slots are only ever
+ * filled, never emptied, so readers on other threads can walk them.
+ */
+typedef struct lstats_table
+{
+    lstats_entry*           slots[LSTATS_SLOTS];
+    int                     count;
+    struct lstats_table*    next;
+} lstats_table;
+
+int lstats_on = 0;
+
+// every table ever made, they outlive their threads
+static lstats_table*    lstats_tables = NULL;
+static pthread_mutex_t  lstats_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread lstats_table* lstats_here = NULL;
+
+
+/*
+ * lstats_now()
+ */
+long lstats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * lstats_bucket()
+ * Values below 1 << LSTATS_SUB_BITS have a bucket each. Above that
+ * the bucket is the position of the top bit and the LSTATS_SUB_BITS
+ * bits below it.
+ */
+static int lstats_bucket(long ns)
+{
+    if(ns < 0)
+        ns = 0;
+    if(ns >= (1L << LSTATS_MAX_BITS))
+        ns = (1L << LSTATS_MAX_BITS) - 1;
+    if(ns < (1L << LSTATS_SUB_BITS))
+        return ns;
+
+    int top = 63 - __builtin_clzl(ns);
+    int shift = top - LSTATS_SUB_BITS;
+    return ((shift + 1) << LSTATS_SUB_BITS) + ((ns >> shift) & ((1 << LSTATS_SUB_BITS) - 1));
+}
+
+/*
+ * lstats_bucket_max()
+ * The highest value that goes into bucket b
+ */
+static long lstats_bucket_max(int b)
+{
+    if(b < (1 << LSTATS_SUB_BITS))
+        return b;
+
+    int shift = (b >> LSTATS_SUB_BITS) - 1;
+    long mantissa = (1 << LSTATS_SUB_BITS) + (b & ((1 << LSTATS_SUB_BITS) - 1));
+    return ((mantissa + 1) << shift) - 1;
+}
+
+/*
+ * lstats_table_here()
+ */
+static lstats_table* lstats_table_here(void)
+{
+    if(lstats_here != NULL)
+        return lstats_here;
+
+    lstats_table* t = calloc(1, sizeof(*t));
+    if(!t)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for call stats\n", __func__, sizeof(*t));
+        return NULL;
+    }
+    pthread_mutex_lock(&lstats_lock);
+    t->next = lstats_tables;
+    lstats_tables = t;
+    pthread_mutex_unlock(&lstats_lock);
+    lstats_here = t;
+
+    return t;
+}
+
+/*
+ * lstats_find()
+ * The entry for key, made if need be. A lambda name can be at the
+ * address of another, freed, name, so those are checked by text.
+ */
+static lstats_entry* lstats_find(lstats_table* t, const void* key, int is_builtin, const char* name)
+{
+    uintptr_t h = ((uintptr_t) key >> 3) * 0x9e3779b97f4a7c15u;
+
+    for(int i = 0; i < LSTATS_SLOTS; ++i)
+    {
+        lstats_entry* e = t->slots[(h + i) & (LSTATS_SLOTS - 1)];
+        if(e == NULL)
+        {
+            if(t->count >= LSTATS_SLOTS / 2)
+                return NULL;
+            e = calloc(1, sizeof(*e));
+            if(!e)
+                return NULL;
+            e->key        = key;
+            e->is_builtin = is_builtin;
+            if(is_builtin)
+            {
+                e->name = lval_builtin_name((lbuiltin) key);
+                if(e->name == NULL)
+                    e->name = "builtin";
+            }
+            else
+                e->name = strdup(name);
+            t->count++;
+            __atomic_store_n(&t->slots[(h + i) & (LSTATS_SLOTS - 1)], e, __ATOMIC_RELEASE);
+            return e;
+        }
+        if(e->key == key && e->is_builtin == is_builtin &&
+           (is_builtin || strcmp(e->name, name) == 0))
+            return e;
+    }
+
+    return NULL;
+}
+
+/*
+ * lstats_record()
+ * Only this thread writes its entries, the stores are atomic for
+ * the readers in lstats_collect().
+ */
+void lstats_record(const void* key, int is_builtin, const char* name, long ns)
+{
+    lstats_table* t = lstats_table_here();
+    lstats_entry* e = (t != NULL) ? lstats_find(t, key, is_builtin, name) : NULL;
+    if(e == NULL)
+        return;
+
+    int b = lstats_bucket(ns);
+    __atomic_store_n(&e->calls, e->calls + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->total_ns, e->total_ns + ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->buckets[b], e->buckets[b] + 1, __ATOMIC_RELAXED);
+    if(ns > e->max_ns)
+        __atomic_store_n(&e->max_ns, ns, __ATOMIC_RELAXED);
+}
+
+static int lstats_row_cmp(const void* a, const void* b)
+{
+    const lstats_row* x = a;
+    const lstats_row* y = b;
+
+    if(x->total_ns != y->total_ns)
+        return (x->total_ns < y->total_ns) ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+/*
+ * lstats_collect()
+ * Tables of different interpreters have different addresses for the
+ * same name, so rows are merged by name.
+ */
+int lstats_collect(lstats_row** rows)
+{
+    int num_rows = 0;
+    int cap = 0;
+    *rows = NULL;
+
+    pthread_mutex_lock(&lstats_lock);
+    for(lstats_table* t = lstats_tables; t != NULL; t = t->next)
+    {
+        for(int i = 0; i < LSTATS_SLOTS; ++i)
+        {
+            lstats_entry* e = __atomic_load_n(&t->slots[i], __ATOMIC_ACQUIRE);
+            if(e == NULL)
+                continue;
+
+            lstats_row* r = NULL;
+            for(int j = 0; j < num_rows && r == NULL; ++j)
+            {
+                if((*rows)[j].is_builtin == e->is_builtin && strcmp((*rows)[j].name, e->name) == 0)
+                    r = &(*rows)[j];
+            }
+            if(r == NULL)
+            {
+                if(num_rows == cap)
+                {
+                    cap = (cap == 0) ? 64 : cap * 2;
+                    *rows = realloc(*rows, sizeof(lstats_row) * cap);
+                }
+                r = &(*rows)[num_rows++];
+                memset(r, 0, sizeof(*r));
+                r->name       = e->name;
+                r->is_builtin = e->is_builtin;
+            }
+
+            r->calls    += __atomic_load_n(&e->calls, __ATOMIC_RELAXED);
+            r->total_ns += __atomic_load_n(&e->total_ns, __ATOMIC_RELAXED);
+            long max = __atomic_load_n(&e->max_ns, __ATOMIC_RELAXED);
+            if(max > r->max_ns)
+                r->max_ns = max;
+            for(int b = 0; b < LSTATS_BUCKETS; ++b)
+                r->buckets[b] += __atomic_load_n(&e->buckets[b], __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&lstats_lock);
+
+    qsort(*rows, num_rows, sizeof(lstats_row), lstats_row_cmp);
+
+    return num_rows;
+}
+
+/*
+ * lstats_percentile()
+ */
+long lstats_percentile(lstats_row* row, double p)
+{
+    long calls = 0;
+    for(int b = 0; b < LSTATS_BUCKETS; ++b)
+        calls += row->buckets[b];
+    if(calls == 0)
+        return 0;
+
+    // nearest rank
+    long rank = (long) (p / 100.0 * calls + 0.999999);
+    if(rank < 1)
+        rank = 1;
+    long seen = 0;
+    for(int b = 0; b < LSTATS_BUCKETS; ++b)
+    {
+        seen += row->buckets[b];
+        if(seen >= rank)
+        {
+            long v = lstats_bucket_max(b);
+            return (v < row->max_ns) ? v : row->max_ns;
+        }
+    }
+
+    return row->max_ns;
+}
+
+/*
+ * lstats_fprint()
+ */
+void lstats_fprint(FILE* fp)
+{
+    lstats_row* rows;
+    int n = lstats_collect(&rows);
+
+    fprintf(fp, "%-16s %10s %12s %10s %10s %10s %10s %10s\n",
+            "function", "calls", "total_ms", "mean_us", "p50_us", "p90_us", "p99_us", "max_us");
+    for(int i = 0; i < n; ++i)
+    {
+        lstats_row* r = &rows[i];
+        fprintf(fp, "%-16s %10ld %12.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                r->name, r->calls, r->total_ns / 1e6,
+                (r->calls > 0) ? r->total_ns / 1e3 / r->calls : 0.0,
+                lstats_percentile(r, 50) / 1e3, lstats_percentile(r, 90) / 1e3,
+                lstats_percentile(r, 99) / 1e3, r->max_ns / 1e3);
+    }
+    free(rows);
+}
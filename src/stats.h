@@ -0,0 +1,76 @@
+/*
+ * STATS
+ * Call counts and latencies of builtins and user functions. While
+ * lstats_on is set, lval_eval_sexpr() times every call it makes and
+ * counts it against the builtin, or against the name a lambda was
+ * called by ("lambda" if it had none). Latencies go into log-linear
+ * histograms in the style of HdrHistogram: each power of two of
+ * nanoseconds is split into 1 << LSTATS_SUB_BITS buckets, so any
+ * percentile is within 1 / (1 << LSTATS_SUB_BITS) of the truth.
+ *
+ * Each thread counts into a table of its own, without atomic updates,
+ * and lstats_collect() merges the tables of every thread. When off,
+ * a call costs one load and a branch.
+ */
+
+#ifndef __BYOL_STATS_H
+#define __BYOL_STATS_H
+
+#include <stdio.h>
+
+#define LSTATS_SUB_BITS     3
+// latencies are clamped to 2^LSTATS_MAX_BITS - 1 ns, about 18 minutes
+#define LSTATS_MAX_BITS     40
+#define LSTATS_BUCKETS      ((LSTATS_MAX_BITS - LSTATS_SUB_BITS + 1) << LSTATS_SUB_BITS)
+// functions counted per thread, a power of two
+#define LSTATS_SLOTS        1024
+
+/*
+ * ROW
+ * The merged counts of one function
+ */
+typedef struct lstats_row
+{
+    const char* name;
+    int         is_builtin;
+    long        calls;
+    long        total_ns;
+    long        max_ns;
+    long        buckets[LSTATS_BUCKETS];
+} lstats_row;
+
+// set while calls are counted
+extern int lstats_on;
+
+/*
+ * lstats_now()
+ * Monotonic nanoseconds
+ */
+long  lstats_now(void);
+/*
+ * lstats_record()
+ * Count a call of ns nanoseconds. key identifies the function: the
+ * builtin itself (name is then unused), or for a lambda the interned
+ * name it was called by, which is also its name.
+ */
+void  lstats_record(const void* key, int is_builtin, const char* name, long ns);
+/*
+ * lstats_collect()
+ * The counts of every thread merged by function, most total time
+ * first. Returns the number of rows, *rows is malloc'd.
+ */
+int   lstats_collect(lstats_row** rows);
+/*
+ * lstats_percentile()
+ * The latency at or below which p percent of the calls in row took,
+ * to within the resolution of the histogram.
+ */
+long  lstats_percentile(lstats_row* row, double p);
+/*
+ * lstats_fprint()
+ * Everything counted so far, as a table.
+ */
+void  lstats_fprint(FILE* fp);
+
+
+#endif /*__BYOL_STATS_H*/
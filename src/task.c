@@ -0,0 +1,678 @@
+/*
+ * TASK
+ * spawn/await on a work-stealing scheduler
+ */
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "context.h"
+#include "task.h"
+#include "fiber.h"
+#include "chan.h"
+
+#define LDEQUE_INITIAL_SIZE 64
+
+// set on scheduler workers, the owner thread finds its deque through
+// the current context instead
+static __thread lsched* ltask_sched = NULL;
+static __thread ldeque* ltask_deque = NULL;
+// depth of tasks running on this thread
+static __thread int     ltask_depth = 0;
+
+
+// ======== DEQUE ======== //
+
+/*
+ * ldeque_buf_new()
+ */
+static ldeque_buf* ldeque_buf_new(long size, ldeque_buf* prev)
+{
+    ldeque_buf* buf = malloc(sizeof(*buf));
+
+    buf->size  = size;
+    buf->tasks = malloc(sizeof(lfuture*) * size);
+    buf->prev  = prev;
+
+    return buf;
+}
+
+/*
+ * ldeque_init()
+ */
+static void ldeque_init(ldeque* dq)
+{
+    dq->top    = 0;
+    dq->bottom = 0;
+    dq->buf    = ldeque_buf_new(LDEQUE_INITIAL_SIZE, NULL);
+}
+
+/*
+ * ldeque_destroy()
+ */
+static void ldeque_destroy(ldeque* dq)
+{
+    while(dq->buf != NULL)
+    {
+        ldeque_buf* prev = dq->buf->prev;
+        free(dq->buf->tasks);
+        free(dq->buf);
+        dq->buf = prev;
+    }
+}
+
+/*
+ * ldeque_push()
+ * Owner only
+ */
+static void ldeque_push(ldeque* dq, lfuture* task)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    ldeque_buf* buf = dq->buf;
+
+    if(b - t > buf->size - 1)
+    {
+        // thieves may still be reading the old buffer, so it is kept
+        // until the deque is destroyed
+        ldeque_buf* big = ldeque_buf_new(buf->size * 2, buf);
+        for(long i = t; i < b; ++i)
+            big->tasks[i & (big->size - 1)] = buf->tasks[i & (buf->size - 1)];
+        __atomic_store_n(&dq->buf, big, __ATOMIC_RELEASE);
+        buf = big;
+    }
+    __atomic_store_n(&buf->tasks[b & (buf->size - 1)], task, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ldeque_take()
+ * Owner only. Returns the newest task, or NULL.
+ */
+static lfuture* ldeque_take(ldeque* dq)
+{
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    ldeque_buf* buf = dq->buf;
+    lfuture* task = NULL;
+
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+    if(t <= b)
+    {
+        task = __atomic_load_n(&buf->tasks[b & (buf->size - 1)], __ATOMIC_RELAXED);
+        if(t == b)
+        {
+            // last task, race the thieves for it
+            if(!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                task = NULL;
+            __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+
+    return task;
+}
+
+/*
+ * ldeque_steal()
+ * Any thread. Returns the oldest task, or NULL if the deque is
+ * empty or another thread got there first.
+ */
+static lfuture* ldeque_steal(ldeque* dq)
+{
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+
+    if(t >= b)
+        return NULL;
+
+    ldeque_buf* buf = __atomic_load_n(&dq->buf, __ATOMIC_ACQUIRE);
+    lfuture* task = __atomic_load_n(&buf->tasks[t & (buf->size - 1)], __ATOMIC_RELAXED);
+    if(!__atomic_compare_exchange_n(&dq->top, &t, t + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        return NULL;
+
+    return task;
+}
+
+
+// ======== FUTURES ======== //
+
+/*
+ * lfuture_retain()
+ */
+void lfuture_retain(lfuture* fut)
+{
+    __atomic_add_fetch(&fut->refs, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * lfuture_release()
+ */
+void lfuture_release(lfuture* fut)
+{
+    if(__atomic_sub_fetch(&fut->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    if(fut->expr != NULL)
+        lval_del(fut->expr);
+    if(fut->frame != NULL)
+        lenv_del(fut->frame);
+    if(fut->result != NULL)
+        lval_del(fut->result);
+    free(fut);
+}
+
+/*
+ * lfuture_done()
+ */
+int lfuture_done(lfuture* fut)
+{
+    return __atomic_load_n(&fut->done, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * lfuture_new()
+ */
+lfuture* lfuture_new(lval* expr, lenv* env)
+{
+    lfuture* fut = malloc(sizeof(*fut));
+    if(!fut)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for future\n", __func__, sizeof(*fut));
+        return NULL;
+    }
+
+    fut->sched  = NULL;
+    fut->expr   = expr;
+    fut->frame  = lenv_capture(env);
+    fut->result = NULL;
+    fut->done   = 0;
+    fut->refs   = 1;
+
+    return fut;
+}
+
+/*
+ * lfuture_run()
+ */
+void lfuture_run(lfuture* fut)
+{
+    lval* x = fut->expr;
+
+    fut->expr = NULL;
+    x->type = LVAL_SEXPR;
+    fut->result = lval_eval(fut->frame, x);
+
+    lenv_del(fut->frame);
+    fut->frame = NULL;
+    __atomic_store_n(&fut->done, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ltask_run()
+ * The frame is a private copy of the local scopes, so the only state
+ * a task shares with other threads is the global scope (see GLOBAL
+ * SCOPE in lval.h).
+ */
+static void ltask_run(lfuture* fut)
+{
+    ltask_depth++;
+    lfuture_run(fut);
+    ltask_depth--;
+}
+
+
+// ======== SCHEDULER ======== //
+
+/*
+ * lsched_find()
+ * Take a task from own, or steal one from another deque. own may
+ * be NULL for threads that are not part of the scheduler.
+ */
+static lfuture* lsched_find(lsched* sched, ldeque* own)
+{
+    int n = __atomic_load_n(&sched->num_workers, __ATOMIC_ACQUIRE) + 1;
+    int start = (own != NULL) ? own - sched->deques : 0;
+    lfuture* task = (own != NULL) ? ldeque_take(own) : NULL;
+
+    // start with the next deque along so that thieves spread out
+    for(int i = 1; i <= n && task == NULL; ++i)
+    {
+        ldeque* victim = &sched->deques[(start + i) % n];
+        if(victim != own)
+            task = ldeque_steal(victim);
+    }
+    if(task != NULL)
+        __atomic_sub_fetch(&sched->queued, 1, __ATOMIC_SEQ_CST);
+
+    return task;
+}
+
+/*
+ * lsched_run()
+ */
+static void lsched_run(lsched* sched, lfuture* task)
+{
+    ltask_run(task);
+    lfuture_release(task);
+    __atomic_sub_fetch(&sched->pending, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * lsched_push()
+ */
+static void lsched_push(lsched* sched, ldeque* dq, lfuture* task)
+{
+    __atomic_add_fetch(&sched->pending, 1, __ATOMIC_RELAXED);
+    ldeque_push(dq, task);
+    __atomic_add_fetch(&sched->queued, 1, __ATOMIC_SEQ_CST);
+
+    // pairs with the sleepers/queued check in lsched_worker()
+    if(__atomic_load_n(&sched->sleepers, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_signal(&sched->wake);
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+/*
+ * lsched_now()
+ */
+static long lsched_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * lsched_help()
+ * Run tasks until fut is done, or if fut is NULL until no task is
+ * pending. Returns -1 if the wait for fut gave up at the timeout of
+ * the evaluation (see lbudget_deadline()).
+ */
+static int lsched_help(lsched* sched, ldeque* own, lfuture* fut)
+{
+    long deadline = (fut != NULL) ? lbudget_deadline() : 0;
+
+    while((fut != NULL) ? !lfuture_done(fut) : __atomic_load_n(&sched->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        lfuture* task = lsched_find(sched, own);
+        if(task != NULL)
+            lsched_run(sched, task);
+        else if(deadline > 0 && lsched_now() >= deadline)
+            return -1;
+        else
+            sched_yield();
+    }
+
+    return 0;
+}
+
+/*
+ * lsched_worker()
+ */
+static void* lsched_worker(void* arg)
+{
+    lsched* sched = arg;
+    int id;
+
+    pthread_mutex_lock(&sched->lock);
+    for(id = 0; !pthread_equal(sched->workers[id], pthread_self()); ++id)
+        ;
+    pthread_mutex_unlock(&sched->lock);
+
+    lheap_set_current(&sched->heaps[id]);
+    ltask_sched = sched;
+    ltask_deque = &sched->deques[id + 1];
+
+    while(1)
+    {
+        lfuture* task = lsched_find(sched, ltask_deque);
+        if(task != NULL)
+        {
+            lsched_run(sched, task);
+            continue;
+        }
+
+        pthread_mutex_lock(&sched->lock);
+        __atomic_add_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+        while(!sched->shutdown && __atomic_load_n(&sched->queued, __ATOMIC_SEQ_CST) <= 0)
+            pthread_cond_wait(&sched->wake, &sched->lock);
+        __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+        int stop = sched->shutdown;
+        pthread_mutex_unlock(&sched->lock);
+
+        if(stop)
+            break;
+    }
+
+    return NULL;
+}
+
+/*
+ * lsched_add_worker()
+ * Start one more worker. Called with the lock held, so the new
+ * worker cannot look for its slot until num_workers is up to date.
+ */
+static int lsched_add_worker(lsched* sched)
+{
+    int i = sched->num_workers;
+
+    if(i >= LSCHED_MAX_WORKERS)
+        return -1;
+
+    lheap_init(&sched->heaps[i], sched->owner);
+    ldeque_init(&sched->deques[i + 1]);
+    if(pthread_create(&sched->workers[i], NULL, lsched_worker, sched) != 0)
+    {
+        fprintf(stderr, "[%s] failed to start worker %d\n", __func__, i);
+        lheap_destroy(&sched->heaps[i]);
+        ldeque_destroy(&sched->deques[i + 1]);
+        return -1;
+    }
+    // thieves may read the new deque from here on
+    __atomic_store_n(&sched->num_workers, i + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/*
+ * lsched_new()
+ */
+lsched* lsched_new(int num_threads, lheap* owner)
+{
+    lsched* sched = malloc(sizeof(*sched));
+    if(!sched)
+    {
+        fprintf(stderr, "[%s] failed to allocate %ld bytes for scheduler\n", __func__, sizeof(*sched));
+        return NULL;
+    }
+
+    // room for every worker up front, so that workers started later
+    // never move a deque that another thread is stealing from
+    sched->num_workers = 0;
+    sched->workers     = malloc(sizeof(pthread_t) * LSCHED_MAX_WORKERS);
+    sched->heaps       = malloc(sizeof(lheap) * LSCHED_MAX_WORKERS);
+    sched->deques      = malloc(sizeof(ldeque) * (LSCHED_MAX_WORKERS + 1));
+    sched->owner       = owner;
+    sched->sleepers    = 0;
+    sched->blocked     = 0;
+    sched->queued      = 0;
+    sched->pending     = 0;
+    sched->speculate   = 0;
+    sched->closing     = 0;
+    sched->shutdown    = 0;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->wake, NULL);
+    ldeque_init(&sched->deques[0]);
+
+    pthread_mutex_lock(&sched->lock);
+    for(int i = 1; i < num_threads; ++i)
+    {
+        if(lsched_add_worker(sched) != 0)
+            break;
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    return sched;
+}
+
+/*
+ * lsched_del()
+ */
+void lsched_del(lsched* sched)
+{
+    __atomic_store_n(&sched->closing, 1, __ATOMIC_RELEASE);
+    lsched_help(sched, &sched->deques[0], NULL);
+
+    pthread_mutex_lock(&sched->lock);
+    sched->shutdown = 1;
+    pthread_cond_broadcast(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+
+    for(int i = 0; i < sched->num_workers; ++i)
+    {
+        pthread_join(sched->workers[i], NULL);
+        lheap_destroy(&sched->heaps[i]);
+        ldeque_destroy(&sched->deques[i + 1]);
+    }
+    ldeque_destroy(&sched->deques[0]);
+
+    pthread_cond_destroy(&sched->wake);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->workers);
+    free(sched->heaps);
+    free(sched->deques);
+    free(sched);
+}
+
+/*
+ * ltask_here()
+ * The scheduler and deque of the calling thread. Workers use their
+ * own deque and the owner of the current context uses deque 0.
+ * Sets both to NULL on threads with neither.
+ */
+static void ltask_here(lsched** sched, ldeque** dq)
+{
+    lispy_ctx* ctx = lispy_ctx_current();
+
+    if(ltask_sched != NULL)
+    {
+        *sched = ltask_sched;
+        *dq    = ltask_deque;
+    }
+    else if(ctx != NULL)
+    {
+        *sched = lispy_ctx_sched(ctx);
+        *dq    = &(*sched)->deques[0];
+    }
+    else
+    {
+        *sched = NULL;
+        *dq    = NULL;
+    }
+}
+
+/*
+ * ltask_block()
+ */
+void ltask_block(int blocked)
+{
+    if(ltask_sched != NULL)
+        __atomic_add_fetch(&ltask_sched->blocked, blocked ? 1 : -1, __ATOMIC_SEQ_CST);
+}
+
+/*
+ * ltask_unstall()
+ */
+void ltask_unstall(void)
+{
+    lispy_ctx* ctx = lispy_ctx_current();
+    lsched* sched = ltask_sched;
+
+    if(sched == NULL)
+        sched = (ctx != NULL) ? ctx->sched : NULL;
+    if(sched == NULL || __atomic_load_n(&sched->queued, __ATOMIC_SEQ_CST) <= 0)
+        return;
+
+    // idle workers are asleep, not blocked, and the push woke them
+    pthread_mutex_lock(&sched->lock);
+    if(!sched->shutdown && sched->num_workers - __atomic_load_n(&sched->blocked, __ATOMIC_SEQ_CST) <= 0)
+        lsched_add_worker(sched);
+    pthread_mutex_unlock(&sched->lock);
+}
+
+/*
+ * ltask_stuck()
+ * The owner does not count itself in blocked, so it adds itself
+ * while it is the one waiting.
+ */
+int ltask_stuck(long* moves, long* since)
+{
+    lispy_ctx* ctx = lispy_ctx_current();
+    lsched* sched = ltask_sched;
+    int self = 0;
+
+    if(sched == NULL && ltask_active() && ctx != NULL)
+    {
+        sched = ctx->sched;
+        self = 1;
+    }
+    if(sched == NULL || !__atomic_load_n(&sched->closing, __ATOMIC_ACQUIRE))
+        return 0;
+
+    long now = lsched_now();
+    long m = lchan_moves();
+    if(m != *moves || __atomic_load_n(&sched->queued, __ATOMIC_SEQ_CST) > 0 ||
+       __atomic_load_n(&sched->blocked, __ATOMIC_SEQ_CST) + self < __atomic_load_n(&sched->pending, __ATOMIC_SEQ_CST))
+    {
+        *moves = m;
+        *since = now;
+        return 0;
+    }
+
+    return now - *since >= LSCHED_STUCK_NS;
+}
+
+/*
+ * ltask_current()
+ */
+lsched* ltask_current(void)
+{
+    return ltask_sched;
+}
+
+/*
+ * ltask_active()
+ */
+int ltask_active(void)
+{
+    return ltask_depth > 0;
+}
+
+/*
+ * ltask_quiet()
+ */
+int ltask_quiet(void)
+{
+    lispy_ctx* ctx = lispy_ctx_current();
+
+    if(ltask_sched != NULL || lpool_active())
+        return 0;
+    if(ctx == NULL || ctx->sched == NULL)
+        return 1;
+
+    return __atomic_load_n(&ctx->sched->pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+/*
+ * ltask_spawn()
+ */
+lfuture* ltask_spawn(lval* expr, lenv* env)
+{
+    lfuture* fut = lfuture_new(expr, env);
+    lsched* sched;
+    ldeque* dq;
+
+    ltask_here(&sched, &dq);
+    fut->sched = sched;
+    if(sched == NULL)
+        ltask_run(fut);
+    else
+    {
+        // the scheduler holds a reference until the task has run
+        lfuture_retain(fut);
+        lsched_push(sched, dq, fut);
+    }
+
+    return fut;
+}
+
+/*
+ * ltask_await()
+ */
+lval* ltask_await(lfuture* fut)
+{
+    if(!lfuture_done(fut) && fut->sched == NULL)
+    {
+        // the only unscheduled futures that are not done are fibers
+        if(lfiber_await(fut) != 0)
+            return lval_err("[%s] Function 'await': the fiber behind this future cannot finish here", __func__);
+    }
+    else if(!lfuture_done(fut))
+    {
+        lsched* sched;
+        ldeque* dq;
+        ltask_here(&sched, &dq);
+        if(sched != fut->sched)
+        {
+            // not a thread of this scheduler, it can only steal
+            sched = fut->sched;
+            dq    = NULL;
+        }
+        if(lsched_help(sched, dq, fut) != 0)
+            return lbudget_timed_out();
+    }
+
+    return lval_copy(fut->result);
+}
+
+/*
+ * ltask_busy()
+ */
+int ltask_busy(void)
+{
+    lsched* sched;
+    ldeque* dq;
+
+    ltask_here(&sched, &dq);
+    if(sched == NULL)
+        return 1;
+
+    int workers = __atomic_load_n(&sched->num_workers, __ATOMIC_ACQUIRE);
+    return workers == 0 || __atomic_load_n(&sched->queued, __ATOMIC_RELAXED) >= workers;
+}
+
+
+// ======== BUILTINS ======== //
+
+/*
+ * builtin_spawn()
+ * (spawn {expr}) -> future of (eval {expr})
+ * Threads that are not part of a context (such as pmap workers) run
+ * the task straight away.
+ */
+lval* builtin_spawn(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("spawn", val, 1);
+    LVAL_ASSERT_TYPE("spawn", val, 0, LVAL_QEXPR);
+
+    return lval_future(ltask_spawn(lval_take(val, 0), env));
+}
+
+/*
+ * builtin_await()
+ * (await f) -> the result of the task behind future f
+ * Runs other tasks while it waits.
+ */
+lval* builtin_await(lenv* env, lval* val)
+{
+    LVAL_ASSERT_NUM("await", val, 1);
+    LVAL_ASSERT_TYPE("await", val, 0, LVAL_FUTURE);
+
+    lval* x = ltask_await(val->cell[0]->future);
+    lval_del(val);
+
+    return x;
+}
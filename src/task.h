@@ -0,0 +1,169 @@
+/*
+ * TASK
+ * Lightweight tasks (spawn/await) on a work-stealing scheduler
+ */
+
+#ifndef __BYOL_TASK_H
+#define __BYOL_TASK_H
+
+#include <pthread.h>
+#include "lval.h"
+
+/*
+ * FUTURE
+ * A spawned task and, once it has run, its result. Shared by the
+ * scheduler and every LVAL_FUTURE that refers to it.
+ */
+struct lfuture
+{
+    struct lsched* sched;   // NULL unless run by a scheduler
+    lval*   expr;       // cleared once the task has run
+    lenv*   frame;
+    lval*   result;
+    int     done;
+    int     refs;
+};
+
+/*
+ * DEQUE
+ * Chase-Lev work-stealing deque. The owning thread pushes and takes
+ * at the bottom, any other thread steals from the top.
+ */
+typedef struct ldeque_buf
+{
+    long                size;   // power of two
+    lfuture**           tasks;
+    struct ldeque_buf*  prev;   // retired buffers, freed with the deque
+} ldeque_buf;
+
+typedef struct ldeque
+{
+    long        top;
+    long        bottom;
+    ldeque_buf* buf;
+} ldeque;
+
+/*
+ * SCHEDULER
+ * Each interpreter context starts its scheduler the first time a
+ * task is spawned (see lispy_ctx_sched()). Deque 0 belongs to the
+ * thread that owns the context, which runs tasks while it awaits.
+ * There is one worker per core to begin with, and more are started
+ * when every worker is blocked on a channel (see ltask_unstall()).
+ */
+#define LSCHED_MAX_WORKERS 256
+// how long tasks blocked on channels wait for one to move once the
+// scheduler is being freed
+#define LSCHED_STUCK_NS    20000000L
+
+typedef struct lsched
+{
+    int             num_workers;    // grows when workers block
+    pthread_t*      workers;
+    lheap*          heaps;      // one per worker
+    ldeque*         deques;     // num_workers + 1
+    lheap*          owner;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    int             sleepers;
+    int             blocked;    // workers in ltask_block()
+    long            queued;     // pushed and not yet taken
+    long            pending;    // spawned and not yet finished
+    long            speculate;  // see spec.h
+    int             closing;    // lsched_del() has started
+    int             shutdown;
+} lsched;
+
+/*
+ * lsched_new()
+ * Start a scheduler with num_threads threads (including the
+ * owner). Worker heaps share the symbol table of owner.
+ */
+lsched* lsched_new(int num_threads, lheap* owner);
+/*
+ * lsched_del()
+ * Run every task still pending, then stop the workers. Once every
+ * task left is blocked on a channel and no channel has moved for
+ * LSCHED_STUCK_NS, their waits fail so that they can finish.
+ */
+void    lsched_del(lsched* sched);
+
+/*
+ * lfuture_new()
+ * A future that will evaluate expr (a Q-Expression, which it takes)
+ * in a capture of env. It holds one reference.
+ */
+lfuture* lfuture_new(lval* expr, lenv* env);
+/*
+ * lfuture_run()
+ * Evaluate the expression of fut on the calling thread and publish
+ * the result.
+ */
+void    lfuture_run(lfuture* fut);
+void    lfuture_retain(lfuture* fut);
+void    lfuture_release(lfuture* fut);
+int     lfuture_done(lfuture* fut);
+
+/*
+ * ltask_spawn()
+ * Queue expr (a Q-Expression, which it takes) as a task on the
+ * scheduler of the calling thread, or run it straight away if there
+ * is none. The caller holds one reference on the future.
+ */
+lfuture* ltask_spawn(lval* expr, lenv* env);
+/*
+ * ltask_await()
+ * A copy of the result of fut, running other tasks (or fibers) until
+ * it is done.
+ */
+lval*   ltask_await(lfuture* fut);
+/*
+ * ltask_busy()
+ * Non-zero if a task spawned now would not run any sooner than on
+ * the calling thread: there is no scheduler or there are already as
+ * many tasks queued as there are workers.
+ */
+int     ltask_busy(void);
+/*
+ * ltask_block()
+ * Mark the calling worker as blocked (blocked != 0) or running
+ * again. A blocked worker is waiting on something another task may
+ * have to do, such as a send on a channel.
+ */
+void    ltask_block(int blocked);
+/*
+ * ltask_unstall()
+ * If tasks are queued and every worker is blocked, start another
+ * worker so that the tasks can run. Blocking waits call this while
+ * they wait, because running the tasks themselves would bury the
+ * wait under a task that may be waiting on it in turn.
+ */
+void    ltask_unstall(void);
+/*
+ * ltask_stuck()
+ * Non-zero if the calling task should stop waiting on a channel: its
+ * scheduler is being freed, every pending task is blocked, and no
+ * channel has moved for LSCHED_STUCK_NS. moves and since belong to
+ * the wait and start out as -1 and 0.
+ */
+int     ltask_stuck(long* moves, long* since);
+/*
+ * ltask_current()
+ * The scheduler the calling worker belongs to, or NULL on threads
+ * that are not workers
+ */
+lsched* ltask_current(void);
+/*
+ * ltask_active()
+ * Non-zero while the calling thread is running a task
+ */
+int     ltask_active(void);
+/*
+ * ltask_quiet()
+ * Non-zero if the calling thread owns its context and no task of
+ * the context is running or queued, so no other thread can be
+ * reading the global scope.
+ */
+int     ltask_quiet(void);
+
+#endif /*__BYOL_TASK_H*/
@@ -0,0 +1,245 @@
+/*
+ * TRACE
+ * Chrome trace events
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+typedef struct
+{
+    const char* name;
+    long        ts;         // ns since ltrace_start()
+    long        dur;        // ns, or lvals in use for LTRACE_MEMORY
+    long        arg;
+    int         cat;
+} ltrace_event;
+
+typedef struct
+{
+    const char* ptr;
+    char*       copy;
+} ltrace_name;
+
+/*
+ * RING
+ * The events of one thread. Only that thread writes it, head is
+ * published for ltrace_write() with a release store.
+ */
+typedef struct ltrace_ring
+{
+    int                 tid;
+    long                head;       // events ever recorded
+    ltrace_event*       events;
+    ltrace_name         names[LTRACE_NAMES];
+    struct ltrace_ring* next;
+} ltrace_ring;
+
+int ltrace_on = 0;
+
+static long             ltrace_epoch = 0;
+static ltrace_ring*     ltrace_rings = NULL;
+static int              ltrace_num_rings = 0;
+static pthread_mutex_t  ltrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread ltrace_ring* ltrace_here = NULL;
+
+static const char* ltrace_cat_str[] = {"call", "builtin", "parse", "eval", "memory"};
+
+
+/*
+ * ltrace_now()
+ */
+long ltrace_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * ltrace_start()
+ */
+void ltrace_start(void)
+{
+    ltrace_epoch = ltrace_now();
+    __atomic_store_n(&ltrace_on, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ltrace_stop()
+ */
+void ltrace_stop(void)
+{
+    __atomic_store_n(&ltrace_on, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * ltrace_ring_here()
+ * The ring of the calling thread, made on its first event. Rings
+ * outlive their threads so that they can be written at exit.
+ */
+static ltrace_ring* ltrace_ring_here(void)
+{
+    if(ltrace_here != NULL)
+        return ltrace_here;
+
+    ltrace_ring* r = calloc(1, sizeof(*r));
+    if(r != NULL)
+        r->events = malloc(sizeof(ltrace_event) * LTRACE_EVENTS);
+    if(r == NULL || r->events == NULL)
+    {
+        fprintf(stderr, "[%s] failed to allocate a trace buffer\n", __func__);
+        free(r);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ltrace_lock);
+    r->tid = ++ltrace_num_rings;
+    r->next = ltrace_rings;
+    ltrace_rings = r;
+    pthread_mutex_unlock(&ltrace_lock);
+    ltrace_here = r;
+
+    return r;
+}
+
+/*
+ * ltrace_copy_name()
+ * The copy of a call name. Names are interned, so copies are kept by
+ * address, and checked by text since the heap of a name may be gone
+ * and its address reused.
+ */
+static const char* ltrace_copy_name(ltrace_ring* r, const char* name)
+{
+    uintptr_t h = ((uintptr_t) name >> 3) * 0x9e3779b97f4a7c15u;
+
+    for(int i = 0; i < LTRACE_NAMES; ++i)
+    {
+        ltrace_name* n = &r->names[(h + i) & (LTRACE_NAMES - 1)];
+        if(n->ptr == NULL)
+        {
+            n->ptr  = name;
+            n->copy = strdup(name);
+            return n->copy;
+        }
+        if(n->ptr == name && strcmp(n->copy, name) == 0)
+            return n->copy;
+    }
+
+    return "?";
+}
+
+/*
+ * ltrace_record()
+ */
+static void ltrace_record(ltrace_cat cat, const char* name, long ts, long dur, long arg)
+{
+    ltrace_ring* r = ltrace_ring_here();
+    if(r == NULL)
+        return;
+
+    ltrace_event* e = &r->events[r->head & (LTRACE_EVENTS - 1)];
+    e->name = (cat == LTRACE_CALL || cat == LTRACE_BUILTIN) ? ltrace_copy_name(r, name) : name;
+    e->ts   = ts;
+    e->dur  = dur;
+    e->arg  = arg;
+    e->cat  = cat;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * ltrace_complete()
+ */
+void ltrace_complete(ltrace_cat cat, const char* name, long start, long end, long arg)
+{
+    ltrace_record(cat, (name != NULL) ? name : "?", start - ltrace_epoch, end - start, arg);
+}
+
+/*
+ * ltrace_memory()
+ */
+void ltrace_memory(long live, long made)
+{
+    ltrace_record(LTRACE_MEMORY, "lvals", ltrace_now() - ltrace_epoch, live, made);
+}
+
+/*
+ * ltrace_fputs()
+ * s as the inside of a JSON string
+ */
+static void ltrace_fputs(FILE* fp, const char* s)
+{
+    for(; *s; ++s)
+    {
+        if(*s == '"' || *s == '\\')
+            fputc('\\', fp);
+        if((unsigned char) *s < 0x20)
+            fprintf(fp, "\\u%04x", *s);
+        else
+            fputc(*s, fp);
+    }
+}
+
+/*
+ * ltrace_write()
+ */
+int ltrace_write(const char* path)
+{
+    FILE* fp = fopen(path, "w");
+    if(!fp)
+    {
+        fprintf(stderr, "[%s] failed to open file [%s]\n", __func__, path);
+        return -1;
+    }
+
+    int pid = getpid();
+    long dropped = 0;
+    int first = 1;
+
+    fprintf(fp, "{\"traceEvents\": [\n");
+    pthread_mutex_lock(&ltrace_lock);
+    for(ltrace_ring* r = ltrace_rings; r != NULL; r = r->next)
+    {
+        long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        long start = (head > LTRACE_EVENTS) ? head - LTRACE_EVENTS : 0;
+        dropped += start;
+
+        for(long i = start; i < head; ++i)
+        {
+            ltrace_event* e = &r->events[i & (LTRACE_EVENTS - 1)];
+            fprintf(fp, "%s{\"name\": \"", first ? "" : ",\n");
+            ltrace_fputs(fp, e->name);
+            if(e->cat == LTRACE_MEMORY)
+            {
+                fprintf(fp, "\", \"cat\": \"%s\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d, "
+                        "\"args\": {\"live\": %ld, \"made\": %ld}}",
+                        ltrace_cat_str[e->cat], e->ts / 1e3, pid, r->tid, e->dur, e->arg);
+            }
+            else
+            {
+                fprintf(fp, "\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": %d, \"tid\": %d",
+                        ltrace_cat_str[e->cat], e->ts / 1e3, e->dur / 1e3, pid, r->tid);
+                if(e->arg >= 0)
+                    fprintf(fp, ", \"args\": {\"lvals\": %ld}", e->arg);
+                fputc('}', fp);
+            }
+            first = 0;
+        }
+    }
+    pthread_mutex_unlock(&ltrace_lock);
+    fprintf(fp, "\n], \"displayTimeUnit\": \"ns\", \"otherData\": {\"dropped\": %ld}}\n", dropped);
+
+    if(dropped > 0)
+        fprintf(stderr, "[%s] %ld old events were dropped, the ring holds %d per thread\n",
+                __func__, dropped, LTRACE_EVENTS);
+
+    return (fclose(fp) == 0) ? 0 : -1;
+}
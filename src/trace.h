@@ -0,0 +1,68 @@
+/*
+ * TRACE
+ * Evaluation tracing in the Chrome trace-event format, which
+ * chrome://tracing and Perfetto read. While ltrace_on is set every
+ * call made by lval_eval_sexpr(), every parse and every top-level
+ * form evaluated through lispy_eval() is recorded with its start
+ * and duration, and after each top-level form a counter records the
+ * lvals in use and how many the form made, so allocation bursts
+ * show up as a track of their own.
+ *
+ * Each thread records into a ring of its own, without locks. A ring
+ * keeps the last LTRACE_EVENTS events of its thread, older ones are
+ * dropped and counted.
+ */
+
+#ifndef __BYOL_TRACE_H
+#define __BYOL_TRACE_H
+
+// events kept per thread, a power of two
+#define LTRACE_EVENTS       (1 << 17)
+// names of user functions remembered per thread, a power of two
+#define LTRACE_NAMES        1024
+
+typedef enum
+{
+    LTRACE_CALL,        // a lambda, by the name it was called by
+    LTRACE_BUILTIN,     // by the name it was called by, if any
+    LTRACE_PARSE,
+    LTRACE_EVAL,        // a top-level form
+    LTRACE_MEMORY       // counter, see ltrace_memory()
+} ltrace_cat;
+
+// set while tracing
+extern int ltrace_on;
+
+/*
+ * ltrace_start()
+ * Start tracing, from now on timestamps count from here.
+ */
+void ltrace_start(void);
+void ltrace_stop(void);
+/*
+ * ltrace_now()
+ * Monotonic nanoseconds
+ */
+long ltrace_now(void);
+/*
+ * ltrace_complete()
+ * Record an event from start to end (see ltrace_now()). Names of
+ * calls and builtins are copied, other names must be string
+ * constants.
+ * arg is shown with the event when not negative.
+ */
+void ltrace_complete(ltrace_cat cat, const char* name, long start, long end, long arg);
+/*
+ * ltrace_memory()
+ * Record the lvals in use and the lvals made by the last form.
+ */
+void ltrace_memory(long live, long made);
+/*
+ * ltrace_write()
+ * Write the events of every thread to path, oldest first. Returns
+ * 0, or -1 if the file cannot be written.
+ */
+int  ltrace_write(const char* path);
+
+
+#endif /*__BYOL_TRACE_H*/